@@ -28,9 +28,17 @@ typedef xbinheapidx xbinheap_handler;
 #define NoNode (xbinheapidx)-1
 #define XBINHEAP_MAX (uint32_t)(1<<0)
 #define XBINHEAP_MIN (uint32_t)(1<<1)
+/*
+ * Keep four children per node instead of two. The heap is half as deep and
+ * the keys of the children of a node share a cache line.
+ */
+#define XBINHEAP_4ARY (uint32_t)(1<<2)
 
+/*
+ * Keys are kept apart from the rest of the nodes, so that sifting compares
+ * packed keys. indexes maps a handler to the current position of its node.
+ */
 struct xbinheap_node {
-    xbinheapidx key;
     xbinheapidx value;
     xbinheapidx h;
 };
@@ -39,8 +47,11 @@ struct xbinheap {
     xbinheapidx size;
     xbinheapidx count;
     uint32_t flags;
-    xbinheapidx *indexes;
+    uint32_t shift;             /* log2 of the number of children */
+    xbinheapidx *keys;
     struct xbinheap_node *nodes;
+    xbinheapidx *indexes;
+    void *alloc;                /* allocated by xbinheap_init, if any */
 };
 
 xbinheap_handler xbinheap_insert(struct xbinheap *h, xbinheapidx key,
@@ -53,6 +64,9 @@ int xbinheap_increasekey(struct xbinheap *h, xbinheap_handler idx,
 int xbinheap_decreasekey(struct xbinheap *h, xbinheap_handler idx,
                          xbinheapidx newkey);
 xbinheapidx xbinheap_getkey(struct xbinheap *h, xbinheap_handler idx);
+int xbinheap_build(struct xbinheap *h, xbinheapidx *keys,
+                   xbinheapidx *values, xbinheapidx n,
+                   xbinheap_handler *handlers);
 int xbinheap_init(struct xbinheap *h, xbinheapidx size, uint32_t flags,
                   void *mem);
 void xbinheap_free(struct xbinheap *h);
@@ -30,14 +30,38 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define XCACHE_LRU_ARRAY      (1<<0)
 #define XCACHE_LRU_HEAP       (1<<1)
 #define XCACHE_USE_RMTABLE    (1<<2)
+#define XCACHE_LRU_LIST       (1<<3)
+#define XCACHE_LRU_CLOCK      (1<<4)
+#define XCACHE_LRU_TINYLFU    (1<<5)
+#define XCACHE_LOCKFREE_LOOKUP (1<<6)
+#define XCACHE_USE_FILTER     (1<<7)
 
 #define XCACHE_LRU_MAX   (uint64_t)(-1)
 
+/* names that xcache_lookup_many hashes and prefetches at once */
+#define XCACHE_LOOKUP_BATCH 16
+
+/* threads at a time that can take the lock-free lookup path, the rest lock */
+#define XCACHE_MAX_READERS 128
+
 typedef xqindex xcache_handler;
 #define NoEntry (xcache_handler)Noneidx
 
 #define NODE_ACTIVE 0
 #define NODE_EVICTED 1
+#define NODE_REMOVED 2          /* invalidated while in "rm_entries" */
+
+/*
+ * Lists of cache nodes kept by the list based policies. XCACHE_LRU_LIST and
+ * XCACHE_LRU_CLOCK use only the first one. XCACHE_LRU_TINYLFU uses it as its
+ * admission window, in front of a segmented LRU of probation and protected
+ * entries.
+ */
+#define XCACHE_LIST_WINDOW    0
+#define XCACHE_LIST_PROBATION 1
+#define XCACHE_LIST_PROTECTED 2
+#define XCACHE_NR_LISTS       3
+#define XCACHE_LIST_NONE      XCACHE_NR_LISTS
 
 /*
  * Called with out cache lock held:
@@ -81,30 +105,112 @@ struct xcache_ops {
     void *(*on_node_init) (void *cache_data, void *data_handler);
 };
 
-/* FIXME: Does xcache_entry need lock? */
+/*
+ * Cache nodes are kept in a dense array, so the fields used on every lookup
+ * come first and names live out of line, in the names arena of their shard.
+ */
 struct xcache_entry {
-    struct xlock lock;
     volatile uint32_t ref;
     uint32_t state;
-    char name[XSEG_MAX_TARGETLEN + 1];
     xbinheap_handler h;
+    xhashidx hash;
     void *priv;
+    char *name;
+    uint64_t cost;              /* weight of the entry, 1 unless declared */
+    xqindex lru_prev;           /* list policy links */
+    xqindex lru_next;
+    uint32_t list;
+    uint32_t referenced;        /* XCACHE_LRU_CLOCK reference bit */
+    /* FIXME: Does xcache_entry need lock? */
+    struct xlock lock;
 };
 
-struct xcache {
+struct xcache_list {
+    xqindex head;               /* most recently used */
+    xqindex tail;               /* least recently used */
+    uint32_t count;
+};
+
+/*
+ * Each name takes a slot of the smallest size class that fits it. Slots are
+ * carved out of chunks that are returned to the system only by xcache_free,
+ * so a lock-free reader can always dereference a name, even a stale one.
+ */
+#define XCACHE_NAME_CLASSES 4
+#define XCACHE_NAME_CHUNK   (16 * 1024)
+
+struct xcache_names {
     struct xlock lock;
+    void *chunks;               /* allocated chunks, linked by their head */
+    char *next;                 /* unused space of the last chunk */
+    char *end;
+    void *free[XCACHE_NAME_CLASSES];    /* free slots of each class */
+};
+
+/*
+ * Counting Bloom filter of the names indexed by a table. It is probed before
+ * the table, without any lock, so that most misses cost neither a lock nor a
+ * string compare. Counters stick once they saturate.
+ */
+#define XCACHE_FILTER_HASHES 3
+
+struct xcache_filter {
+    volatile uint8_t *counters;
+    uint32_t mask;
+};
+
+/*
+ * A cache shard owns a contiguous range of cache nodes, together with the
+ * tables, lock and LRU state that index them. Entries are assigned to shards
+ * by the hash of their name, so operations on different shards never contend.
+ */
+struct xcache_shard {
+    struct xlock lock;
+    volatile uint32_t seq;      /* odd while entries is being modified */
     uint32_t size;
-    uint32_t nr_nodes;
+    uint32_t first_node;
     struct xq free_nodes;
     xhash_t *entries;
     xhash_t *rm_entries;
     struct xlock rm_lock;
-    struct xcache_entry *nodes;
+    struct xcache_filter entries_filter;        /* XCACHE_USE_FILTER */
+    struct xcache_filter rm_filter;
     uint64_t time;
-    uint64_t *times;
+    uint64_t weight;            /* sum of the costs of "entries" */
+    uint64_t max_weight;        /* zero for no weight limit */
     struct xbinheap binheap;
+    struct xcache_list lists[XCACHE_NR_LISTS];
+    uint32_t window_size;       /* XCACHE_LRU_TINYLFU segment sizes */
+    uint32_t protected_size;
+    uint64_t *sketch;           /* XCACHE_LRU_TINYLFU frequency sketch */
+    uint32_t sketch_mask;
+    uint32_t sketch_samples;
+    struct xcache_names names;
+};
+
+/*
+ * Per thread epoch of XCACHE_LOCKFREE_LOOKUP readers, zero when outside a
+ * lookup. Each one sits in its own cache line.
+ */
+struct xcache_reader {
+    volatile uint64_t epoch;
+    char pad[56];
+};
+
+struct xcache {
+    uint32_t size;
+    uint32_t nr_nodes;
+    uint32_t nr_shards;
+    uint32_t shard_shift;       /* log2 of nodes per shard */
+    uint64_t max_weight;
+    struct xcache_shard *shards;
+    struct xcache_entry *nodes;
+    uint64_t *times;
+    volatile uint64_t epoch;
+    struct xcache_reader *readers;
     struct xcache_ops ops;
     uint32_t flags;
+    uint64_t id;                /* unique among the caches of the process */
     void *priv;
 };
 
@@ -145,16 +251,28 @@ static char *xcache_get_name(struct xcache *cache, xcache_handler h)
 
 int xcache_init(struct xcache *cache, uint32_t xcache_size,
                 struct xcache_ops *ops, uint32_t flags, void *priv);
+int xcache_init_shards(struct xcache *cache, uint32_t xcache_size,
+                       uint32_t nr_shards, struct xcache_ops *ops,
+                       uint32_t flags, void *priv);
+int xcache_init_weighted(struct xcache *cache, uint32_t xcache_size,
+                         uint64_t max_weight, uint32_t nr_shards,
+                         struct xcache_ops *ops, uint32_t flags, void *priv);
 void xcache_close(struct xcache *cache);
 void xcache_free(struct xcache *cache);
 xcache_handler xcache_lookup(struct xcache *cache, char *name);
+uint32_t xcache_lookup_many(struct xcache *cache, char **names, uint32_t n,
+                            xcache_handler * handlers);
 xcache_handler xcache_alloc_init(struct xcache *cache, char *name);
 xcache_handler xcache_insert(struct xcache *cache, xcache_handler h);
+xcache_handler xcache_insert_weighted(struct xcache *cache, xcache_handler h,
+                                      uint64_t cost);
 int xcache_remove(struct xcache *cache, xcache_handler h);
 int xcache_invalidate(struct xcache *cache, char *name);
 void xcache_put(struct xcache *cache, xcache_handler h);
 void xcache_get(struct xcache *cache, xcache_handler h);
 uint64_t xcache_free_nodes(struct xcache *cache);
+uint64_t xcache_weight(struct xcache *cache);
+uint64_t xcache_max_weight(struct xcache *cache);
 void xcache_free_new(struct xcache *cache, xcache_handler h);
 
 #ifdef __cplusplus
@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __XEXEC_H
+#define __XEXEC_H
+
+#include <pthread.h>
+#include <xseg/util.h>
+#include <xseg/xlock.h>
+#include <xseg/xworkq.h>
+
+/*
+ * An executor runs the works of xworkqs on a pool of worker threads. An
+ * xworkq with pending works is ready, and is held by exactly one worker until
+ * it has run them, so works of the same xworkq still run one at a time and in
+ * order, while works of different xworkqs run in parallel.
+ *
+ * Each worker keeps the ready xworkqs in a Chase-Lev deque. It pushes and pops
+ * at the bottom, so that an xworkq made ready by a job runs next on the same
+ * thread, and idle workers steal from the top of the others. Threads that are
+ * not workers of the executor make xworkqs ready through a shared deque that
+ * they push to under a lock.
+ */
+
+/* spins of an idle worker looking for work before it sleeps */
+#define XEXEC_IDLE_SPINS 64
+
+struct xexec_array {
+    long size;
+    struct xexec_array *prev;   /* replaced arrays, freed on destroy */
+    struct xworkq *queues[];
+};
+
+struct xexec_deque {
+    volatile long top;
+    volatile long bottom;
+    struct xexec_array *volatile array;
+};
+
+struct xexec;
+
+struct xexec_worker {
+    struct xexec_deque deque;
+    struct xexec *ex;
+    pthread_t thread;
+    unsigned long seed;
+};
+
+struct xexec {
+    struct xexec_worker *workers;
+    uint32_t nr_workers;
+    struct xexec_deque inject;
+    struct xlock inject_lock;
+    volatile uint32_t sleepers;
+    volatile uint32_t stop;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+};
+
+int xexec_init(struct xexec *ex, uint32_t nr_workers);
+int xexec_enqueue(struct xexec *ex, struct xworkq *wq,
+                  void (*job_fn) (void *q, void *arg), void *job);
+int xexec_enqueue_work(struct xexec *ex, struct xworkq *wq, struct work *w);
+void xexec_destroy(struct xexec *ex);
+
+#endif                          /* __XEXEC_H */
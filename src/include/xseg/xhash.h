@@ -48,6 +48,12 @@ enum xhash_type {
 };
 #define NR_XHASH_TYPES 2
 
+/* xhash flags */
+/* Swiss table layout. Every slot has a control byte holding 7 bits of the
+ * key's hash, and lookups compare the control bytes of 16 slots at once.
+ */
+#define XHASH_SWISS (1 << 0)
+
 struct xhash {
     xhashidx size_shift;
     xhashidx minsize_shift;
@@ -56,6 +62,7 @@ struct xhash {
     xhashidx defval;
     xhashidx limit;
     enum xhash_type type;
+    uint32_t flags;
 #ifdef PHASH_STATS
     xhashidx inserts;
     xhashidx deletes;
@@ -63,12 +70,21 @@ struct xhash {
     xhashidx bounces;
 #endif
      XPTR_TYPE(xhashidx) kvs;
+    /* table drained by an incremental resize, none if it points to self */
+     XPTR_TYPE(struct xhash) old;
+    xhashidx migrate_idx;       /* next slot of old to migrate */
 };
 typedef struct xhash xhash_t;
 
+static inline xhash_t *xhash_old(xhash_t * xhash)
+{
+    return xhash->old.x ? XPTR(&xhash->old) : NULL;
+}
+
 static inline xhashidx xhash_elements(xhash_t * xhash)
 {
-    return xhash->used;
+    xhash_t *old = xhash_old(xhash);
+    return xhash->used + (old ? old->used : 0);
 }
 
 static inline xhashidx xhash_size(xhash_t * xhash)
@@ -114,20 +130,51 @@ static inline xhashidx *xhash_vals(xhash_t * xhash)
 xhashidx xhash_grow_size_shift(xhash_t * xhash);
 xhashidx xhash_shrink_size_shift(xhash_t * xhash);
 ssize_t xhash_get_alloc_size(xhashidx size_shift);
+ssize_t xhash_get_alloc_size_flags(xhashidx size_shift, uint32_t flags);
 
 xhash_t *xhash_new(xhashidx minsize_shift, xhashidx limit,
                    enum xhash_type type);
 void xhash_free(xhash_t * xhash);       // pairs with _new()
 void xhash_init(struct xhash *xhash, xhashidx minsize_shift, xhashidx limit,
                 enum xhash_type type);
+xhash_t *xhash_new_flags(xhashidx minsize_shift, xhashidx limit,
+                         enum xhash_type type, uint32_t flags);
+void xhash_init_flags(struct xhash *xhash, xhashidx minsize_shift,
+                      xhashidx limit, enum xhash_type type, uint32_t flags);
 
 xhash_t *xhash_resize(xhash_t * xhash, xhashidx new_size_shift,
                       xhashidx newlimit, xhash_t * newxhash);
+
+/*
+ * Incremental resizing.
+ *
+ * xhash_resize_incremental() initializes newxhash (or allocates it, if NULL)
+ * and links xhash to it, instead of copying all of its items. newxhash takes
+ * the place of xhash, and each insertion or deletion on it migrates a few
+ * slots of xhash, while lookups consult both tables.
+ *
+ * Once drained, xhash is returned (and unlinked) by xhash_reclaim(), to be
+ * freed by the caller. It must be reclaimed before newxhash is resized
+ * again, so callers should try to reclaim after every insertion or deletion,
+ * and before handling -XHASH_ERESIZE.
+ */
+xhash_t *xhash_resize_incremental(xhash_t * xhash, xhashidx new_size_shift,
+                                  xhashidx newlimit, xhash_t * newxhash);
+xhash_t *xhash_reclaim(xhash_t * xhash);
 int xhash_insert(xhash_t * xhash, xhashidx key, xhashidx val);
 int xhash_update(xhash_t * xhash, xhashidx key, xhashidx val);
 int xhash_freql_update(xhash_t * xhash, xhashidx key, xhashidx val);
 int xhash_delete(struct xhash *xhash, xhashidx key);
+/* delete without checking if the table should shrink first */
+int xhash_delete_noshrink(struct xhash *xhash, xhashidx key);
 int xhash_lookup(xhash_t * xhash, xhashidx key, xhashidx * val);
+/* The hash of a key can be computed once with xhash_hash, and used for
+ * lookups on any table of the same key type.
+ */
+xhashidx xhash_hash(enum xhash_type type, xhashidx key);
+int xhash_lookup_hash(xhash_t * xhash, xhashidx key, xhashidx hash,
+                      xhashidx * val);
+void xhash_prefetch(xhash_t * xhash, xhashidx hash);
 
 struct xhash_iter {
     xhashidx loc;               /* location on the array */
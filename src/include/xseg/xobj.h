@@ -46,6 +46,8 @@ struct xobject_h {
     uint64_t allocated_space;
     xptr list;
     uint64_t nr_free;
+    uint64_t trim_ratio;
+    uint64_t trim_mark;
 };
 
 struct xobject_iter {
@@ -60,6 +62,18 @@ void xobj_put_obj(struct xobject_h *obj_h, void *ptr);
 int xobj_alloc_obj(struct xobject_h *obj_h, uint64_t nr);
 int xobj_handler_init(struct xobject_h *obj_h, void *container,
                       uint32_t magic, uint64_t size, struct xheap *heap);
+void xobj_handler_destroy(struct xobject_h *obj_h);
+
+/* Release fully free chunks back to the heap.
+ * Returns the number of chunks released.
+ */
+int xobj_trim(struct xobject_h *obj_h);
+int __xobj_trim(struct xobject_h *obj_h);
+
+/* Trim automatically on put, when more than ratio percent of the allocated
+ * objects are free. A ratio of zero disables automatic trimming.
+ */
+void xobj_set_trim_ratio(struct xobject_h *obj_h, uint64_t ratio);
 
 void xobj_iter_init(struct xobject_h *obj_h, struct xobject_iter *it);
 int xobj_iterate(struct xobject_h *obj_h, struct xobject_iter *it, void **obj);
@@ -69,10 +83,7 @@ int xobj_isFree(struct xobject_h *obj_h, void *obj);
 int __xobj_check(struct xobject_h *obj_h, void *obj);
 int __xobj_isFree(struct xobject_h *obj_h, void *obj);
 
-//TODO 
-//xobj_handler_destroy()
-//releases allocated pages
-//
+//TODO
 //maybe we need lock free versions of get/put obj
 //
 //also an
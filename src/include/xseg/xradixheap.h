@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __XRADIXHEAP_H
+#define __XRADIXHEAP_H
+
+#include <xseg/xtypes.h>
+#include <xseg/domain.h>
+#include <xseg/util.h>
+#include <xseg/xbinheap.h>
+
+/*
+ * A min radix heap, for keys that never drop below the last extracted one,
+ * such as access times or deadlines. Nodes are kept in buckets by the highest
+ * bit in which their key differs from the last extracted key, and only move to
+ * lower buckets until they are extracted. Insert and extract cost O(1)
+ * amortized when keys are close to each other.
+ *
+ * Buckets are arrays of keys and node indexes, so that finding the minimum of
+ * a bucket and spreading it to the lower ones are sequential scans. They grow
+ * on demand, so an insert or a key change may fail for lack of memory.
+ *
+ * Handlers are used as in xbinheap: they stay valid until their node is
+ * extracted or removed, and xbinheap_handler values can be used as is.
+ */
+typedef xbinheapidx xradixheapidx;
+typedef xbinheap_handler xradixheap_handler;
+
+#define XRADIXHEAP_BUCKETS 65
+
+struct xradixheap_entry {
+    xradixheapidx key;
+    xradixheapidx node;
+};
+
+struct xradixheap_bucket {
+    struct xradixheap_entry *entries;
+    xradixheapidx count;
+    xradixheapidx capacity;
+};
+
+struct xradixheap_node {
+    xradixheapidx value;
+    xradixheapidx pos;          /* in its bucket, or the next free node */
+    uint32_t bucket;
+};
+
+struct xradixheap {
+    xradixheapidx size;
+    xradixheapidx count;
+    xradixheapidx last;         /* the last extracted key */
+    uint64_t bitmap;            /* non empty buckets, but bucket 0 */
+    struct xradixheap_bucket buckets[XRADIXHEAP_BUCKETS];
+    xradixheapidx free;
+    struct xradixheap_node *nodes;
+    void *alloc;                /* allocated by xradixheap_init, if any */
+};
+
+xradixheap_handler xradixheap_insert(struct xradixheap *h, xradixheapidx key,
+                                     xradixheapidx value);
+int xradixheap_empty(struct xradixheap *h);
+xradixheapidx xradixheap_peak(struct xradixheap *h);
+xradixheapidx xradixheap_extract(struct xradixheap *h);
+int xradixheap_increasekey(struct xradixheap *h, xradixheap_handler idx,
+                           xradixheapidx newkey);
+int xradixheap_decreasekey(struct xradixheap *h, xradixheap_handler idx,
+                           xradixheapidx newkey);
+int xradixheap_remove(struct xradixheap *h, xradixheap_handler idx);
+xradixheapidx xradixheap_getkey(struct xradixheap *h, xradixheap_handler idx);
+int xradixheap_init(struct xradixheap *h, xradixheapidx size, void *mem);
+void xradixheap_free(struct xradixheap *h);
+
+#endif                          /* __XRADIXHEAP_H */
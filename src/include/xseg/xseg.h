@@ -30,6 +30,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xobj.h>
 #include <xseg/xhash.h>
 #include <xseg/xpool.h>
+#include <xseg/xwaitq.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -50,9 +51,11 @@ typedef uint32_t xport;
 #define XSEG_DEF_MAX_ALLOCATED_REQS 1024
 #endif
 
-/* hard limit on max allocated requests per port */
-//FIXME make this a dynamicly calculated value based
-//on heap_size and request_h->size
+/*
+ * upper bound of the defaults above. At runtime, max allocated requests per
+ * port are limited by the requests the heap can hold, see
+ * xseg_get_request_capacity.
+ */
 #ifndef	XSEG_MAX_ALLOCATED_REQS
 #define XSEG_MAX_ALLOCATED_REQS 10000
 #endif
@@ -65,6 +68,11 @@ typedef uint32_t xport;
 #error	"XSEG_DEF_REQS should me less than XSEG_MAX_ALLOCATED_REQS"
 #endif
 
+/* denied gets of a port that trigger a rebalance of the request quotas */
+#ifndef XSEG_QUOTA_MISSES
+#define XSEG_QUOTA_MISSES 16
+#endif
+
 #ifndef MAX_PATH_LEN
 #define MAX_PATH_LEN 32
 #endif
@@ -168,14 +176,22 @@ struct xseg_port {
     xptr free_queue;
     xptr request_queue;
     xptr reply_queue;
+    xptr free_drain;            /* replaced rings, emptied before the */
+    xptr request_drain;         /* current ones and then freed */
+    xptr reply_drain;
     uint64_t owner;
     uint64_t peer_type;
     uint32_t portno;
     uint64_t max_alloc_reqs;
     uint64_t alloc_reqs;
+    uint64_t denied_reqs;       /* gets over max_alloc_reqs, decayed */
     struct xlock port_lock;
     xptr signal_desc;
     uint32_t flags;
+    uint32_t window;            /* max requests in flight per source */
+    xptr inflight;              /* requests in flight, per source port */
+    volatile uint32_t free_seq; /* bumped when request slots may be free */
+    volatile uint32_t free_sleepers;
 };
 
 struct xseg_request;
@@ -224,6 +240,27 @@ struct xseg_task {
 #define CAN_ACCEPT   (1 << 0)
 #define CAN_RECEIVE  (1 << 1)
 
+/* PORT GROUP POLICIES */
+#define XSEG_GROUP_RR        0  /* round robin */
+#define XSEG_GROUP_SHORTEST  1  /* shortest request queue */
+#define XSEG_GROUP_P2C       2  /* shorter queue of two random members */
+
+#define XSEG_GROUP_MAX_MEMBERS 64
+
+/*
+ * A logical destination, whose requests are dispatched to one of its member
+ * ports. Membership is one bit per slot of ports, so that submitters see it
+ * change atomically.
+ */
+struct xseg_port_group {
+    struct xlock lock;          /* serializes membership changes */
+    volatile uint64_t members;
+    xport ports[XSEG_GROUP_MAX_MEMBERS];
+    uint32_t policy;
+    volatile uint32_t active;
+    volatile uint64_t cursor;
+};
+
 /* STATES */
 #define XS_SERVED	(1 << 0)
 #define XS_FAILED	(1 << 1)
@@ -267,8 +304,17 @@ struct xseg_shared {
     xptr *peer_type_data;
     uint32_t nr_peer_types;
     struct xlock segment_lock;
+    struct xlock quota_lock;
+    uint32_t quota_heap;        /* percent of the heap for requests */
+    uint32_t quota_fair;        /* percent of it split evenly */
+    xptr dynport_map;           /* one bit per dynport, set while free */
+    volatile uint32_t route_gen;        /* bumped when routes change */
+    volatile uint32_t heap_seq; /* bumped when heap space is freed */
+    volatile uint32_t heap_sleepers;
 };
 
+struct xseg_port_waitq;
+
 struct xseg_private {
     struct xseg_type segment_type;
     struct xseg_peer peer_type;
@@ -276,8 +322,10 @@ struct xseg_private {
     void **peer_type_data;
     uint32_t max_peer_types;
     void (*wakeup) (uint32_t portno);
-    xhash_t *req_data;
-    struct xlock reqdatalock;
+    void ***req_data;           /* pages of per request data */
+    uint64_t nr_req_data_pages;
+    struct xseg_port_waitq **port_waitqs;       /* made on first wait */
+    uint64_t **routes;          /* next hops per transit port and dst */
 };
 
 struct xseg_counters {
@@ -296,6 +344,7 @@ struct xseg {
     struct xobject_h *port_h;
     xptr *ports;
     xport *path_next, *dst_gw;
+    xptr *groups;               /* port groups, by destination */
 
     struct xseg_shared *shared;
     struct xseg_private *priv;
@@ -363,6 +412,18 @@ int xseg_put_request(struct xseg *xseg,
 int xseg_prep_request(struct xseg *xseg,
                       struct xseg_request *xreq,
                       uint32_t targetlen, uint64_t datalen);
+
+struct xseg_request *xseg_get_request_wait(struct xseg *xseg,
+                                           xport src_portno,
+                                           xport dst_portno, uint32_t flags,
+                                           uint32_t usec_timeout);
+
+int xseg_wait_request(struct xseg *xseg, xport portno, struct work *w);
+
+int xseg_prep_request_wait(struct xseg *xseg,
+                           struct xseg_request *xreq,
+                           uint32_t targetlen, uint64_t datalen,
+                           uint32_t usec_timeout);
 /*                    \___________________/                       \_________/ */
 /*                     ___________________                         _________  */
 /*                    /                   \                       /         \ */
@@ -436,8 +497,38 @@ void xseg_put_objh(struct xseg *xseg, struct xobject_h *objh);
 #define xseg_get_queue(__xseg, __port, __queue) \
 	((struct xq *) XPTR_TAKE(__port->__queue, __xseg->segment))
 
+/* the ring a port queue replaced, still to be emptied, or NULL */
+#define xseg_get_drain(__xseg, __port, __drain) \
+	((struct xq *) (__port->__drain ? \
+			XPTR_TAKE(__port->__drain, __xseg->segment) : NULL))
+
+static inline xqindex __xseg_queue_count(struct xseg *xseg, xptr queue,
+                                         xptr drain)
+{
+    xqindex nr = xq_count(XPTR_TAKE(queue, xseg->segment));
+
+    if (drain) {
+        nr += xq_count(XPTR_TAKE(drain, xseg->segment));
+    }
+    return nr;
+}
+
+/*
+ * Entries in a port queue, free, request or reply, including the ones left in
+ * its drain. Must be called with the queue lock held, since drained and
+ * replaced rings are freed under it.
+ */
+#define xseg_queue_count(__xseg, __port, __queue) \
+	__xseg_queue_count(__xseg, __port->__queue##_queue, \
+			   __port->__queue##_drain)
+
 
 int xseg_set_path_next(struct xseg *xseg, xport portno, xport next);
+int xseg_set_dst_gw(struct xseg *xseg, xport dst, xport gw);
+int xseg_create_group(struct xseg *xseg, xport group, uint32_t policy);
+int xseg_destroy_group(struct xseg *xseg, xport group);
+int xseg_join_group(struct xseg *xseg, xport group, xport portno);
+int xseg_leave_group(struct xseg *xseg, xport group, xport portno);
 
 int xseg_set_req_data(struct xseg *xseg, struct xseg_request *xreq,
                       void *data);
@@ -453,6 +544,14 @@ int xseg_resize_request(struct xseg *xseg, struct xseg_request *req,
 int xseg_set_max_requests(struct xseg *xseg, xport portno, uint64_t nr_reqs);
 uint64_t xseg_get_max_requests(struct xseg *xseg, xport portno);
 uint64_t xseg_get_allocated_requests(struct xseg *xseg, xport portno);
+uint64_t xseg_get_request_capacity(struct xseg *xseg);
+int xseg_set_request_quotas(struct xseg *xseg, uint32_t heap_pct,
+                            uint32_t fair_pct);
+int xseg_rebalance_requests(struct xseg *xseg);
+int xseg_set_window(struct xseg *xseg, xport portno, uint32_t window);
+uint32_t xseg_get_window(struct xseg *xseg, xport portno);
+uint32_t xseg_get_credits(struct xseg *xseg, xport src_portno,
+                          xport dst_portno);
 int xseg_set_freequeue_size(struct xseg *xseg, xport portno, xqindex size,
                             uint32_t flags);
 
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define _XQ_DOMAIN_H
 
 void *xtypes_malloc(unsigned long size);
+void *xtypes_realloc(void *ptr, unsigned long size);
 void xtypes_free(void *ptr);
 
 #endif
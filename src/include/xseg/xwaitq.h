@@ -23,18 +23,37 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #define XWAIT_SIGNAL_ONE (1 << 0)
 
+/* timeout of xwaitq_wait that never expires */
+#define XWAIT_FOREVER ((uint32_t) -1)
+
+/* works xwaitq_signal_n pops in one hold of the lock */
+#define XWAITQ_BATCH 16
+
+/*
+ * Besides works, whose job_fn is called once the condition holds, threads may
+ * block on an xwaitq with xwaitq_wait. Blocked threads sleep on a futex on
+ * seq, which signals bump when there are sleepers. An xwaitq is local to its
+ * process, as its queue and condition are. Whoever makes the condition true
+ * must signal the xwaitq afterwards.
+ */
 struct xwaitq {
     int (*cond_fn) (void *arg);
     void *cond_arg;
     uint32_t flags;
     struct xq *q;
     struct xlock lock;
+    volatile uint32_t seq;
+    volatile uint32_t sleepers;
 };
 
 int xwaitq_init(struct xwaitq *wq, int (*cond_fn) (void *arg), void *arg,
                 uint32_t flags);
 int xwaitq_enqueue(struct xwaitq *wq, struct work *w);
 void xwaitq_signal(struct xwaitq *wq);
+uint32_t xwaitq_signal_n(struct xwaitq *wq, uint32_t n);
+int xwaitq_wait(struct xwaitq *wq, uint32_t usec_timeout);
+int xwaitq_wait_cond(struct xwaitq *wq, int (*cond_fn) (void *arg), void *arg,
+                     uint32_t usec_timeout);
 void xwaitq_destroy(struct xwaitq *wq);
 
 
@@ -18,9 +18,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef __XWORK_H
 #define __XWORK_H
 
+#include <xseg/util.h>
+
+/* XWORK_POOLED: the work belongs to the pool of its xworkq */
+#define XWORK_POOLED (1 << 0)
+
 struct work {
     void *job;
     void (*job_fn) (void *q, void *arg);
+    struct work *next;          /* in an xworkq */
+    uint32_t flags;
 };
 
 #endif                          /* __XWORK_H */
@@ -21,16 +21,39 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xq.h>
 #include <xseg/xwork.h>
 
+/* works allocated at once when the pool of an xworkq runs out */
+#define XWORKQ_POOL_CHUNK 64
+
+struct xworkq_chunk {
+    struct xworkq_chunk *next;
+    struct work works[XWORKQ_POOL_CHUNK];
+};
+
+/*
+ * Pending works are kept in a list linked through the works themselves, and
+ * q_lock protects it along with the pool of free works. Works enqueued with
+ * xworkq_enqueue come from the pool, and go back to it after they run, so
+ * that a queue allocates only when its pool grows.
+ */
 struct xworkq {
     struct xlock q_lock;
     uint32_t flags;
-    struct xq *q;
+    struct work *head;
+    struct work *tail;
+    struct work *free;
+    struct xworkq_chunk *chunks;
     struct xlock *lock;
+    volatile uint32_t sched;    /* held ready by an xexec */
 };
 
 int xworkq_init(struct xworkq *wq, struct xlock *lock, uint32_t flags);
 int xworkq_enqueue(struct xworkq *wq, void (*job_fn) (void *q, void *arg),
                    void *job);
+int xworkq_enqueue_work(struct xworkq *wq, struct work *w);
+int xworkq_append(struct xworkq *wq, void (*job_fn) (void *q, void *arg),
+                  void *job);
+int xworkq_append_work(struct xworkq *wq, struct work *w);
+int xworkq_pending(struct xworkq *wq);
 void xworkq_signal(struct xworkq *wq);
 void xworkq_destroy(struct xworkq *wq);
 
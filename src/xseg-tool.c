@@ -1322,6 +1322,22 @@ int cmd_submit_reqs(long loops, long concurrent_reqs, int op)
     return 0;
 }
 
+/*
+ * Count a port queue, or return -1 if its lock is held, since its rings are
+ * freed under it and a stuck peer must not hang the report.
+ */
+static long long queue_count(struct xlock *lock, xptr * queue, xptr * drain)
+{
+    long long nr;
+
+    if (!xlock_try_lock(lock)) {
+        return -1;
+    }
+    nr = __xseg_queue_count(xseg, *queue, *drain);
+    xlock_release(lock);
+    return nr;
+}
+
 static void lock_status(struct xlock *lock, char *buf, int len)
 {
     int r;
@@ -1363,18 +1379,22 @@ int cmd_report(uint32_t portno)
     lock_status(&port->pq_lock, pls, 64);
     fprintf(stderr, "port %u (dynamic: %s):\n"
             "   requests: %llu/%llu  next: %u  dst gw: %u  owner:%llu\n"
-            "       free_queue [%p] count : %4llu | %s\n"
-            "    request_queue [%p] count : %4llu | %s\n"
-            "      reply_queue [%p] count : %4llu | %s\n",
+            "       free_queue [%p] count : %4lld | %s\n"
+            "    request_queue [%p] count : %4lld | %s\n"
+            "      reply_queue [%p] count : %4lld | %s\n",
             portno, dynamic,
             (unsigned long long) port->alloc_reqs,
             (unsigned long long) port->max_alloc_reqs,
             xseg->path_next[portno],
             xseg->dst_gw[portno],
             (unsigned long long) port->owner,
-            (void *) fq, (unsigned long long) xq_count(fq), fls,
-            (void *) rq, (unsigned long long) xq_count(rq), rls,
-            (void *) pq, (unsigned long long) xq_count(pq), pls);
+            (void *) fq,
+            queue_count(&port->fq_lock, &port->free_queue, &port->free_drain),
+            fls, (void *) rq,
+            queue_count(&port->rq_lock, &port->request_queue,
+                        &port->request_drain), rls, (void *) pq,
+            queue_count(&port->pq_lock, &port->reply_queue,
+                        &port->reply_drain), pls);
     return 0;
 }
 
@@ -1511,6 +1531,22 @@ int finish_req(struct xseg_request *req, enum req_action action)
     return 0;
 }
 
+/* whether a port queue, or the drain it left, holds req */
+static int in_port_queue(struct xlock *lock, xptr * queue, xptr * drain,
+                         struct xseg_request *req)
+{
+    xptr xqi = XPTR_MAKE(req, xseg->segment);
+    int r;
+
+    xlock_acquire(lock);
+    r = __xq_check(XPTR_TAKE(*queue, xseg->segment), xqi);
+    if (!r && *drain) {
+        r = __xq_check(XPTR_TAKE(*drain, xseg->segment), xqi);
+    }
+    xlock_release(lock);
+    return r;
+}
+
 //FIXME this should be in xseg lib?
 static int isDangling(struct xseg_request *req)
 {
@@ -1523,28 +1559,14 @@ static int isDangling(struct xseg_request *req)
                 fprintf(stderr, "Inconsisten port <-> portno mapping %u", i);
                 continue;
             }
-            struct xq *fq, *rq, *pq;
-            fq = xseg_get_queue(xseg, port, free_queue);
-            rq = xseg_get_queue(xseg, port, request_queue);
-            pq = xseg_get_queue(xseg, port, reply_queue);
-            xlock_acquire(&port->fq_lock);
-            if (__xq_check(fq, XPTR_MAKE(req, xseg->segment))) {
-                xlock_release(&port->fq_lock);
-                return 0;
-            }
-            xlock_release(&port->fq_lock);
-            xlock_acquire(&port->rq_lock);
-            if (__xq_check(rq, XPTR_MAKE(req, xseg->segment))) {
-                xlock_release(&port->rq_lock);
+            if (in_port_queue(&port->fq_lock, &port->free_queue,
+                              &port->free_drain, req) ||
+                in_port_queue(&port->rq_lock, &port->request_queue,
+                              &port->request_drain, req) ||
+                in_port_queue(&port->pq_lock, &port->reply_queue,
+                              &port->reply_drain, req)) {
                 return 0;
             }
-            xlock_release(&port->rq_lock);
-            xlock_acquire(&port->pq_lock);
-            if (__xq_check(pq, XPTR_MAKE(req, xseg->segment))) {
-                xlock_release(&port->pq_lock);
-                return 0;
-            }
-            xlock_release(&port->pq_lock);
         }
     }
     return 1;
@@ -1727,11 +1749,28 @@ int cmd_recoverport(long portno)
     return 0;
 }
 
+/* report the requests of q, leaving it as it was. Called with its lock held */
+static xqindex report_queue(struct xq *q)
+{
+    xqindex i, c = xq_count(q);
+    struct xseg_request *req;
+    xptr xqi;
+
+    for (i = 0; i < c; i++) {
+        xqi = __xq_pop_head(q);
+        req = XPTR_TAKE(xqi, xseg->segment);
+        report_request(req);
+        __xq_append_tail(q, xqi);
+    }
+    return c;
+}
+
 int cmd_inspectq(xport portno, enum queue qt)
 {
-    struct xq *q;
+    xptr *queue, *drain;
     struct xlock *l;
     struct xseg_port *port;
+    xqindex c = 0;
 
     if (cmd_join()) {
         return -1;
@@ -1742,30 +1781,28 @@ int cmd_inspectq(xport portno, enum queue qt)
         return -1;
     }
     if (qt == FREE_QUEUE) {
-        q = xseg_get_queue(xseg, port, free_queue);
+        queue = &port->free_queue;
+        drain = &port->free_drain;
         l = &port->fq_lock;
     } else if (qt == REQUEST_QUEUE) {
-        q = xseg_get_queue(xseg, port, request_queue);
+        queue = &port->request_queue;
+        drain = &port->request_drain;
         l = &port->rq_lock;
     } else if (qt == REPLY_QUEUE) {
-        q = xseg_get_queue(xseg, port, reply_queue);
-        l = &port->rq_lock;
+        queue = &port->reply_queue;
+        drain = &port->reply_drain;
+        l = &port->pq_lock;
     } else {
         return -1;
     }
     xlock_acquire(l);
 
-    xqindex i, c = xq_count(q);
-    if (c) {
-        struct xseg_request *req;
-        xptr xqi;
-        for (i = 0; i < c; i++) {
-            xqi = __xq_pop_head(q);
-            req = XPTR_TAKE(xqi, xseg->segment);
-            report_request(req);
-            __xq_append_tail(q, xqi);
-        }
-    } else {
+    /* the drain holds the older requests */
+    if (*drain) {
+        c += report_queue(XPTR_TAKE(*drain, xseg->segment));
+    }
+    c += report_queue(XPTR_TAKE(*queue, xseg->segment));
+    if (!c) {
         fprintf(stderr, "Queue is empty\n\n");
     }
     xlock_release(l);
@@ -21,10 +21,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define XSEG_NR_TYPES 16
 #define XSEG_NR_PEER_TYPES 64
 #define XSEG_MIN_PAGE_SIZE 4096
+/* slots of per request data in a page */
+#define REQ_DATA_PAGE_SHIFT 12
+#define REQ_DATA_PAGE_SIZE (1 << REQ_DATA_PAGE_SHIFT)
 
 static struct xseg_type *__types[XSEG_NR_TYPES];
 static unsigned int __nr_types;
@@ -540,6 +548,9 @@ int xseg_disable_driver(struct xseg *xseg, const char *name)
  * must always be exactly in sync!
 */
 
+/* words of the free dynports bitmap */
+#define DYNPORT_WORDS(cfg) (((cfg)->nr_ports - (cfg)->dynports + 63) / 64)
+
 static uint64_t calculate_segment_size(struct xseg_config *config)
 {
     uint64_t size = 0;
@@ -679,6 +690,14 @@ static long initialize_segment(struct xseg *xseg, struct xseg_config *cfg)
     }
     xseg->dst_gw = (xport *) XPTR_MAKE(mem, segment);
 
+    //allocate port groups
+    mem = xheap_allocate(heap, sizeof(xptr) * cfg->nr_ports);
+    if (!mem) {
+        return -1;
+    }
+    memset(mem, 0, sizeof(xptr) * cfg->nr_ports);
+    xseg->groups = (xptr *) XPTR_MAKE(mem, segment);
+
     //allocate xseg_shared memory
     mem = xheap_allocate(heap, sizeof(struct xseg_shared));
     if (!mem) {
@@ -688,8 +707,25 @@ static long initialize_segment(struct xseg *xseg, struct xseg_config *cfg)
     shared->flags = 0;
     shared->nr_peer_types = 0;
     xlock_release(&shared->segment_lock);
+    xlock_release(&shared->quota_lock);
+    shared->quota_heap = 0;
+    shared->quota_fair = 0;
+    shared->route_gen = 1;
+    shared->heap_seq = 0;
+    shared->heap_sleepers = 0;
     xseg->shared = (struct xseg_shared *) XPTR_MAKE(mem, segment);
 
+    //allocate the free dynports bitmap, all of them free
+    mem = xheap_allocate(heap, sizeof(uint64_t) * DYNPORT_WORDS(cfg));
+    if (!mem) {
+        return -1;
+    }
+    memset(mem, 0, sizeof(uint64_t) * DYNPORT_WORDS(cfg));
+    for (i = 0; i < cfg->nr_ports - cfg->dynports; i++) {
+        ((uint64_t *) mem)[i / 64] |= 1ULL << (i % 64);
+    }
+    shared->dynport_map = XPTR_MAKE(mem, segment);
+
     mem = xheap_allocate(heap, page_size);
     if (!mem) {
         return -1;
@@ -830,6 +866,228 @@ static int xseg_validate_pointers(struct xseg *xseg)
     return r;
 }
 
+/*
+ * Backpressure. Threads out of request slots or heap space sleep on a futex
+ * on a word in the segment, the free_seq of the port for its request slots
+ * and the heap_seq of the segment for heap space. Whoever, in any process,
+ * puts a request or frees heap space bumps the word, and wakes up its
+ * sleepers if there are any.
+ *
+ * Works waiting for the request slots of a port are kept in a waitq of this
+ * process, made on the first wait, since their job_fn can only run here.
+ * Only the puts of this process signal it.
+ */
+struct xseg_port_waitq {
+    struct xwaitq wq;
+    struct xseg *xseg;
+    xport portno;
+};
+
+static void __wake_seq(volatile uint32_t * seq, volatile uint32_t * sleepers)
+{
+    __sync_fetch_and_add(seq, 1);
+    if (*sleepers) {
+        syscall(SYS_futex, seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Count the entries of a port queue with its lock held, as drained and
+ * replaced rings are freed under it.
+ */
+static xqindex __queue_count(struct xseg *xseg, struct xlock *lock,
+                             xptr * queue, xptr * drain)
+{
+    xqindex nr;
+
+    xlock_acquire(lock);
+    nr = __xseg_queue_count(xseg, *queue, *drain);
+    xlock_release(lock);
+    return nr;
+}
+
+static int __port_has_slot(void *arg)
+{
+    struct xseg_port_waitq *pw = (struct xseg_port_waitq *) arg;
+    struct xseg *xseg = pw->xseg;
+    struct xseg_port *port = xseg_get_port(xseg, pw->portno);
+
+    if (!port) {
+        /* let the waiters fail */
+        return 1;
+    }
+    if (port->alloc_reqs < port->max_alloc_reqs) {
+        return 1;
+    }
+    return (__queue_count(xseg, &port->fq_lock, &port->free_queue,
+                          &port->free_drain) > 0);
+}
+
+static struct xseg_port_waitq *__get_port_waitq(struct xseg *xseg,
+                                                xport portno)
+{
+    struct xseg_private *priv = xseg->priv;
+    struct xseg_peer_operations *pops = &priv->peer_type.peer_ops;
+    struct xseg_port_waitq *pw;
+
+    pw = priv->port_waitqs[portno];
+    if (LIKELY(pw)) {
+        return pw;
+    }
+    pw = pops->malloc(sizeof(struct xseg_port_waitq));
+    if (!pw) {
+        XSEGLOG("Cannot allocate memory");
+        return NULL;
+    }
+    pw->xseg = xseg;
+    pw->portno = portno;
+    if (xwaitq_init(&pw->wq, __port_has_slot, pw, 0) < 0) {
+        XSEGLOG("Cannot allocate memory");
+        pops->mfree(pw);
+        return NULL;
+    }
+    if (!__sync_bool_compare_and_swap(&priv->port_waitqs[portno], NULL, pw)) {
+        xwaitq_destroy(&pw->wq);
+        pops->mfree(pw);
+    }
+    return priv->port_waitqs[portno];
+}
+
+/* wake up the sleepers of a port in any process, but run no works */
+static void __wake_port(struct xseg *xseg, xport portno)
+{
+    struct xseg_port *port;
+
+    if (portno >= xseg->config.nr_ports) {
+        return;
+    }
+    port = xseg_get_port(xseg, portno);
+    if (port) {
+        __wake_seq(&port->free_seq, &port->free_sleepers);
+    }
+}
+
+static void __signal_port(struct xseg *xseg, xport portno)
+{
+    struct xseg_port_waitq *pw;
+
+    if (portno >= xseg->config.nr_ports) {
+        return;
+    }
+    __wake_port(xseg, portno);
+    pw = xseg->priv->port_waitqs[portno];
+    if (pw) {
+        xwaitq_signal(&pw->wq);
+    }
+}
+
+static void __signal_heap(struct xseg *xseg)
+{
+    struct xseg_shared *shared = xseg->shared;
+
+    __wake_seq(&shared->heap_seq, &shared->heap_sleepers);
+}
+
+/* every free of heap space goes through here, to wake up its waiters */
+static void __heap_free(struct xseg *xseg, void *ptr)
+{
+    xheap_free(ptr);
+    __signal_heap(xseg);
+}
+
+/* objects put may trim their handler, and give heap space back */
+static void __put_obj(struct xseg *xseg, struct xobject_h *obj_h, void *obj)
+{
+    xobj_put_obj(obj_h, obj);
+    __signal_heap(xseg);
+}
+
+static void __free_req_data(struct xseg *xseg)
+{
+    struct xseg_private *priv = xseg->priv;
+    struct xseg_peer_operations *pops = &priv->peer_type.peer_ops;
+    uint64_t i;
+
+    for (i = 0; i < priv->nr_req_data_pages; i++) {
+        if (priv->req_data[i]) {
+            pops->mfree(priv->req_data[i]);
+        }
+    }
+    pops->mfree(priv->req_data);
+}
+
+static void __free_waitqs(struct xseg *xseg)
+{
+    struct xseg_private *priv = xseg->priv;
+    struct xseg_peer_operations *pops = &priv->peer_type.peer_ops;
+    uint32_t i;
+
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        if (priv->port_waitqs[i]) {
+            xwaitq_destroy(&priv->port_waitqs[i]->wq);
+            pops->mfree(priv->port_waitqs[i]);
+        }
+    }
+    pops->mfree(priv->port_waitqs);
+}
+
+static void __free_routes(struct xseg *xseg)
+{
+    struct xseg_private *priv = xseg->priv;
+    struct xseg_peer_operations *pops = &priv->peer_type.peer_ops;
+    uint32_t i;
+
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        if (priv->routes[i]) {
+            pops->mfree(priv->routes[i]);
+        }
+    }
+    pops->mfree(priv->routes);
+}
+
+static uint64_t __wait_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t __wait_deadline(uint32_t usec_timeout)
+{
+    if (usec_timeout == XWAIT_FOREVER) {
+        return (uint64_t) -1;
+    }
+    return __wait_now() + usec_timeout;
+}
+
+/*
+ * Sleep until *seq is bumped past old, which the caller read before it last
+ * looked for room, or until the deadline. Returns -1 once the deadline has
+ * passed. A bump in between makes the futex wait return at once.
+ */
+static int __wait_seq(volatile uint32_t * seq, volatile uint32_t * sleepers,
+                      uint32_t old, uint64_t deadline)
+{
+    struct timespec ts, *tsp = NULL;
+    uint64_t now, usec;
+
+    if (deadline != (uint64_t) -1) {
+        now = __wait_now();
+        if (now >= deadline) {
+            return -1;
+        }
+        usec = deadline - now;
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+        tsp = &ts;
+    }
+    __sync_fetch_and_add(sleepers, 1);
+    syscall(SYS_futex, seq, FUTEX_WAIT, old, tsp, NULL, 0);
+    __sync_fetch_and_sub(sleepers, 1);
+    return 0;
+}
+
 struct xseg *xseg_join(const char *segtypename,
                        const char *segname,
                        const char *peertypename, void (*wakeup)
@@ -912,12 +1170,6 @@ struct xseg *xseg_join(const char *segtypename,
     priv->segment_type = *segtype;
     priv->peer_type = *peertype;
     priv->wakeup = wakeup;
-    priv->req_data = xhash_new(3, 0, XHASH_INTEGER);    //FIXME should be relative to XSEG_DEF_REQS
-    if (!priv->req_data) {
-        errno = ENOMEM;
-        goto err_priv;
-    }
-    xlock_release(&priv->reqdatalock);
 
     xseg->max_peer_types = __xseg->max_peer_types;
 
@@ -945,6 +1197,7 @@ struct xseg *xseg_join(const char *segtypename,
     xseg->ports = XPTR_TAKE(__xseg->ports, __xseg);
     xseg->path_next = XPTR_TAKE(__xseg->path_next, __xseg);
     xseg->dst_gw = XPTR_TAKE(__xseg->dst_gw, __xseg);
+    xseg->groups = XPTR_TAKE(__xseg->groups, __xseg);
     xseg->heap = XPTR_TAKE(__xseg->heap, __xseg);
     xseg->object_handlers = XPTR_TAKE(__xseg->object_handlers, __xseg);
     xseg->shared = XPTR_TAKE(__xseg->shared, __xseg);
@@ -959,6 +1212,34 @@ struct xseg *xseg_join(const char *segtypename,
         goto err_free_types;
     }
 
+    /* one slot for every request object that fits in the segment */
+    priv->nr_req_data_pages = ((size / xseg->request_h->obj_size) >>
+                               REQ_DATA_PAGE_SHIFT) + 1;
+    priv->req_data = pops->malloc(sizeof(void **) * priv->nr_req_data_pages);
+    if (!priv->req_data) {
+        err_no = ENOMEM;
+        XSEGLOG("Cannot allocate memory");
+        goto err_free_types;
+    }
+    memset(priv->req_data, 0, sizeof(void **) * priv->nr_req_data_pages);
+
+    priv->port_waitqs = pops->malloc(sizeof(struct xseg_port_waitq *) *
+                                     xseg->config.nr_ports);
+    if (!priv->port_waitqs) {
+        err_no = ENOMEM;
+        XSEGLOG("Cannot allocate memory");
+        goto err_free_req_data;
+    }
+    memset(priv->port_waitqs, 0,
+           sizeof(struct xseg_port_waitq *) * xseg->config.nr_ports);
+    priv->routes = pops->malloc(sizeof(uint64_t *) * xseg->config.nr_ports);
+    if (!priv->routes) {
+        err_no = ENOMEM;
+        XSEGLOG("Cannot allocate memory");
+        goto err_free_waitqs;
+    }
+    memset(priv->routes, 0, sizeof(uint64_t *) * xseg->config.nr_ports);
+
     /* Do we need this?
        r = xops->signal_join(xseg);
        if (r) {
@@ -969,13 +1250,16 @@ struct xseg *xseg_join(const char *segtypename,
     pthread_mutex_unlock(&xseg_joinref_mutex);
     return xseg;
 
+  err_free_waitqs:
+    pops->mfree(priv->port_waitqs);
+  err_free_req_data:
+    pops->mfree(priv->req_data);
   err_free_types:
     pops->mfree(priv->peer_types);
   err_unmap:
     xseg_join_ref--;
     if (!xseg_join_ref)
         xops->unmap(__xseg, size);
-    xhash_free(priv->req_data);
   err_priv:
     pops->mfree(priv);
   err_seg:
@@ -1011,6 +1295,9 @@ void xseg_leave(struct xseg *xseg)
     }
     __unlock_domain();
 
+    __free_req_data(xseg);
+    __free_waitqs(xseg);
+    __free_routes(xseg);
     type->ops.unmap(xseg->segment, xseg->segment_size);
     free(xseg);
     pthread_mutex_unlock(&xseg_joinref_mutex);
@@ -1036,6 +1323,66 @@ struct xseg_port *xseg_get_port(struct xseg *xseg, uint32_t portno)
     }
 }
 
+/*
+ * Credit based flow control. A port with a window accepts at most that many
+ * requests in flight from each source port, counted in its inflight array.
+ * A request is in flight from the time it is submitted to the port until its
+ * reply is received back, or it is put. The path entry of the hop records the
+ * charged port, plus one, in its upper half, and whoever pops the entry gives
+ * the credit back.
+ */
+#define PATH_CREDIT_SHIFT 32
+
+static inline xqindex __path_entry(xport portno, xport charged)
+{
+    return (xqindex) portno |
+        ((xqindex) (charged + 1) << PATH_CREDIT_SHIFT);
+}
+
+/* 1 if charged, 0 if the port has no window, -1 if out of credits */
+static int __get_credit(struct xseg *xseg, struct xseg_port *port, xport src)
+{
+    volatile uint32_t *inflight;
+    uint32_t window = port->window;
+
+    if (LIKELY(!window)) {
+        return 0;
+    }
+    inflight = XPTR_TAKE(port->inflight, xseg->segment);
+    if (__sync_add_and_fetch(&inflight[src], 1) > window) {
+        __sync_fetch_and_sub(&inflight[src], 1);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * The charged port may have been freed and reallocated in the same slot while
+ * the request was in flight, with its counters zeroed, so never go below zero.
+ */
+static void __put_credit(struct xseg *xseg, xqindex entry)
+{
+    volatile uint32_t *inflight;
+    struct xseg_port *port;
+    xport src = (xport) entry;
+    uint32_t used;
+
+    if (LIKELY(!(entry >> PATH_CREDIT_SHIFT)) || entry == Noneidx) {
+        return;
+    }
+    port = xseg_get_port(xseg, (entry >> PATH_CREDIT_SHIFT) - 1);
+    if (!port || !port->inflight) {
+        return;
+    }
+    inflight = XPTR_TAKE(port->inflight, xseg->segment);
+    do {
+        used = inflight[src];
+        if (UNLIKELY(!used)) {
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&inflight[src], used, used - 1));
+}
+
 struct xq *__alloc_queue(struct xseg *xseg, uint64_t nr_reqs)
 {
     uint64_t bytes;
@@ -1064,6 +1411,81 @@ struct xq *__alloc_queue(struct xseg *xseg, uint64_t nr_reqs)
     return q;
 }
 
+/*
+ * Port queues are replaced without copying them under their lock. The new
+ * ring is published in place of the old one, which moves to the drain slot
+ * of the queue. Consumers empty the drain ring before the current one, so the
+ * order of the queue is kept, and free it once empty. The queue lock is the
+ * grace period of the rings: they must only be touched with it held, even to
+ * count their entries, so that a drained or replaced ring is unused once the
+ * lock is released. One ring drains at a time.
+ */
+
+/* pop the head of a port queue, called with its lock held */
+static xqindex __queue_pop(struct xseg *xseg, xptr * cur, xptr * drain)
+{
+    struct xq *q;
+    xqindex xqi;
+
+    if (UNLIKELY(*drain)) {
+        q = XPTR_TAKE(*drain, xseg->segment);
+        xqi = __xq_pop_head(q);
+        if (xqi != Noneidx) {
+            return xqi;
+        }
+        *drain = 0;
+        __heap_free(xseg, q);
+    }
+    q = XPTR_TAKE(*cur, xseg->segment);
+    return __xq_pop_head(q);
+}
+
+/*
+ * Grow a full port queue to double its size, called with its lock held. The
+ * lock is dropped while the new ring is allocated. Returns the current ring,
+ * or NULL if none could be allocated.
+ */
+static struct xq *__queue_grow(struct xseg *xseg, struct xlock *lock,
+                               xptr * cur, xptr * drain)
+{
+    struct xq *q, *newq;
+    xptr old = *cur;
+    xqindex size;
+
+    q = XPTR_TAKE(old, xseg->segment);
+    size = xq_size(q) * 2;
+    if (UNLIKELY(*drain)) {
+        /* an older ring still drains, copy this one instead */
+        newq = __alloc_queue(xseg, size);
+        if (!newq) {
+            return NULL;
+        }
+        if (__xq_resize(q, newq) == Noneidx) {
+            __heap_free(xseg, newq);
+            return NULL;
+        }
+        *cur = XPTR_MAKE(newq, xseg->segment);
+        __heap_free(xseg, q);
+        return newq;
+    }
+
+    /* the ring may be replaced and freed once the lock is dropped */
+    xlock_release(lock);
+    newq = __alloc_queue(xseg, size);
+    xlock_acquire(lock);
+    if (!newq) {
+        return NULL;
+    }
+    if (*cur != old || *drain) {
+        /* grown by someone else meanwhile */
+        __heap_free(xseg, newq);
+        return XPTR_TAKE(*cur, xseg->segment);
+    }
+    *drain = old;
+    *cur = XPTR_MAKE(newq, xseg->segment);
+    return newq;
+}
+
 //FIXME
 //maybe add parameters of initial free_queue size and max_alloc_reqs
 struct xseg_port *xseg_alloc_port(struct xseg *xseg, uint32_t flags,
@@ -1112,20 +1534,28 @@ struct xseg_port *xseg_alloc_port(struct xseg *xseg, uint32_t flags,
     port->portno = NoPort;
     port->peer_type = 0;        //FIXME what  here ??? NoType??
     port->alloc_reqs = 0;
+    port->denied_reqs = 0;
     port->max_alloc_reqs = XSEG_DEF_MAX_ALLOCATED_REQS;
     port->flags = 0;
     port->signal_desc = 0;
+    port->window = 0;
+    port->inflight = 0;
+    port->free_drain = 0;
+    port->request_drain = 0;
+    port->reply_drain = 0;
+    port->free_seq = 0;
+    port->free_sleepers = 0;
 
     return port;
 
   err_reply:
-    xheap_free(XPTR_TAKE(port->request_queue, xseg->segment));
+    __heap_free(xseg, XPTR_TAKE(port->request_queue, xseg->segment));
     port->request_queue = 0;
   err_req:
-    xheap_free(XPTR_TAKE(port->free_queue, xseg->segment));
+    __heap_free(xseg, XPTR_TAKE(port->free_queue, xseg->segment));
     port->free_queue = 0;
   err_free:
-    xobj_put_obj(obj_h, port);
+    __put_obj(xseg, obj_h, port);
 
     return NULL;
 }
@@ -1139,18 +1569,35 @@ void xseg_free_port(struct xseg *xseg, struct xseg_port *port)
     struct xobject_h *obj_h = xseg->port_h;
 
     if (port->request_queue) {
-        xheap_free(XPTR_TAKE(port->request_queue, xseg->segment));
+        __heap_free(xseg, XPTR_TAKE(port->request_queue, xseg->segment));
         port->request_queue = 0;
     }
     if (port->free_queue) {
-        xheap_free(XPTR_TAKE(port->free_queue, xseg->segment));
+        __heap_free(xseg, XPTR_TAKE(port->free_queue, xseg->segment));
         port->free_queue = 0;
     }
     if (port->reply_queue) {
-        xheap_free(XPTR_TAKE(port->reply_queue, xseg->segment));
+        __heap_free(xseg, XPTR_TAKE(port->reply_queue, xseg->segment));
         port->reply_queue = 0;
     }
-    xobj_put_obj(obj_h, port);
+    if (port->free_drain) {
+        __heap_free(xseg, XPTR_TAKE(port->free_drain, xseg->segment));
+        port->free_drain = 0;
+    }
+    if (port->request_drain) {
+        __heap_free(xseg, XPTR_TAKE(port->request_drain, xseg->segment));
+        port->request_drain = 0;
+    }
+    if (port->reply_drain) {
+        __heap_free(xseg, XPTR_TAKE(port->reply_drain, xseg->segment));
+        port->reply_drain = 0;
+    }
+    if (port->inflight) {
+        __heap_free(xseg, XPTR_TAKE(port->inflight, xseg->segment));
+        port->inflight = 0;
+    }
+    port->window = 0;
+    __put_obj(xseg, obj_h, port);
 }
 
 void *xseg_alloc_buffer(struct xseg *xseg, uint64_t size)
@@ -1165,7 +1612,7 @@ void *xseg_alloc_buffer(struct xseg *xseg, uint64_t size)
     if (mem && xheap_get_chunk_size(mem) < size) {
         XSEGLOG("Buffer size %llu instead of %llu\n",
                 xheap_get_chunk_size(mem), size);
-        xheap_free(mem);
+        __heap_free(xseg, mem);
         mem = NULL;
     }
     return mem;
@@ -1178,7 +1625,7 @@ void xseg_free_buffer(struct xseg *xseg, void *ptr)
         return;
     }
 
-    xheap_free(ptr);
+    __heap_free(xseg, ptr);
 }
 
 int xseg_prepare_wait(struct xseg *xseg, uint32_t portno)
@@ -1307,7 +1754,7 @@ int xseg_alloc_requests(struct xseg *xseg, uint32_t portno, uint32_t nr)
         xqi = XPTR_MAKE(req, xseg->segment);
         xqi = __xq_append_tail(q, xqi);
         if (xqi == Noneidx) {
-            xobj_put_obj(xseg->request_h, req);
+            __put_obj(xseg, xseg->request_h, req);
             break;
         }
         i++;
@@ -1321,7 +1768,6 @@ int xseg_free_requests(struct xseg *xseg, uint32_t portno, int nr)
 {
     int i = 0;
     xqindex xqi;
-    struct xq *q;
     struct xseg_request *req;
     struct xseg_port *port;
 
@@ -1336,20 +1782,21 @@ int xseg_free_requests(struct xseg *xseg, uint32_t portno, int nr)
     }
 
     xlock_acquire(&port->fq_lock);
-    q = XPTR_TAKE(port->free_queue, xseg->segment);
-    while ((xqi = __xq_pop_head(q)) != Noneidx && i < nr) {
+    while (i < nr && (xqi = __queue_pop(xseg, &port->free_queue,
+                                        &port->free_drain)) != Noneidx) {
         req = XPTR_TAKE(xqi, xseg->segment);
-        xobj_put_obj(xseg->request_h, (void *) req);
+        __put_obj(xseg, xseg->request_h, (void *) req);
         i++;
     }
+    xlock_release(&port->fq_lock);
     if (i == 0) {
         return -1;
     }
-    xlock_release(&port->fq_lock);
 
     xlock_acquire(&port->port_lock);
     port->alloc_reqs -= i;
     xlock_release(&port->port_lock);
+    __signal_port(xseg, portno);
 
     return i;
 }
@@ -1378,62 +1825,223 @@ int xseg_prep_ports(struct xseg *xseg, struct xseg_request *xreq,
     return 0;
 }
 
-struct xseg_request *xseg_get_request(struct xseg *xseg, xport src_portno,
-                                      xport dst_portno, uint32_t flags)
+/*
+ * The number of requests the heap can hold: the ones already allocated, plus
+ * the ones that fit in the space the heap has not handed out yet.
+ */
+uint64_t xseg_get_request_capacity(struct xseg *xseg)
 {
-    /*
-     * Flags:
-     * X_ALLOC Allocate more requests if object handler
-     *         does not have any avaiable
-     * X_LOCAL Use only local - preallocated reqs
-     *         (Maybe we want this as default, to give a hint to a peer
-     *          how many requests it can have flying)
-     */
-    struct xseg_request *req = NULL;
-    struct xseg_port *port;
-    struct xq *q;
-    xqindex xqi;
-    xptr ptr;
+    struct xobject_h *obj_h;
+    struct xheap *heap;
 
     if (!xseg) {
-        XSEGLOG("Invalid xseg argument");
-        return NULL;
+        XSEGLOG("Invalid argument");
+        return 0;
     }
+    obj_h = xseg->request_h;
+    heap = xseg->heap;
+    return obj_h->nr_allocated + (heap->size - heap->cur) / obj_h->obj_size;
+}
 
-    port = xseg_get_port(xseg, src_portno);
-    if (!port) {
-        return NULL;
+/*
+ * Request quotas. The max allocated requests of the bound ports are computed
+ * from heap_pct percent of the request capacity of the heap. fair_pct percent
+ * of it is split evenly among the ports, and the rest in proportion to the
+ * demand of each port, i.e. the requests it holds plus the ones it has been
+ * denied. Ports that do not use their share this way lend it to busy ones,
+ * and get it back as the busy ones put their requests.
+ *
+ * Must be called with shared->quota_lock held.
+ */
+static void __rebalance_requests(struct xseg *xseg)
+{
+    struct xseg_shared *shared = xseg->shared;
+    struct xseg_port *port;
+    uint64_t cap, fair, rest, demand, total = 0, quota, denied;
+    uint32_t i, nr = 0;
+
+    cap = xseg_get_request_capacity(xseg) * shared->quota_heap / 100;
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        port = xseg_get_port(xseg, i);
+        if (!port) {
+            continue;
+        }
+        total += port->alloc_reqs + port->denied_reqs;
+        nr++;
     }
-    //try to allocate from free_queue
-    xlock_acquire(&port->fq_lock);
-    q = XPTR_TAKE(port->free_queue, xseg->segment);
-    xqi = __xq_pop_head(q);
-    if (xqi != Noneidx) {
-        xlock_release(&port->fq_lock);
-        ptr = xqi;
-        req = XPTR_TAKE(ptr, xseg->segment);
-        goto done;
+    if (!nr) {
+        return;
     }
-    xlock_release(&port->fq_lock);
 
-    if (flags & X_LOCAL) {
-        return NULL;
-    }
-    //else try to allocate from global heap
-    //FIXME
-    xlock_acquire(&port->port_lock);
-    if (port->alloc_reqs < port->max_alloc_reqs) {
-        req = xobj_get_obj(xseg->request_h, flags & X_ALLOC);
-        if (req) {
-            port->alloc_reqs++;
+    fair = cap * shared->quota_fair / 100 / nr;
+    rest = cap - fair * nr;
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        port = xseg_get_port(xseg, i);
+        if (!port) {
+            continue;
         }
+        demand = port->alloc_reqs + port->denied_reqs;
+        quota = fair + (total ? rest * demand / total : rest / nr);
+        if (!quota) {
+            quota = 1;
+        }
+        /*
+         * Let old misses fade, so that shares follow the current load. The
+         * ports are not locked here, and their owners keep counting misses
+         * under their port_lock, so update the counters atomically.
+         */
+        do {
+            denied = port->denied_reqs;
+        } while (!__sync_bool_compare_and_swap(&port->denied_reqs, denied,
+                                               denied >> 1));
+        __sync_lock_test_and_set(&port->max_alloc_reqs, quota);
     }
-    xlock_release(&port->port_lock);
-    if (!req) {
-        return NULL;
-    }
+}
 
-  done:
+/* wake up the local waiters of the ports, after their quotas changed */
+static void __signal_ports(struct xseg *xseg)
+{
+    uint32_t i;
+
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        __signal_port(xseg, i);
+    }
+}
+
+/*
+ * Enable request quotas, or disable them with a heap_pct of 0, which leaves
+ * the max requests of the ports as they are. While enabled, the quotas
+ * override xseg_set_max_requests on the next rebalance.
+ */
+int xseg_set_request_quotas(struct xseg *xseg, uint32_t heap_pct,
+                            uint32_t fair_pct)
+{
+    struct xseg_shared *shared;
+
+    if (!xseg || heap_pct > 100 || fair_pct > 100) {
+        XSEGLOG("Invalid argument");
+        return -1;
+    }
+    shared = xseg->shared;
+    xlock_acquire(&shared->quota_lock);
+    shared->quota_heap = heap_pct;
+    shared->quota_fair = fair_pct;
+    if (heap_pct) {
+        __rebalance_requests(xseg);
+    }
+    xlock_release(&shared->quota_lock);
+    __signal_ports(xseg);
+    return 0;
+}
+
+/*
+ * Recompute the request quotas of all ports. Peers may call it periodically;
+ * it also runs every XSEG_QUOTA_MISSES gets a port is denied.
+ */
+int xseg_rebalance_requests(struct xseg *xseg)
+{
+    struct xseg_shared *shared;
+
+    if (!xseg) {
+        XSEGLOG("Invalid argument");
+        return -1;
+    }
+    shared = xseg->shared;
+    if (!shared->quota_heap) {
+        return -1;
+    }
+    xlock_acquire(&shared->quota_lock);
+    __rebalance_requests(xseg);
+    xlock_release(&shared->quota_lock);
+    __signal_ports(xseg);
+    return 0;
+}
+
+/*
+ * Count a get denied by the quota of the port, and rebalance the quotas if it
+ * is time to and nobody else is doing it. Returns whether the port may
+ * allocate again. Must be called with port->port_lock held, so only the
+ * threads sleeping on other ports are woken up here, and the works waiting on
+ * them are not run.
+ */
+static int __request_denied(struct xseg *xseg, struct xseg_port *port)
+{
+    struct xseg_shared *shared = xseg->shared;
+    uint64_t denied;
+    uint32_t i;
+    int r;
+
+    denied = __sync_add_and_fetch(&port->denied_reqs, 1);
+    if (!shared->quota_heap || denied % XSEG_QUOTA_MISSES) {
+        return 0;
+    }
+    if (!xlock_try_lock(&shared->quota_lock)) {
+        return 0;
+    }
+    __rebalance_requests(xseg);
+    r = (port->alloc_reqs < port->max_alloc_reqs);
+    xlock_release(&shared->quota_lock);
+    for (i = 0; i < xseg->config.nr_ports; i++) {
+        __wake_port(xseg, i);
+    }
+    return r;
+}
+
+struct xseg_request *xseg_get_request(struct xseg *xseg, xport src_portno,
+                                      xport dst_portno, uint32_t flags)
+{
+    /*
+     * Flags:
+     * X_ALLOC Allocate more requests if object handler
+     *         does not have any avaiable
+     * X_LOCAL Use only local - preallocated reqs
+     *         (Maybe we want this as default, to give a hint to a peer
+     *          how many requests it can have flying)
+     */
+    struct xseg_request *req = NULL;
+    struct xseg_port *port;
+    xqindex xqi;
+    xptr ptr;
+
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return NULL;
+    }
+
+    port = xseg_get_port(xseg, src_portno);
+    if (!port) {
+        return NULL;
+    }
+    //try to allocate from free_queue
+    xlock_acquire(&port->fq_lock);
+    xqi = __queue_pop(xseg, &port->free_queue, &port->free_drain);
+    if (xqi != Noneidx) {
+        xlock_release(&port->fq_lock);
+        ptr = xqi;
+        req = XPTR_TAKE(ptr, xseg->segment);
+        goto done;
+    }
+    xlock_release(&port->fq_lock);
+
+    if (flags & X_LOCAL) {
+        return NULL;
+    }
+    //else try to allocate from global heap
+    //FIXME
+    xlock_acquire(&port->port_lock);
+    if (port->alloc_reqs < port->max_alloc_reqs ||
+        __request_denied(xseg, port)) {
+        req = xobj_get_obj(xseg->request_h, flags & X_ALLOC);
+        if (req) {
+            port->alloc_reqs++;
+        }
+    }
+    xlock_release(&port->port_lock);
+    if (!req) {
+        return NULL;
+    }
+
+  done:
 
     req->buffer = 0;
     req->bufferlen = 0;
@@ -1470,7 +2078,8 @@ int xseg_put_request(struct xseg *xseg, struct xseg_request *xreq,
 
     xqindex xqi = XPTR_MAKE(xreq, xseg->segment);
     struct xq *q;
-    struct xseg_port *port = xseg_get_port(xseg, xreq->src_portno);
+    xport src_portno = xreq->src_portno;
+    struct xseg_port *port = xseg_get_port(xseg, src_portno);
     if (!port) {
         return -1;
     }
@@ -1479,7 +2088,10 @@ int xseg_put_request(struct xseg *xseg, struct xseg_request *xreq,
         void *ptr = XPTR_TAKE(xreq->buffer, xseg->segment);
         xseg_free_buffer(xseg, ptr);
     }
-    /* empty path */
+    /* empty path, giving back the credits of unfinished hops */
+    while (xq_count(&xreq->path)) {
+        __put_credit(xseg, __xq_pop_head(&xreq->path));
+    }
     xq_init_empty(&xreq->path, MAX_PATH_LEN, xreq->path_bufs);
 
     xreq->buffer = 0;
@@ -1507,14 +2119,14 @@ int xseg_put_request(struct xseg *xseg, struct xseg_request *xreq,
     q = XPTR_TAKE(port->free_queue, xseg->segment);
     xqi = __xq_append_head(q, xqi);
     xlock_release(&port->fq_lock);
-    if (xqi != Noneidx) {
-        return 0;
+    if (xqi == Noneidx) {
+        //else return it to segment
+        __put_obj(xseg, xseg->request_h, (void *) xreq);
+        xlock_acquire(&port->port_lock);
+        port->alloc_reqs--;
+        xlock_release(&port->port_lock);
     }
-    //else return it to segment
-    xobj_put_obj(xseg->request_h, (void *) xreq);
-    xlock_acquire(&port->port_lock);
-    port->alloc_reqs--;
-    xlock_release(&port->port_lock);
+    __signal_port(xseg, src_portno);
     return 0;
 }
 
@@ -1570,6 +2182,105 @@ int xseg_resize_request(struct xseg *xseg, struct xseg_request *req,
     return xseg_prep_request(xseg, req, new_targetlen, new_datalen);
 }
 
+/*
+ * Get a request as xseg_get_request, waiting up to usec_timeout microseconds,
+ * or forever with XWAIT_FOREVER, for a request slot of the port to free up.
+ * The slots of a port are freed by xseg_put_request, in any process, so the
+ * thread that receives the replies of the port must not be the one waiting.
+ */
+struct xseg_request *xseg_get_request_wait(struct xseg *xseg,
+                                           xport src_portno,
+                                           xport dst_portno, uint32_t flags,
+                                           uint32_t usec_timeout)
+{
+    struct xseg_request *req;
+    struct xseg_port *port;
+    uint64_t deadline;
+    uint32_t seq;
+
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return NULL;
+    }
+
+    deadline = __wait_deadline(usec_timeout);
+    for (;;) {
+        port = xseg_get_port(xseg, src_portno);
+        if (!port) {
+            return NULL;
+        }
+        /* any put after this may have freed a slot */
+        seq = port->free_seq;
+        req = xseg_get_request(xseg, src_portno, dst_portno, flags);
+        if (req) {
+            return req;
+        }
+        if (__wait_seq(&port->free_seq, &port->free_sleepers, seq,
+                       deadline) < 0) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Call w->job_fn once the port may have a free request slot, possibly at once
+ * from this thread. It is called with the waitq of the port and w->job, and
+ * should try xseg_get_request again, and wait again if it still fails.
+ *
+ * The job is run by the thread of this process that frees the slot. Slots
+ * freed by other processes do not run it, so a process whose requests are put
+ * elsewhere should block in xseg_get_request_wait instead.
+ */
+int xseg_wait_request(struct xseg *xseg, xport portno, struct work *w)
+{
+    struct xseg_port_waitq *pw;
+
+    if (!xseg || !w) {
+        XSEGLOG("Invalid argument");
+        return -1;
+    }
+    if (!xseg_get_port(xseg, portno)) {
+        return -1;
+    }
+    pw = __get_port_waitq(xseg, portno);
+    if (!pw) {
+        return -1;
+    }
+    return xwaitq_enqueue(&pw->wq, w);
+}
+
+/*
+ * Prepare a request as xseg_prep_request, waiting up to usec_timeout
+ * microseconds, or forever with XWAIT_FOREVER, for heap space to free up.
+ */
+int xseg_prep_request_wait(struct xseg *xseg, struct xseg_request *req,
+                           uint32_t targetlen, uint64_t datalen,
+                           uint32_t usec_timeout)
+{
+    struct xseg_shared *shared;
+    uint64_t deadline;
+    uint32_t seq;
+
+    if (!xseg || !req) {
+        XSEGLOG("Invalid argument");
+        return -1;
+    }
+
+    shared = xseg->shared;
+    deadline = __wait_deadline(usec_timeout);
+    for (;;) {
+        /* any free after this may have made room */
+        seq = shared->heap_seq;
+        if (!xseg_prep_request(xseg, req, targetlen, datalen)) {
+            return 0;
+        }
+        if (__wait_seq(&shared->heap_seq, &shared->heap_sleepers, seq,
+                       deadline) < 0) {
+            return -1;
+        }
+    }
+}
+
 #if 0
 static void __update_timestamp(struct xseg_request *xreq)
 {
@@ -1595,14 +2306,227 @@ static void __update_timestamp(struct xseg_request *xreq)
 #endif
 
 //FIXME should we add NON_BLOCK flag?
+/*
+ * Routing. The next hop of a request at transit port cur, towards its
+ * effective destination dst, is path_next[cur] if set, or else the gateway
+ * of the destination, dst_gw[dst], if set and not cur itself, or else dst.
+ * Hops that do not accept requests are skipped, by routing again from them.
+ *
+ * Next hops are compiled into a table of this process, with a row per transit
+ * port made on its first submit. Each entry carries the routing generation of
+ * the segment it was computed in. Changing a route bumps the generation,
+ * which drops the entries of all processes at once.
+ */
+#define ROUTE_ENTRY(gen, next) (((uint64_t) (gen) << 32) | (next))
+
+static void __routes_changed(struct xseg *xseg)
+{
+    /* publish the new routes before the generation that drops the old ones */
+    MFENCE();
+    /* generation 0 would match the entries of new rows */
+    if (!__sync_add_and_fetch(&xseg->shared->route_gen, 1)) {
+        __sync_add_and_fetch(&xseg->shared->route_gen, 1);
+    }
+}
+
+static xport __route_walk(struct xseg *xseg, xport cur, xport dst)
+{
+    struct xseg_port *port;
+    xport next = cur, gw;
+    uint32_t hops;
+
+    for (hops = 0; hops < xseg->config.nr_ports; hops++) {
+        if (next == dst) {
+            XSEGLOG("Path ended with no one willing to accept");
+            return NoPort;
+        }
+        gw = xseg->dst_gw[dst];
+        if (xseg->path_next[next] != NoPort) {
+            next = xseg->path_next[next];
+        } else if (gw != NoPort && gw != next) {
+            next = gw;
+        } else {
+            next = dst;
+        }
+
+        port = xseg_get_port(xseg, next);
+        if (!port) {
+            XSEGLOG("Couldnt get port (next :%u)", next);
+            return NoPort;
+        }
+        if (port->flags & CAN_ACCEPT) {
+            return next;
+        }
+    }
+    XSEGLOG("Routing loop from %u to %u", cur, dst);
+    return NoPort;
+}
+
+static uint64_t *__get_route_row(struct xseg *xseg, xport cur)
+{
+    struct xseg_private *priv = xseg->priv;
+    struct xseg_peer_operations *pops = &priv->peer_type.peer_ops;
+    uint64_t *row;
+
+    row = pops->malloc(sizeof(uint64_t) * xseg->config.nr_ports);
+    if (!row) {
+        XSEGLOG("Cannot allocate memory");
+        return NULL;
+    }
+    memset(row, 0, sizeof(uint64_t) * xseg->config.nr_ports);
+    if (!__sync_bool_compare_and_swap(&priv->routes[cur], NULL, row)) {
+        pops->mfree(row);
+    }
+    return priv->routes[cur];
+}
+
+static xport __route(struct xseg *xseg, xport cur, xport dst)
+{
+    uint32_t gen = xseg->shared->route_gen;
+    uint64_t *row, entry;
+    xport next;
+
+    row = xseg->priv->routes[cur];
+    if (UNLIKELY(!row)) {
+        row = __get_route_row(xseg, cur);
+    }
+    if (LIKELY(row)) {
+        entry = row[dst];
+        if (LIKELY((uint32_t) (entry >> 32) == gen)) {
+            return (xport) entry;
+        }
+    }
+
+    /* read the routes after the generation they are stored under */
+    MFENCE();
+    next = __route_walk(xseg, cur, dst);
+    if (row && next != NoPort) {
+        row[dst] = ROUTE_ENTRY(gen, next);
+    }
+    return next;
+}
+
+/*
+ * Port groups. A request for a group is dispatched to one of its members when
+ * first submitted, which becomes its effective destination. Members are taken
+ * from a snapshot of the membership mask, and members that are not bound are
+ * passed over. Queue depths are read without locks, as a hint.
+ */
+static struct xseg_port_group *__get_group(struct xseg *xseg, xport group)
+{
+    xptr g = xseg->groups[group];
+
+    if (LIKELY(!g)) {
+        return NULL;
+    }
+    return XPTR_TAKE(g, xseg->segment);
+}
+
+static struct xseg_port *__group_port(struct xseg *xseg,
+                                      struct xseg_port_group *g, uint32_t slot)
+{
+    struct xseg_port *port = xseg_get_port(xseg, g->ports[slot]);
+
+    if (!port || port->owner == NoOwner) {
+        return NULL;
+    }
+    return port;
+}
+
+/* the slot of the nth member in the mask */
+static uint32_t __nth_member(uint64_t mask, uint32_t n)
+{
+    while (n--) {
+        mask &= mask - 1;
+    }
+    return __builtin_ctzll(mask);
+}
+
+/* splitmix64, to draw members from the shared cursor */
+static uint64_t __mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static xqindex __request_count(struct xseg *xseg, struct xseg_port *port)
+{
+    return __queue_count(xseg, &port->rq_lock, &port->request_queue,
+                         &port->request_drain);
+}
+
+static xport __group_pick(struct xseg *xseg, struct xseg_port_group *g)
+{
+    uint64_t mask = g->members, m, r;
+    uint32_t nr, i, slot, best = XSEG_GROUP_MAX_MEMBERS;
+    struct xseg_port *port, *other;
+    xqindex depth, min = Noneidx;
+
+    nr = __builtin_popcountll(mask);
+    if (!g->active || !nr) {
+        return NoPort;
+    }
+    r = __sync_fetch_and_add(&g->cursor, 1);
+
+    switch (g->policy) {
+    case XSEG_GROUP_P2C:
+        r = __mix(r);
+        slot = __nth_member(mask, (uint32_t) r % nr);
+        port = __group_port(xseg, g, slot);
+        i = __nth_member(mask, (uint32_t) (r >> 32) % nr);
+        other = __group_port(xseg, g, i);
+        if (!port || (other && __request_count(xseg, other) <
+                      __request_count(xseg, port))) {
+            port = other;
+            slot = i;
+        }
+        if (port) {
+            best = slot;
+        }
+        break;
+    case XSEG_GROUP_SHORTEST:
+        for (m = mask; m; m &= m - 1) {
+            slot = __builtin_ctzll(m);
+            port = __group_port(xseg, g, slot);
+            if (!port) {
+                continue;
+            }
+            depth = __request_count(xseg, port);
+            if (min == Noneidx || depth < min) {
+                min = depth;
+                best = slot;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    if (best < XSEG_GROUP_MAX_MEMBERS) {
+        return g->ports[best];
+    }
+
+    /* round robin, also over the members the policy could not use */
+    for (i = 0; i < nr; i++) {
+        slot = __nth_member(mask, (uint32_t) ((r + i) % nr));
+        if (__group_port(xseg, g, slot)) {
+            return g->ports[slot];
+        }
+    }
+    return NoPort;
+}
+
 xport xseg_submit(struct xseg *xseg, struct xseg_request *xreq,
                   xport portno, uint32_t flags)
 {
     xserial serial = NoSerial;
-    xqindex xqi, r;
-    struct xq *q, *newq;
-    xport next, cur;
+    xqindex xqi, entry;
+    struct xq *q;
+    xport next, cur, dst, group_dst;
     struct xseg_port *port;
+    struct xseg_port_group *group;
+    int charged;
 
     if (!xseg || !xreq) {
         XSEGLOG("Invalid argument");
@@ -1622,27 +2546,38 @@ xport xseg_submit(struct xseg *xseg, struct xseg_request *xreq,
         return NoPort;
     }
 
-    cur = xreq->transit_portno;
-    next = cur;
-    //FIXME assert(cur == portno);
-    do {
-        if (next == xreq->effective_dst_portno) {
-            XSEGLOG("Path ended with no one willing to accept");
+    /*
+     * The member picked for a group becomes the effective destination only
+     * when the request is queued, so that a failed submit picks again.
+     */
+    dst = group_dst = xreq->effective_dst_portno;
+    group = __get_group(xseg, dst);
+    if (UNLIKELY(group)) {
+        dst = __group_pick(xseg, group);
+        if (dst == NoPort) {
+            XSEGLOG("No member of group %u to submit to", group_dst);
             return NoPort;
         }
+    }
 
-        if (xseg->path_next[next] != NoPort) {
-            next = xseg->path_next[next];
-        } else {
-            next = xreq->effective_dst_portno;
-        }
+    cur = xreq->transit_portno;
+    //FIXME assert(cur == portno);
+    next = __route(xseg, cur, dst);
+    if (next == NoPort) {
+        return NoPort;
+    }
+    port = xseg_get_port(xseg, next);
+    if (!port) {
+        XSEGLOG("Couldnt get port (next :%u)", next);
+        return NoPort;
+    }
 
-        port = xseg_get_port(xseg, next);
-        if (!port) {
-            XSEGLOG("Couldnt get port (next :%u)", next);
-            return NoPort;
-        }
-    } while ((!port->flags & CAN_ACCEPT));
+    /* take a credit for the hop, or tell the submitter to back off */
+    charged = __get_credit(xseg, port, cur);
+    if (charged < 0) {
+        errno = EAGAIN;
+        return NoPort;
+    }
 
     /* submit */
 
@@ -1651,36 +2586,38 @@ xport xseg_submit(struct xseg *xseg, struct xseg_request *xreq,
     xqi = XPTR_MAKE(xreq, xseg->segment);
 
     /* add current port to path */
-    serial = __xq_append_head(&xreq->path, cur);
+    entry = charged ? __path_entry(cur, next) : cur;
+    serial = __xq_append_head(&xreq->path, entry);
     if (serial == Noneidx) {
         XSEGLOG("Couldn't append path head");
+        __put_credit(xseg, entry);
         return NoPort;
     }
 
     xlock_acquire(&port->rq_lock);
+    if (UNLIKELY(group)) {
+        xreq->effective_dst_portno = dst;
+    }
     q = XPTR_TAKE(port->request_queue, xseg->segment);
     serial = __xq_append_tail(q, xqi);
     if (flags & X_ALLOC && serial == Noneidx) {
         /* double up queue size */
-        newq = __alloc_queue(xseg, xq_size(q) * 2);
-        if (!newq) {
-            goto out_rel;
-        }
-        r = __xq_resize(q, newq);
-        if (r == Noneidx) {
-            xheap_free(newq);
+        q = __queue_grow(xseg, &port->rq_lock, &port->request_queue,
+                         &port->request_drain);
+        if (!q) {
             goto out_rel;
         }
-        port->request_queue = XPTR_MAKE(newq, xseg->segment);
-        xheap_free(q);
-        serial = __xq_append_tail(newq, xqi);
+        serial = __xq_append_tail(q, xqi);
     }
 
   out_rel:
+    if (UNLIKELY(group) && serial == Noneidx) {
+        xreq->effective_dst_portno = group_dst;
+    }
     xlock_release(&port->rq_lock);
     if (serial == Noneidx) {
         XSEGLOG("Couldn't append request to queue");
-        __xq_pop_head(&xreq->path);
+        __put_credit(xseg, __xq_pop_head(&xreq->path));
         next = NoPort;
     }
     return next;
@@ -1692,7 +2629,6 @@ struct xseg_request *xseg_receive(struct xseg *xseg, xport portno,
 {
     xqindex xqi;
     xserial serial = NoSerial;
-    struct xq *q;
     struct xseg_request *req;
     struct xseg_port *port;
 
@@ -1713,8 +2649,7 @@ struct xseg_request *xseg_receive(struct xseg *xseg, xport portno,
     } else {
         xlock_acquire(&port->pq_lock);
     }
-    q = XPTR_TAKE(port->reply_queue, xseg->segment);
-    xqi = __xq_pop_head(q);
+    xqi = __queue_pop(xseg, &port->reply_queue, &port->reply_drain);
     xlock_release(&port->pq_lock);
 
     if (xqi == Noneidx) {
@@ -1729,6 +2664,7 @@ struct xseg_request *xseg_receive(struct xseg *xseg, xport portno,
         XSEGLOG("pop head of path queue returned Noneidx\n");
         goto retry;
     }
+    __put_credit(xseg, serial);
 
     return req;
 }
@@ -1737,7 +2673,6 @@ struct xseg_request *xseg_accept(struct xseg *xseg, xport portno,
                                  uint32_t flags)
 {
     xqindex xqi;
-    struct xq *q;
     struct xseg_request *req;
     struct xseg_port *port;
 
@@ -1758,8 +2693,7 @@ struct xseg_request *xseg_accept(struct xseg *xseg, xport portno,
         xlock_acquire(&port->rq_lock);
     }
 
-    q = XPTR_TAKE(port->request_queue, xseg->segment);
-    xqi = __xq_pop_head(q);
+    xqi = __queue_pop(xseg, &port->request_queue, &port->request_drain);
     xlock_release(&port->rq_lock);
     if (xqi == Noneidx) {
         return NULL;
@@ -1776,8 +2710,8 @@ xport xseg_respond(struct xseg * xseg, struct xseg_request * xreq,
                    xport portno, uint32_t flags)
 {
     xserial serial = NoSerial;
-    xqindex xqi, r;
-    struct xq *q, *newq;
+    xqindex xqi;
+    struct xq *q;
     struct xseg_port *port;
     xport dst;
 
@@ -1800,7 +2734,7 @@ xport xseg_respond(struct xseg * xseg, struct xseg_request * xreq,
     if (!(port->flags & CAN_RECEIVE)) {
         //XSEGLOG("Port %u cannot receive", dst);
         /* Port cannot receive. Try next one in path */
-        __xq_pop_head(&xreq->path);
+        __put_credit(xseg, __xq_pop_head(&xreq->path));
         goto retry;
     }
 
@@ -1810,18 +2744,12 @@ xport xseg_respond(struct xseg * xseg, struct xseg_request * xreq,
     q = XPTR_TAKE(port->reply_queue, xseg->segment);
     serial = __xq_append_tail(q, xqi);
     if (flags & X_ALLOC && serial == Noneidx) {
-        newq = __alloc_queue(xseg, xq_size(q) * 2);
-        if (!newq) {
-            goto out_rel;
-        }
-        r = __xq_resize(q, newq);
-        if (r == Noneidx) {
-            xheap_free(newq);
+        q = __queue_grow(xseg, &port->pq_lock, &port->reply_queue,
+                         &port->reply_drain);
+        if (!q) {
             goto out_rel;
         }
-        port->reply_queue = XPTR_MAKE(newq, xseg->segment);
-        xheap_free(q);
-        serial = __xq_append_tail(newq, xqi);
+        serial = __xq_append_tail(q, xqi);
     }
 
   out_rel:
@@ -1849,6 +2777,7 @@ xport xseg_forward(struct xseg * xseg, struct xseg_request * req,
     return xseg_submit(xseg, req, portno, flags);
 }
 
+/* route requests leaving portno through next, or clear it with NoPort */
 int xseg_set_path_next(struct xseg *xseg, xport portno, xport next)
 {
     if (!xseg) {
@@ -1858,82 +2787,251 @@ int xseg_set_path_next(struct xseg *xseg, xport portno, xport next)
     if (!__validate_port(xseg, portno)) {
         return -1;
     }
-    if (!__validate_port(xseg, next)) {
+    if (next != NoPort && !__validate_port(xseg, next)) {
         return -1;
     }
     xseg->path_next[portno] = next;
+    __routes_changed(xseg);
     return 0;
 }
 
-int xseg_set_req_data(struct xseg *xseg, struct xseg_request *xreq, void *data)
+/* route requests for dst through gateway gw, or clear it with NoPort */
+int xseg_set_dst_gw(struct xseg *xseg, xport dst, xport gw)
 {
-    int r;
-    xhash_t *req_data;
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return -1;
+    }
+    if (!__validate_port(xseg, dst)) {
+        return -1;
+    }
+    if (gw != NoPort && !__validate_port(xseg, gw)) {
+        return -1;
+    }
+    xseg->dst_gw[dst] = gw;
+    __routes_changed(xseg);
+    return 0;
+}
+
+/*
+ * Make group a port group dispatching with policy, or change its policy.
+ * Groups are never freed, since submitters of any process may be looking at
+ * them; a destroyed group is kept inactive and made again on create.
+ */
+int xseg_create_group(struct xseg *xseg, xport group, uint32_t policy)
+{
+    struct xseg_port_group *g;
 
     if (!xseg) {
         XSEGLOG("Invalid xseg argument");
         return -1;
     }
-    if (!xreq) {
-        XSEGLOG("Invalid xreq argument");
+    if (!__validate_port(xseg, group) || policy > XSEG_GROUP_P2C) {
+        return -1;
+    }
+
+    __lock_segment(xseg);
+    g = __get_group(xseg, group);
+    if (!g) {
+        g = xheap_allocate(xseg->heap, sizeof(struct xseg_port_group));
+        if (!g) {
+            __unlock_segment(xseg);
+            XSEGLOG("Cannot allocate memory");
+            return -1;
+        }
+        xlock_release(&g->lock);
+        g->members = 0;
+        g->cursor = 0;
+        g->active = 0;
+        g->policy = policy;
+        MFENCE();
+        xseg->groups[group] = XPTR_MAKE(g, xseg->segment);
+    }
+    g->policy = policy;
+    g->active = 1;
+    __unlock_segment(xseg);
+    return 0;
+}
+
+int xseg_destroy_group(struct xseg *xseg, xport group)
+{
+    struct xseg_port_group *g;
+
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
         return -1;
     }
+    if (!__validate_port(xseg, group)) {
+        return -1;
+    }
+    g = __get_group(xseg, group);
+    if (!g) {
+        return -1;
+    }
+    xlock_acquire(&g->lock);
+    g->active = 0;
+    g->members = 0;
+    xlock_release(&g->lock);
+    return 0;
+}
+
+/* add portno to group. Requests submitted to the group may go to it at once */
+int xseg_join_group(struct xseg *xseg, xport group, xport portno)
+{
+    struct xseg_port_group *g;
+    uint64_t mask;
+    uint32_t slot;
+    int r = -1;
 
-    xlock_acquire(&xseg->priv->reqdatalock);
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return -1;
+    }
+    if (!__validate_port(xseg, group) || !__validate_port(xseg, portno)) {
+        return -1;
+    }
+    g = __get_group(xseg, group);
+    if (!g) {
+        return -1;
+    }
 
-    req_data = xseg->priv->req_data;
-    r = xhash_insert(req_data, (xhashidx) xreq, (xhashidx) data);
-    if (r == -XHASH_ERESIZE) {
-        req_data =
-            xhash_resize(req_data, xhash_grow_size_shift(req_data), 0, NULL);
-        if (req_data) {
-            xseg->priv->req_data = req_data;
-            r = xhash_insert(req_data, (xhashidx) xreq, (xhashidx) data);
+    xlock_acquire(&g->lock);
+    if (!g->active) {
+        goto out;
+    }
+    for (mask = g->members; mask; mask &= mask - 1) {
+        if (g->ports[__builtin_ctzll(mask)] == portno) {
+            r = 0;
+            goto out;
         }
     }
+    if (!~g->members) {
+        XSEGLOG("Group %u is full", group);
+        goto out;
+    }
+    slot = __builtin_ctzll(~g->members);
+    g->ports[slot] = portno;
+    /* fill the slot before it shows up in the mask */
+    MFENCE();
+    g->members |= 1ULL << slot;
+    r = 0;
+  out:
+    xlock_release(&g->lock);
+    return r;
+}
+
+int xseg_leave_group(struct xseg *xseg, xport group, xport portno)
+{
+    struct xseg_port_group *g;
+    uint64_t mask;
+    uint32_t slot;
+    int r = -1;
+
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return -1;
+    }
+    if (!__validate_port(xseg, group)) {
+        return -1;
+    }
+    g = __get_group(xseg, group);
+    if (!g) {
+        return -1;
+    }
 
-    xlock_release(&xseg->priv->reqdatalock);
+    xlock_acquire(&g->lock);
+    for (mask = g->members; mask; mask &= mask - 1) {
+        slot = __builtin_ctzll(mask);
+        if (g->ports[slot] == portno) {
+            g->members &= ~(1ULL << slot);
+            r = 0;
+            break;
+        }
+    }
+    xlock_release(&g->lock);
     return r;
 }
 
-int xseg_get_req_data(struct xseg *xseg, struct xseg_request *xreq,
-                      void **data)
+/*
+ * Request objects do not overlap, so their offsets in the segment, divided
+ * by the object size, give each request a distinct slot.
+ */
+static int __req_data_slot(struct xseg *xseg, struct xseg_request *xreq,
+                           uint64_t * page, uint64_t * slot)
 {
-    int r;
-    xhashidx val;
-    xhash_t *req_data;
+    unsigned long off = (unsigned long) xreq - (unsigned long) xseg->segment;
+    uint64_t idx;
+
+    if (off >= xseg->segment_size) {
+        return -1;
+    }
+    idx = off / xseg->request_h->obj_size;
+    *page = idx >> REQ_DATA_PAGE_SHIFT;
+    *slot = idx & (REQ_DATA_PAGE_SIZE - 1);
+    return 0;
+}
+
+/*
+ * Request data are process local and do not need a lock. Pages of slots are
+ * allocated on first use, and a request's data are taken atomically by
+ * xseg_get_req_data. Setting NULL data is the same as clearing them.
+ */
+int xseg_set_req_data(struct xseg *xseg, struct xseg_request *xreq, void *data)
+{
+    struct xseg_peer_operations *pops;
+    uint64_t page, slot;
+    void **pg, **new;
 
     if (!xseg) {
         XSEGLOG("Invalid xseg argument");
         return -1;
     }
-    if (!xreq) {
+    if (!xreq || __req_data_slot(xseg, xreq, &page, &slot) < 0) {
         XSEGLOG("Invalid xreq argument");
         return -1;
     }
 
-    xlock_acquire(&xseg->priv->reqdatalock);
-
-    req_data = xseg->priv->req_data;
-    //maybe we need a xhash_delete with lookup...
-    //maybe we also need a delete that doesn't shrink xhash
-    r = xhash_lookup(req_data, (xhashidx) xreq, &val);
-    *data = (void *) val;
-    if (r >= 0) {
-        r = xhash_delete(req_data, (xhashidx) xreq);
-        if (r == -XHASH_ERESIZE) {
-            req_data =
-                xhash_resize(req_data, xhash_shrink_size_shift(req_data), 0,
-                             NULL);
-            if (req_data) {
-                xseg->priv->req_data = req_data;
-                r = xhash_delete(req_data, (xhashidx) xreq);
-            }
+    pg = xseg->priv->req_data[page];
+    if (UNLIKELY(!pg)) {
+        pops = &xseg->priv->peer_type.peer_ops;
+        new = pops->malloc(sizeof(void *) * REQ_DATA_PAGE_SIZE);
+        if (!new) {
+            XSEGLOG("Cannot allocate memory");
+            return -1;
         }
+        memset(new, 0, sizeof(void *) * REQ_DATA_PAGE_SIZE);
+        if (!__sync_bool_compare_and_swap(&xseg->priv->req_data[page],
+                                          NULL, new)) {
+            pops->mfree(new);
+        }
+        pg = xseg->priv->req_data[page];
     }
+    pg[slot] = data;
+    return 0;
+}
 
-    xlock_release(&xseg->priv->reqdatalock);
-    return r;
+int xseg_get_req_data(struct xseg *xseg, struct xseg_request *xreq,
+                      void **data)
+{
+    uint64_t page, slot;
+    void **pg;
+
+    *data = NULL;
+    if (!xseg) {
+        XSEGLOG("Invalid xseg argument");
+        return -1;
+    }
+    if (!xreq || __req_data_slot(xseg, xreq, &page, &slot) < 0) {
+        XSEGLOG("Invalid xreq argument");
+        return -1;
+    }
+
+    pg = xseg->priv->req_data[page];
+    if (!pg) {
+        return -1;
+    }
+    *data = __sync_lock_test_and_set(&pg[slot], NULL);
+    return (*data ? 0 : -1);
 }
 
 struct xobject_h *xseg_get_objh(struct xseg *xseg, uint32_t magic,
@@ -1950,7 +3048,7 @@ struct xobject_h *xseg_get_objh(struct xseg *xseg, uint32_t magic,
     }
     r = xobj_handler_init(obj_h, xseg->segment, magic, size, xseg->heap);
     if (r < 0) {
-        xobj_put_obj(xseg->object_handlers, obj_h);
+        __put_obj(xseg, xseg->object_handlers, obj_h);
         return NULL;
     }
     return obj_h;
@@ -1962,7 +3060,7 @@ void xseg_put_objh(struct xseg *xseg, struct xobject_h *objh)
         XSEGLOG("Invalid argument");
         return;
     }
-    xobj_put_obj(xseg->object_handlers, objh);
+    __put_obj(xseg, xseg->object_handlers, objh);
 }
 
 
@@ -2053,6 +3151,7 @@ struct xseg_port *xseg_bind_port(struct xseg *xseg, uint32_t req, void *sd)
         port->portno = portno;
         port->flags = CAN_ACCEPT | CAN_RECEIVE;
         xseg->ports[portno] = XPTR_MAKE(port, xseg->segment);
+        __routes_changed(xseg);
         goto out;
     }
     if (port) {
@@ -2065,91 +3164,120 @@ struct xseg_port *xseg_bind_port(struct xseg *xseg, uint32_t req, void *sd)
     return port;
 }
 
+/*
+ * Free dynamic ports are tracked in a bitmap in the shared segment, with one
+ * bit per port from config.dynports on, set while the port has no owner.
+ * Binding claims a set bit with a CAS and leaving sets it again, so neither
+ * scans the ports or holds the segment lock for them.
+ */
+static xport __claim_dynport(struct xseg *xseg)
+{
+    uint64_t *map = XPTR_TAKE(xseg->shared->dynport_map, xseg->segment);
+    uint64_t word;
+    uint32_t i, bit;
+
+    for (i = 0; i < DYNPORT_WORDS(&xseg->config); i++) {
+        word = *(volatile uint64_t *) &map[i];
+        while (word) {
+            bit = __builtin_ctzll(word);
+            if (__sync_bool_compare_and_swap(&map[i], word,
+                                             word & ~(1ULL << bit))) {
+                return xseg->config.dynports + i * 64 + bit;
+            }
+            word = *(volatile uint64_t *) &map[i];
+        }
+    }
+    return NoPort;
+}
+
+static void __release_dynport(struct xseg *xseg, xport portno)
+{
+    uint64_t *map = XPTR_TAKE(xseg->shared->dynport_map, xseg->segment);
+    uint32_t i = portno - xseg->config.dynports;
+
+    __sync_fetch_and_or(&map[i / 64], 1ULL << (i % 64));
+}
+
 struct xseg_port *xseg_bind_dynport(struct xseg *xseg)
 {
-    uint32_t portno, maxno, id = __get_id();
+    uint32_t portno, id = __get_id();
     struct xseg_port *port = NULL;
     void *peer_data, *sigdesc;
     int64_t driver;
-    int r, has_sd = 0, port_allocated = 0;
+    int r, port_allocated = 0;
 
     if (!xseg) {
         XSEGLOG("Invalid argument");
         return NULL;
     }
 
-    maxno = xseg->config.nr_ports;
-
     __lock_segment(xseg);
     driver = __enable_driver(xseg, &xseg->priv->peer_type);
+    __unlock_segment(xseg);
     if (driver < 0) {
         return NULL;
     }
 
-    for (portno = xseg->config.dynports; portno < maxno; portno++) {
-        if (!xseg->ports[portno]) {
-            port = xseg_alloc_port(xseg, X_ALLOC, XSEG_DEF_REQS);
-            if (!port) {
-                goto out;
-            }
-            xseg->ports[portno] = XPTR_MAKE(port, xseg->segment);
-            port_allocated = 1;
-        } else {
-            port = xseg_get_port(xseg, portno);
-            if (!port) {
-                goto out;
-            }
-            if (port->owner != NoOwner) {
-                continue;
-            }
+    portno = __claim_dynport(xseg);
+    if (portno == NoPort) {
+        return NULL;
+    }
 
-            if (port->signal_desc) {
-                if (port->peer_type == driver) {
-                    has_sd = 1;
-                } else {
-                    /* Just abandon the old signal desc.
-                     * We can't be really sure when to free
-                     * it.
-                     * Minor memory leak.
-                     */
-                    port->signal_desc = 0;
-                }
-            }
+    /* the port is ours now, and nobody else touches its slot */
+    if (!xseg->ports[portno]) {
+        port = xseg_alloc_port(xseg, X_ALLOC, XSEG_DEF_REQS);
+        if (!port) {
+            goto out_release;
         }
-        if (!has_sd) {
-            peer_data = __get_peer_type_data(xseg, (uint64_t) driver);
-            if (!peer_data) {
-                break;
-            }
-            sigdesc =
-                xseg->priv->peer_type.peer_ops.alloc_signal_desc(xseg,
-                                                                 peer_data);
-            if (!sigdesc) {
-                break;
-            }
-            r = xseg->priv->peer_type.peer_ops.init_signal_desc(xseg, sigdesc);
-            if (r < 0) {
-                xseg->priv->peer_type.peer_ops.free_signal_desc(xseg,
-                                                                peer_data,
-                                                                sigdesc);
-                break;
-            }
-            port->signal_desc = XPTR_MAKE(sigdesc, xseg->segment);
+        xseg->ports[portno] = XPTR_MAKE(port, xseg->segment);
+        port_allocated = 1;
+    } else {
+        port = xseg_get_port(xseg, portno);
+        if (!port) {
+            goto out_release;
         }
-        port->peer_type = (uint64_t) driver;
-        port->owner = id;
-        port->portno = portno;
-        port->flags = CAN_ACCEPT | CAN_RECEIVE;
-        goto out;
+        if (port->signal_desc && port->peer_type != driver) {
+            /* Just abandon the old signal desc.
+             * We can't be really sure when to free
+             * it.
+             * Minor memory leak.
+             */
+            port->signal_desc = 0;
+        }
+    }
+    if (!port->signal_desc) {
+        peer_data = __get_peer_type_data(xseg, (uint64_t) driver);
+        if (!peer_data) {
+            goto out_free;
+        }
+        sigdesc =
+            xseg->priv->peer_type.peer_ops.alloc_signal_desc(xseg, peer_data);
+        if (!sigdesc) {
+            goto out_free;
+        }
+        r = xseg->priv->peer_type.peer_ops.init_signal_desc(xseg, sigdesc);
+        if (r < 0) {
+            xseg->priv->peer_type.peer_ops.free_signal_desc(xseg, peer_data,
+                                                            sigdesc);
+            goto out_free;
+        }
+        port->signal_desc = XPTR_MAKE(sigdesc, xseg->segment);
     }
+    port->peer_type = (uint64_t) driver;
+    port->owner = id;
+    port->portno = portno;
+    port->flags = CAN_ACCEPT | CAN_RECEIVE;
+    __routes_changed(xseg);
+    return port;
+
+  out_free:
     if (port_allocated) {
-        xseg_free_port(xseg, port);
         xseg->ports[portno] = 0;
+        xseg_free_port(xseg, port);
     }
-    port = NULL;
-  out:
-    __unlock_segment(xseg);
-    return port;
+  out_release:
+    __release_dynport(xseg, portno);
+    return NULL;
 }
 
 int xseg_leave_dynport(struct xseg *xseg, struct xseg_port *port)
@@ -2158,13 +3286,14 @@ int xseg_leave_dynport(struct xseg *xseg, struct xseg_port *port)
         XSEGLOG("Invalid argument");
         return -1;
     }
-    if (!port) {
+    if (!port || port->portno < xseg->config.dynports ||
+        port->portno >= xseg->config.nr_ports) {
         return -1;
     }
 
-    __lock_segment(xseg);
     port->owner = NoOwner;
-    __unlock_segment(xseg);
+    /* a full barrier, so the port is seen unowned once it is free */
+    __release_dynport(xseg, port->portno);
     return 0;
 }
 
@@ -2187,7 +3316,7 @@ int xseg_set_max_requests(struct xseg *xseg, xport portno, uint64_t nr_reqs)
         XSEGLOG("Invalid argument");
         return -1;
     }
-    if (nr_reqs > XSEG_MAX_ALLOCATED_REQS) {
+    if (nr_reqs > xseg_get_request_capacity(xseg)) {
         return -1;
     }
 
@@ -2209,6 +3338,7 @@ int xseg_set_max_requests(struct xseg *xseg, xport portno, uint64_t nr_reqs)
      * the new limit.
      */
     port->max_alloc_reqs = nr_reqs;
+    __signal_port(xseg, portno);
     return r;
 }
 
@@ -2240,6 +3370,88 @@ uint64_t xseg_get_allocated_requests(struct xseg * xseg, xport portno)
     return port->alloc_reqs;
 }
 
+/*
+ * Limit the requests each source port may have in flight to the port, or lift
+ * the limit with a window of 0. Submits over the window fail with errno set to
+ * EAGAIN, until replies come back.
+ */
+int xseg_set_window(struct xseg *xseg, xport portno, uint32_t window)
+{
+    struct xseg_port *port;
+    uint64_t size;
+    void *mem;
+    xptr ptr;
+
+    if (!xseg) {
+        XSEGLOG("Invalid argument");
+        return -1;
+    }
+    port = xseg_get_port(xseg, portno);
+    if (!port) {
+        return -1;
+    }
+
+    if (window && !port->inflight) {
+        size = sizeof(uint32_t) * xseg->config.nr_ports;
+        mem = xseg_alloc_buffer(xseg, size);
+        if (!mem) {
+            return -1;
+        }
+        memset(mem, 0, size);
+        ptr = XPTR_MAKE(mem, xseg->segment);
+        if (!__sync_bool_compare_and_swap(&port->inflight, 0, ptr)) {
+            __heap_free(xseg, mem);
+        }
+    }
+    /* the counters are in place before anyone sees the window */
+    MFENCE();
+    port->window = window;
+    return 0;
+}
+
+uint32_t xseg_get_window(struct xseg *xseg, xport portno)
+{
+    struct xseg_port *port;
+
+    if (!xseg) {
+        XSEGLOG("Invalid argument");
+        return 0;
+    }
+    port = xseg_get_port(xseg, portno);
+    if (!port) {
+        return 0;
+    }
+    return port->window;
+}
+
+/*
+ * Credits left to the source port for requests to the destination port, or
+ * (uint32_t) -1 if the destination has no window.
+ */
+uint32_t xseg_get_credits(struct xseg *xseg, xport src_portno,
+                          xport dst_portno)
+{
+    struct xseg_port *port;
+    volatile uint32_t *inflight;
+    uint32_t window, used;
+
+    if (!xseg || !__validate_port(xseg, src_portno)) {
+        XSEGLOG("Invalid argument");
+        return 0;
+    }
+    port = xseg_get_port(xseg, dst_portno);
+    if (!port) {
+        return 0;
+    }
+    window = port->window;
+    if (!window) {
+        return (uint32_t) -1;
+    }
+    inflight = XPTR_TAKE(port->inflight, xseg->segment);
+    used = inflight[src_portno];
+    return (used < window) ? window - used : 0;
+}
+
 /*
  * set free_queue size, aka the local "cached" requests a port can have
  * it should be smaller than port->max_alloc_reqs?
@@ -2250,7 +3462,7 @@ int xseg_set_freequeue_size(struct xseg *xseg, xport portno, xqindex size,
 {
     int ret = 0;
     xqindex xqi, r;
-    struct xq *q, *newq;
+    struct xq *q, *newq, *drain;
     struct xseg_request *xreq;
     struct xseg_port *port;
 
@@ -2278,23 +3490,40 @@ int xseg_set_freequeue_size(struct xseg *xseg, xport portno, xqindex size,
 
     q = XPTR_TAKE(port->free_queue, xseg->segment);
 
-    /* put requests that don't fit in the new queue */
-    while (xq_count(q) > xq_size(newq)) {
-        xqi = __xq_pop_head(q);
+    if (!port->free_drain && xq_size(newq) >= xq_size(q)) {
+        /* gets empty the old ring first, no need to copy it */
+        port->free_drain = port->free_queue;
+        port->free_queue = XPTR_MAKE(newq, xseg->segment);
+        goto out_rel;
+    }
+
+    /* put requests that don't fit in the new queue, the drained ones first */
+    while (xseg_queue_count(xseg, port, free) > xq_size(newq)) {
+        xqi = __queue_pop(xseg, &port->free_queue, &port->free_drain);
         if (xqi != Noneidx) {
             xreq = XPTR_TAKE(xqi, xseg->segment);
-            xobj_put_obj(xseg->request_h, (void *) xreq);
+            __put_obj(xseg, xseg->request_h, (void *) xreq);
+        }
+    }
+
+    /* then move what is left in the drain ahead of the current ring */
+    drain = xseg_get_drain(xseg, port, free_drain);
+    if (drain) {
+        while ((xqi = __xq_pop_head(drain)) != Noneidx) {
+            __xq_append_tail(newq, xqi);
         }
+        port->free_drain = 0;
+        __heap_free(xseg, drain);
     }
 
     r = __xq_resize(q, newq);
     if (r == Noneidx) {
-        xheap_free(newq);
+        __heap_free(xseg, newq);
         ret = -1;
         goto out_rel;
     }
     port->free_queue = XPTR_MAKE(newq, xseg->segment);
-    xheap_free(q);
+    __heap_free(xseg, q);
     ret = 0;
 
   out_rel:
@@ -96,6 +96,11 @@ void *xtypes_malloc(unsigned long size)
     return malloc(size);
 }
 
+void *xtypes_realloc(void *ptr, unsigned long size)
+{
+    return realloc(ptr, size);
+}
+
 void xtypes_free(void *ptr)
 {
     free(ptr);
@@ -22,95 +22,77 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //add resize capability
 //add custom compare functions
 
-#define SWAP(_a_, _b_)				\
-	do {					\
-		typeof(_a_) __temp__ = _a_; 	\
-		_a_ = _b_; 			\
-		_b_ = __temp__ ; 		\
-	} while (0)
-
-static inline void swap_nodes(struct xbinheap *h, xbinheapidx a, xbinheapidx b)
+static inline int isMaxHeap(struct xbinheap *h)
 {
-    xbinheapidx h1, h2;
-    h1 = h->nodes[a].h;
-    h2 = h->nodes[b].h;
-    //XSEGLOG("Swaping %llu, %llu", a, b);
-    SWAP(h->nodes[a].key, h->nodes[b].key);
-    SWAP(h->nodes[a].value, h->nodes[b].value);
-    SWAP(h->nodes[a].h, h->nodes[b].h);
-    SWAP(h->indexes[h1], h->indexes[h2]);
-    //XSEGLOG("Index[%llu]: %llu, Index[%llu]: %lli", a, h->indexes[a], b, h->indexes[b]);
+    return (h->flags & XBINHEAP_MAX);
 }
 
-static inline int isMaxHeap(struct xbinheap *h)
+/* whether key a belongs above key b */
+static inline int above(struct xbinheap *h, xbinheapidx a, xbinheapidx b)
 {
-    return (h->flags & XBINHEAP_MAX);
+    return isMaxHeap(h) ? a > b : a < b;
 }
 
+static inline void place(struct xbinheap *h, xbinheapidx i, xbinheapidx key,
+                         xbinheapidx value, xbinheap_handler hd)
+{
+    h->keys[i] = key;
+    h->nodes[i].value = value;
+    h->nodes[i].h = hd;
+    h->indexes[hd] = i;
+}
+
+/*
+ * Both sift functions move the node at i into a hole, shifting the nodes it
+ * passes by one level, and store it once at its final position.
+ */
 static int heapify_up(struct xbinheap *h, xbinheapidx i)
 {
     xbinheapidx parent;
-    struct xbinheap_node *n, *pn;
-    int cmp;
-    if (!i) {
-        return 0;
-    }
-    parent = (i - 1) / 2;
-    n = &h->nodes[i];
-    pn = &h->nodes[parent];
-    //XSEGLOG("i: %llu, p: %llu, count: %lu", n->key, pn->key, h->count);
-    if (isMaxHeap(h)) {
-        cmp = pn->key < n->key;
-    } else {
-        cmp = pn->key > n->key;
-    }
-    if (cmp) {
-        swap_nodes(h, i, parent);
-        return heapify_up(h, parent);
+    xbinheapidx key = h->keys[i];
+    xbinheapidx value = h->nodes[i].value;
+    xbinheap_handler hd = h->nodes[i].h;
+
+    while (i) {
+        parent = (i - 1) >> h->shift;
+        if (!above(h, key, h->keys[parent])) {
+            break;
+        }
+        place(h, i, h->keys[parent], h->nodes[parent].value, h->nodes[parent].h);
+        i = parent;
     }
+    place(h, i, key, value, hd);
     return 0;
 }
 
 static int heapify_down(struct xbinheap *h, xbinheapidx i)
 {
-    xbinheapidx left, right, largest;
-    struct xbinheap_node *n, *ln, *rn, *largest_n;
-    left = 2 * i + 1;
-    right = 2 * i + 1 + 1;
-    largest = i;
-    (void) n;
-    //n = &h->nodes[i];
-    ln = &h->nodes[left];
-    rn = &h->nodes[right];
-    largest_n = &h->nodes[largest];
-    if (isMaxHeap(h)) {
-        //      XSEGLOG("l: %llu, r: %llu, p: %llu, count: %lu", ln->key, rn->key, largest_n->key, h->count);
-        if (left < h->count && (ln->key > largest_n->key)) {
-            largest = left;
-            largest_n = &h->nodes[largest];
-        }
-        if (right < h->count && (rn->key > largest_n->key)) {
-            largest = right;
-            largest_n = &h->nodes[largest];
-        }
-        if (largest != i) {
-            swap_nodes(h, i, largest);
-            return heapify_down(h, largest);
+    xbinheapidx child, best, last, c;
+    xbinheapidx key = h->keys[i];
+    xbinheapidx value = h->nodes[i].value;
+    xbinheap_handler hd = h->nodes[i].h;
+
+    for (;;) {
+        child = (i << h->shift) + 1;
+        if (child >= h->count) {
+            break;
         }
-    } else {
-        if (left < h->count && ln->key < largest_n->key) {
-            largest = left;
-            largest_n = &h->nodes[largest];
+        last = child + ((xbinheapidx) 1 << h->shift);
+        if (last > h->count) {
+            last = h->count;
         }
-        if (right < h->count && rn->key < largest_n->key) {
-            largest = right;
-            largest_n = &h->nodes[largest];
+        /* the children share a cache line, pick the best without branches */
+        best = child;
+        for (c = child + 1; c < last; c++) {
+            best = above(h, h->keys[c], h->keys[best]) ? c : best;
         }
-        if (largest != i) {
-            swap_nodes(h, i, largest);
-            return heapify_down(h, largest);
+        if (!above(h, h->keys[best], key)) {
+            break;
         }
+        place(h, i, h->keys[best], h->nodes[best].value, h->nodes[best].h);
+        i = best;
     }
+    place(h, i, key, value, hd);
     return 0;
 }
 
@@ -122,14 +104,45 @@ xbinheap_handler xbinheap_insert(struct xbinheap * h, xbinheapidx key,
         return NoNode;
     }
     ret = h->nodes[h->count].h;
-    h->nodes[h->count].key = key;
+    h->keys[h->count] = key;
     h->nodes[h->count].value = value;
-    //h->indexes[h->count] = h->count;
-    heapify_up(h, h->count);
     h->count++;
+    heapify_up(h, h->count - 1);
     return ret;
 }
 
+/*
+ * Insert n nodes at once and restore the heap property bottom up, in time
+ * linear to the size of the heap. The handler of each node is returned in
+ * handlers, unless it is NULL.
+ */
+int xbinheap_build(struct xbinheap *h, xbinheapidx * keys,
+                   xbinheapidx * values, xbinheapidx n,
+                   xbinheap_handler * handlers)
+{
+    xbinheapidx i;
+
+    if (h->count + n > h->size) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (handlers) {
+            handlers[i] = h->nodes[h->count].h;
+        }
+        h->keys[h->count] = keys[i];
+        h->nodes[h->count].value = values[i];
+        h->count++;
+    }
+    if (h->count < 2) {
+        return 0;
+    }
+    i = ((h->count - 2) >> h->shift) + 1;
+    while (i--) {
+        heapify_down(h, i);
+    }
+    return 0;
+}
+
 int xbinheap_empty(struct xbinheap *h)
 {
     return (h->count == 0);
@@ -147,13 +160,23 @@ xbinheapidx xbinheap_peak(struct xbinheap * h)
 /* extract min or max */
 xbinheapidx xbinheap_extract(struct xbinheap * h)
 {
-    xbinheapidx ret = h->nodes[0].value;
+    xbinheapidx ret, key, last;
+    xbinheap_handler hd;
+
     if (xbinheap_empty(h)) {
         return NoNode;
     }
+    key = h->keys[0];
+    ret = h->nodes[0].value;
+    hd = h->nodes[0].h;
     h->count--;
-    swap_nodes(h, 0, h->count);
-    heapify_down(h, 0);
+    last = h->count;
+    if (last) {
+        place(h, 0, h->keys[last], h->nodes[last].value, h->nodes[last].h);
+        heapify_down(h, 0);
+    }
+    /* the handler is free again, after the ones in use */
+    place(h, last, key, ret, hd);
     return ret;
 }
 
@@ -162,11 +185,8 @@ int xbinheap_increasekey(struct xbinheap *h, xbinheap_handler idx,
 {
     int r;
     xbinheapidx i = h->indexes[idx];
-    struct xbinheap_node *hn = &h->nodes[i];
-    //XSEGLOG("h: %llu, index: %llu, key: %llu, newkey:%llu",
-    //              idx, i, hn->key, newkey);
-    //assert newkey > hn->key
-    hn->key = newkey;
+    //assert newkey > h->keys[i]
+    h->keys[i] = newkey;
     if (isMaxHeap(h)) {
         r = heapify_up(h, i);
     } else {
@@ -181,30 +201,40 @@ xbinheapidx xbinheap_getkey(struct xbinheap * h, xbinheap_handler idx)
     if (i > h->count) {
         return NoNode;
     }
-    return h->nodes[i].key;
+    return h->keys[i];
 }
 
+/*
+ * With mem, the arrays are laid out in the given 4 * size indexes. Otherwise
+ * they are allocated, so that the children of a node start at a cache line
+ * boundary: keys is offset by 7 indexes from a 64 byte boundary, which puts
+ * the first child of node i, at 4 * i + 1, at 32 * (i + 1) bytes from it.
+ */
 int xbinheap_init(struct xbinheap *h, xbinheapidx size, uint32_t flags,
                   void *mem)
 {
-    xbinheapidx i;
+    xbinheapidx i, *base;
+
+    h->alloc = NULL;
     if (!mem) {
-        h->indexes = xtypes_malloc(sizeof(xbinheapidx) * size);
-        h->nodes = xtypes_malloc(sizeof(struct xbinheap_node) * size);
-        if (!h->indexes || !h->nodes) {
-            xtypes_free(h->indexes);
-            xtypes_free(h->nodes);
+        h->alloc = xtypes_malloc(sizeof(xbinheapidx) * (4 * size + 8) + 63);
+        if (!h->alloc) {
             return -1;
         }
+        base = (xbinheapidx *) (((unsigned long) h->alloc + 63) & ~63UL);
+        h->keys = base + 7;
+        h->nodes = (struct xbinheap_node *) (base + 8 + size);
     } else {
-        h->indexes = mem;
-        h->nodes = (void *) ((unsigned long) mem + sizeof(xbinheapidx) * size);
+        h->keys = mem;
+        h->nodes = (struct xbinheap_node *) (h->keys + size);
     }
+    h->indexes = (xbinheapidx *) (h->nodes + size);
     for (i = 0; i < size; i++) {
         h->nodes[i].h = i;
         h->indexes[i] = i;
     }
     h->flags = flags;
+    h->shift = (flags & XBINHEAP_4ARY) ? 2 : 1;
     h->size = size;
     h->count = 0;
     return 0;
@@ -212,8 +242,8 @@ int xbinheap_init(struct xbinheap *h, xbinheapidx size, uint32_t flags,
 
 void xbinheap_free(struct xbinheap *h)
 {
-    xtypes_free(h->indexes);
-    xtypes_free(h->nodes);
+    xtypes_free(h->alloc);
+    h->alloc = NULL;
 }
 
 
@@ -222,11 +252,8 @@ int xbinheap_decreasekey(struct xbinheap *h, xbinheap_handler idx,
 {
     int r;
     xbinheapidx i = h->indexes[idx];
-    struct xbinheap_node *hn = &h->nodes[i];
-    //XSEGLOG("h: %llu, index: %llu, key: %llu, newkey:%llu",
-    //              idx, i, hn->key, newkey);
-    //assert newkey > hn->key
-    hn->key = newkey;
+    //assert newkey < h->keys[i]
+    h->keys[i] = newkey;
     if (isMaxHeap(h)) {
         r = heapify_down(h, i);
     } else {
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <xseg/xcache.h>
 #include <string.h>
+#include <pthread.h>
 
 //TODO container aware and xptrs
 
@@ -44,15 +45,46 @@ static void __free_cache_entry(struct xcache *cache, xqindex idx)
 #endif
 
 /* table helper functions */
-static xcache_handler __table_lookup(xhash_t * table, char *name)
+static xcache_handler __table_lookup(xhash_t * table, char *name,
+                                     xhashidx hash)
 {
     xqindex xqi = Noneidx;
-    if (xhash_lookup(table, (xhashidx) name, &xqi) < 0) {
+    if (xhash_lookup_hash(table, (xhashidx) name, hash, &xqi) < 0) {
         return NoEntry;
     }
     return (xcache_handler) xqi;
 }
 
+/*
+ * Wait for a grace period: every lock-free reader that might have seen memory
+ * unlinked before this call, has left its lookup when this returns.
+ */
+static void __wait_readers(struct xcache *cache)
+{
+    uint64_t epoch, e;
+    uint32_t i;
+
+    if (!cache->readers) {
+        return;
+    }
+    epoch = __sync_add_and_fetch(&cache->epoch, 1);
+    for (i = 0; i < XCACHE_MAX_READERS; i++) {
+        do {
+            e = cache->readers[i].epoch;
+        } while (e && e < epoch);
+    }
+}
+
+/* free the previous table, once it has been drained into the current one */
+static void __table_reclaim(struct xcache *cache, xhash_t * table)
+{
+    xhash_t *old = xhash_reclaim(table);
+    if (old) {
+        __wait_readers(cache);
+        xhash_free(old);
+    }
+}
+
 static int __table_insert(xhash_t ** table, struct xcache *cache,
                           xcache_handler h)
 {
@@ -64,8 +96,9 @@ static int __table_insert(xhash_t ** table, struct xcache *cache,
     r = xhash_insert(*table, (xhashidx) ce->name, idx);
     if (r == -XHASH_ERESIZE) {
         XSEGLOG("Rebuilding internal hash table");
-        new =
-            xhash_resize(*table, (*table)->size_shift, (*table)->limit, NULL);
+        __table_reclaim(cache, *table);
+        new = xhash_resize_incremental(*table, (*table)->size_shift,
+                                       (*table)->limit, NULL);
         if (!new) {
             XSEGLOG("Error resizing hash table");
             return -1;
@@ -79,15 +112,17 @@ static int __table_insert(xhash_t ** table, struct xcache *cache,
             return -1;
         }
     }
+    __table_reclaim(cache, *table);
 
     return r;
 }
 
-static int __table_remove(xhash_t * table, char *name)
+static int __table_remove(xhash_t * table, struct xcache *cache, char *name)
 {
     int r;
 
     r = xhash_delete(table, (xhashidx) name);
+    __table_reclaim(cache, table);
     if (UNLIKELY(r < 0)) {
         if (r == -XHASH_ERESIZE) {
             XSEGLOG("BUG: hash table must be resized");
@@ -98,14 +133,205 @@ static int __table_remove(xhash_t * table, char *name)
     return r;
 }
 
-static xqindex alloc_cache_entry(struct xcache *cache)
+/* shard helper functions */
+static struct xcache_shard *__hash_shard(struct xcache *cache, xhashidx hash)
+{
+    /* the low bits of the hash pick the slot inside the shard's tables */
+    return &cache->shards[(hash >> 40) & (cache->nr_shards - 1)];
+}
+
+static struct xcache_shard *__idx_shard(struct xcache *cache, xqindex idx)
+{
+    return &cache->shards[idx >> cache->shard_shift];
+}
+
+/*
+ * Modifications of "entries" are enclosed in an odd shard sequence number, so
+ * that lock-free readers can tell if the table changed under their feet.
+ * Called with the shard lock held.
+ */
+static void __shard_write_begin(struct xcache_shard *shard)
+{
+    shard->seq++;
+    BARRIER();
+}
+
+static void __shard_write_end(struct xcache_shard *shard)
+{
+    BARRIER();
+    shard->seq++;
+}
+
+/*
+ * XCACHE_USE_FILTER
+ *
+ * A name is added to the filter of a table before it is inserted, and deleted
+ * after it is removed, so a reader that finds no trace of a name in the filter
+ * can be sure that the table did not index it, at some point during the probe.
+ */
+static int __filter_init(struct xcache_filter *f, uint32_t size)
+{
+    uint32_t nr = 8 * size < 64 ? 64 : 8 * size;
+
+    f->counters = xtypes_malloc(nr);
+    if (!f->counters) {
+        return -1;
+    }
+    memset((void *) f->counters, 0, nr);
+    f->mask = nr - 1;
+    return 0;
+}
+
+static void __filter_free(struct xcache_filter *f)
+{
+    xtypes_free((void *) f->counters);
+    f->counters = NULL;
+}
+
+static uint32_t __filter_idx(struct xcache_filter *f, xhashidx hash,
+                             uint32_t i)
+{
+    uint32_t h = (uint32_t) (hash >> 16) + i * ((uint32_t) (hash >> 32) | 1);
+    return h & f->mask;
+}
+
+static int filter_test(struct xcache_filter *f, xhashidx hash)
+{
+    uint32_t i;
+
+    for (i = 0; i < XCACHE_FILTER_HASHES; i++) {
+        if (!f->counters[__filter_idx(f, hash, i)]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* called with the lock of the filtered table held */
+static void __filter_add(struct xcache_filter *f, xhashidx hash)
+{
+    uint32_t i, c;
+
+    for (i = 0; i < XCACHE_FILTER_HASHES; i++) {
+        c = __filter_idx(f, hash, i);
+        if (f->counters[c] != UINT8_MAX) {
+            f->counters[c]++;
+        }
+    }
+    BARRIER();
+}
+
+static void __filter_del(struct xcache_filter *f, xhashidx hash)
+{
+    uint32_t i, c;
+
+    BARRIER();
+    for (i = 0; i < XCACHE_FILTER_HASHES; i++) {
+        c = __filter_idx(f, hash, i);
+        if (f->counters[c] != UINT8_MAX) {
+            f->counters[c]--;
+        }
+    }
+}
+
+/* names arena */
+static const uint32_t name_slot_size[XCACHE_NAME_CLASSES] = {
+    32, 64, 128, (XSEG_MAX_TARGETLEN + 1 + 7) & ~7
+};
+
+static uint32_t __name_class(uint32_t len)
+{
+    uint32_t c;
+
+    for (c = 0; c < XCACHE_NAME_CLASSES - 1; c++) {
+        if (len < name_slot_size[c]) {
+            break;
+        }
+    }
+    return c;
+}
+
+/*
+ * Copy name to a free slot of the shard arena. The last byte of a slot is
+ * never written, so a slot is always NULL terminated.
+ */
+static char *__names_alloc(struct xcache_names *names, char *name)
+{
+    uint32_t len = strnlen(name, XSEG_MAX_TARGETLEN);
+    uint32_t c = __name_class(len);
+    char *slot, *chunk;
+
+    xlock_acquire(&names->lock);
+    slot = names->free[c];
+    if (slot) {
+        names->free[c] = *(void **)slot;
+    } else {
+        if (names->end - names->next < name_slot_size[c]) {
+            chunk = xtypes_malloc(XCACHE_NAME_CHUNK);
+            if (!chunk) {
+                xlock_release(&names->lock);
+                return NULL;
+            }
+            memset(chunk, 0, XCACHE_NAME_CHUNK);
+            *(void **)chunk = names->chunks;
+            names->chunks = chunk;
+            names->next = chunk + sizeof(void *);
+            names->end = chunk + XCACHE_NAME_CHUNK;
+        }
+        slot = names->next;
+        names->next += name_slot_size[c];
+    }
+    xlock_release(&names->lock);
+
+    memcpy(slot, name, len);
+    slot[len] = 0;
+    return slot;
+}
+
+static void __names_free(struct xcache_names *names, char *slot)
 {
-    return xq_pop_head(&cache->free_nodes);
+    uint32_t c = __name_class(strlen(slot));
+
+    xlock_acquire(&names->lock);
+    *(void **)slot = names->free[c];
+    names->free[c] = slot;
+    xlock_release(&names->lock);
+}
+
+static void __names_init(struct xcache_names *names)
+{
+    uint32_t c;
+
+    xlock_release(&names->lock);
+    names->chunks = NULL;
+    names->next = NULL;
+    names->end = NULL;
+    for (c = 0; c < XCACHE_NAME_CLASSES; c++) {
+        names->free[c] = NULL;
+    }
+}
+
+static void __names_destroy(struct xcache_names *names)
+{
+    void *chunk;
+
+    while (names->chunks) {
+        chunk = names->chunks;
+        names->chunks = *(void **)chunk;
+        xtypes_free(chunk);
+    }
+}
+
+static xqindex alloc_cache_entry(struct xcache_shard *shard)
+{
+    return xq_pop_head(&shard->free_nodes);
 }
 
 static void __free_cache_entry(struct xcache *cache, xqindex idx)
 {
-    if (UNLIKELY(xq_append_head(&cache->free_nodes, idx) == Noneidx)) {
+    struct xcache_shard *shard = __idx_shard(cache, idx);
+
+    if (UNLIKELY(xq_append_head(&shard->free_nodes, idx) == Noneidx)) {
         XSEGLOG("BUG: Could not free cache entry node. Queue is full");
     }
 }
@@ -119,6 +345,10 @@ static void free_cache_entry(struct xcache *cache, xqindex idx)
                 idx);
     }
 
+    if (ce->name) {
+        __names_free(&__idx_shard(cache, idx)->names, ce->name);
+        ce->name = NULL;
+    }
     __free_cache_entry(cache, idx);
     if (cache->ops.on_free) {
         cache->ops.on_free(cache->priv, ce->priv);
@@ -127,64 +357,295 @@ static void free_cache_entry(struct xcache *cache, xqindex idx)
 
 static xqindex __count_free_nodes(struct xcache *cache)
 {
-    return xq_count(&cache->free_nodes);
+    uint32_t i;
+    xqindex count = 0;
+
+    for (i = 0; i < cache->nr_shards; i++) {
+        count += xq_count(&cache->shards[i].free_nodes);
+    }
+    return count;
 }
 
-static void __reset_times(struct xcache *cache)
+static void __reset_times(struct xcache *cache, struct xcache_shard *shard)
 {
-    uint32_t i;
+    uint32_t i, end;
     struct xcache_entry *ce;
     xbinheapidx time;
 
-    /* assert thatn cache->time does not get MAX value. If this happens, add
+    /* assert thatn shard->time does not get MAX value. If this happens, add
      * one more, to overflow time and return to zero.
      */
+    end = shard->first_node + (1 << cache->shard_shift);
     if (cache->flags & XCACHE_LRU_ARRAY) {
-        for (i = 0; i < cache->size; i++) {
+        for (i = shard->first_node; i < end; i++) {
             if (cache->times[i] != XCACHE_LRU_MAX) {
-                cache->times[i] = cache->time++;
+                cache->times[i] = shard->time++;
             }
         }
     } else if (cache->flags & XCACHE_LRU_HEAP) {
-        for (i = 0; i < cache->size; i++) {
+        for (i = shard->first_node; i < end; i++) {
             ce = &cache->nodes[i];
             if (ce->h == NoNode) {
                 continue;
             }
-            time = xbinheap_getkey(&cache->binheap, ce->h);
-            if (time < cache->time) {
-                xbinheap_increasekey(&cache->binheap, ce->h, cache->time);
+            time = xbinheap_getkey(&shard->binheap, ce->h);
+            if (time < shard->time) {
+                xbinheap_increasekey(&shard->binheap, ce->h, shard->time);
             } else {
-                xbinheap_decreasekey(&cache->binheap, ce->h, cache->time);
+                xbinheap_decreasekey(&shard->binheap, ce->h, shard->time);
             }
         }
     }
 }
 
 /*
- * xbinheap should be protected by cache lock.
+ * The list based policies keep the entries of a shard in doubly linked lists,
+ * in access order, linked through their node indexes. All list helpers must be
+ * called with the shard lock held.
+ */
+#define LIST_POLICIES (XCACHE_LRU_LIST | XCACHE_LRU_CLOCK | XCACHE_LRU_TINYLFU)
+
+static void __list_unlink(struct xcache *cache, struct xcache_shard *shard,
+                          xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+    struct xcache_list *l = &shard->lists[ce->list];
+
+    if (ce->lru_prev != Noneidx) {
+        cache->nodes[ce->lru_prev].lru_next = ce->lru_next;
+    } else {
+        l->head = ce->lru_next;
+    }
+    if (ce->lru_next != Noneidx) {
+        cache->nodes[ce->lru_next].lru_prev = ce->lru_prev;
+    } else {
+        l->tail = ce->lru_prev;
+    }
+    l->count--;
+    ce->lru_prev = Noneidx;
+    ce->lru_next = Noneidx;
+    ce->list = XCACHE_LIST_NONE;
+}
+
+static void __list_push_head(struct xcache *cache, struct xcache_shard *shard,
+                             uint32_t list, xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+    struct xcache_list *l = &shard->lists[list];
+
+    ce->lru_prev = Noneidx;
+    ce->lru_next = l->head;
+    if (l->head != Noneidx) {
+        cache->nodes[l->head].lru_prev = idx;
+    } else {
+        l->tail = idx;
+    }
+    l->head = idx;
+    l->count++;
+    ce->list = list;
+}
+
+static void __list_move_head(struct xcache *cache, struct xcache_shard *shard,
+                             uint32_t list, xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+
+    if (ce->list == list && shard->lists[list].head == idx) {
+        return;
+    }
+    if (ce->list != XCACHE_LIST_NONE) {
+        __list_unlink(cache, shard, idx);
+    }
+    __list_push_head(cache, shard, list, idx);
+}
+
+/*
+ * XCACHE_LRU_TINYLFU estimates access frequencies with a count-min sketch of
+ * four rows of 4-bit counters, packed sixteen to a word. Once the shard has
+ * seen ten times as many accesses as its size, all counters are halved, so
+ * that the sketch follows changes in popularity.
+ */
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+
+static uint32_t __sketch_idx(struct xcache_shard *shard, xhashidx hash,
+                             uint32_t row)
+{
+    /* double hashing, from the halves of the name hash */
+    uint32_t h = (uint32_t) (hash >> 8) + row * ((uint32_t) (hash >> 32) | 1);
+    return row * (shard->sketch_mask + 1) + (h & shard->sketch_mask);
+}
+
+static uint32_t __sketch_estimate(struct xcache_shard *shard, xhashidx hash)
+{
+    uint32_t row, c, freq = SKETCH_MAX;
+
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        c = __sketch_idx(shard, hash, row);
+        c = (shard->sketch[c >> 4] >> ((c & 15) << 2)) & SKETCH_MAX;
+        if (c < freq) {
+            freq = c;
+        }
+    }
+    return freq;
+}
+
+static void __sketch_increment(struct xcache_shard *shard, xhashidx hash)
+{
+    uint32_t row, c, shift;
+    uint64_t i, words;
+
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        c = __sketch_idx(shard, hash, row);
+        shift = (c & 15) << 2;
+        if (((shard->sketch[c >> 4] >> shift) & SKETCH_MAX) < SKETCH_MAX) {
+            shard->sketch[c >> 4] += 1ULL << shift;
+        }
+    }
+
+    if (++shard->sketch_samples < 10 * shard->size) {
+        return;
+    }
+    words = SKETCH_ROWS * ((uint64_t) shard->sketch_mask + 1) / 16;
+    for (i = 0; i < words; i++) {
+        shard->sketch[i] = (shard->sketch[i] >> 1) & 0x7777777777777777ULL;
+    }
+    shard->sketch_samples /= 2;
+}
+
+/*
+ * An accessed window entry moves to the head of the window, and the entries
+ * that overflow it move on to probation. A probation entry that is accessed
+ * again is promoted to protected, whose overflow is demoted back to probation.
+ */
+static void __tinylfu_access(struct xcache *cache, struct xcache_shard *shard,
+                             xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+    struct xcache_list *l;
+
+    __sketch_increment(shard, ce->hash);
+
+    switch (ce->list) {
+    case XCACHE_LIST_NONE:
+    case XCACHE_LIST_WINDOW:
+        __list_move_head(cache, shard, XCACHE_LIST_WINDOW, idx);
+        l = &shard->lists[XCACHE_LIST_WINDOW];
+        while (l->count > shard->window_size) {
+            __list_move_head(cache, shard, XCACHE_LIST_PROBATION, l->tail);
+        }
+        break;
+    case XCACHE_LIST_PROBATION:
+    case XCACHE_LIST_PROTECTED:
+        __list_move_head(cache, shard, XCACHE_LIST_PROTECTED, idx);
+        l = &shard->lists[XCACHE_LIST_PROTECTED];
+        while (l->count > shard->protected_size) {
+            __list_move_head(cache, shard, XCACHE_LIST_PROBATION, l->tail);
+        }
+        break;
+    }
+}
+
+/*
+ * Pick the victim of a full shard. Unless the window is smaller than its
+ * share, its oldest entry is the candidate for admission to the main cache.
+ * It is admitted only if it is estimated to be accessed more often than the
+ * oldest probation entry, which is evicted instead.
+ */
+static xqindex __tinylfu_victim(struct xcache *cache,
+                                struct xcache_shard *shard)
+{
+    struct xcache_list *window = &shard->lists[XCACHE_LIST_WINDOW];
+    xqindex candidate, victim;
+
+    victim = shard->lists[XCACHE_LIST_PROBATION].tail;
+    if (victim == Noneidx) {
+        victim = shard->lists[XCACHE_LIST_PROTECTED].tail;
+    }
+
+    if (window->count < shard->window_size && victim != Noneidx) {
+        return victim;
+    }
+
+    candidate = window->tail;
+    if (victim == Noneidx) {
+        return candidate;
+    }
+    if (candidate == Noneidx) {
+        return victim;
+    }
+
+    if (__sketch_estimate(shard, cache->nodes[candidate].hash) >
+        __sketch_estimate(shard, cache->nodes[victim].hash)) {
+        __list_move_head(cache, shard, XCACHE_LIST_PROBATION, candidate);
+        return victim;
+    }
+    return candidate;
+}
+
+/*
+ * XCACHE_LRU_CLOCK is implemented as second chance FIFO: a hit merely sets
+ * the reference bit of the entry, and eviction recycles referenced entries from
+ * the tail to the head, clearing their bit, until it finds one that is not.
+ */
+static xqindex __clock_victim(struct xcache *cache, struct xcache_shard *shard)
+{
+    struct xcache_list *l = &shard->lists[XCACHE_LIST_WINDOW];
+    struct xcache_entry *ce;
+
+    while (l->tail != Noneidx) {
+        ce = &cache->nodes[l->tail];
+        if (!ce->referenced) {
+            break;
+        }
+        ce->referenced = 0;
+        __list_move_head(cache, shard, XCACHE_LIST_WINDOW, l->tail);
+    }
+    return l->tail;
+}
+
+/*
+ * xbinheap should be protected by shard lock.
  */
-static void __update_access_time(struct xcache *cache, xqindex idx)
+static void __update_access_time(struct xcache *cache,
+                                 struct xcache_shard *shard, xqindex idx)
 {
     struct xcache_entry *ce = &cache->nodes[idx];
 
-    /* assert thatn cache->time does not get MAX value. If this happen,
+    /* the list policies need no clock */
+    if (cache->flags & XCACHE_LRU_LIST) {
+        __list_move_head(cache, shard, XCACHE_LIST_WINDOW, idx);
+        return;
+    } else if (cache->flags & XCACHE_LRU_CLOCK) {
+        if (ce->list == XCACHE_LIST_NONE) {
+            ce->referenced = 0;
+            __list_push_head(cache, shard, XCACHE_LIST_WINDOW, idx);
+        } else {
+            ce->referenced = 1;
+        }
+        return;
+    } else if (cache->flags & XCACHE_LRU_TINYLFU) {
+        __tinylfu_access(cache, shard, idx);
+        return;
+    }
+
+    /* assert thatn shard->time does not get MAX value. If this happen,
      * reset it to zero, and also reset all access times.
      */
-    cache->time++;
-    if (cache->time == XCACHE_LRU_MAX) {
-        cache->time = 0;
-        __reset_times(cache);
+    shard->time++;
+    if (shard->time == XCACHE_LRU_MAX) {
+        shard->time = 0;
+        __reset_times(cache, shard);
         return;
     }
 
     if (cache->flags & XCACHE_LRU_ARRAY) {
-        cache->times[idx] = cache->time;
+        cache->times[idx] = shard->time;
     } else if (cache->flags & XCACHE_LRU_HEAP) {
         if (ce->h != NoNode) {
-            xbinheap_increasekey(&cache->binheap, ce->h, cache->time);
+            xbinheap_increasekey(&shard->binheap, ce->h, shard->time);
         } else {
-            ce->h = xbinheap_insert(&cache->binheap, cache->time, idx);
+            ce->h = xbinheap_insert(&shard->binheap, shard->time, idx);
             if (ce->h == NoNode) {
                 XSEGLOG("BUG: Cannot insert to lru binary heap");
             }
@@ -200,75 +661,96 @@ static void __xcache_entry_get(struct xcache *cache, xqindex idx)
 }
 
 /*
- * __xcache_entry_get_and_update must be called with cache->lock held, due to
+ * __xcache_entry_get_and_update must be called with shard->lock held, due to
  * the race for __update_access_time.
  */
-static void __xcache_entry_get_and_update(struct xcache *cache, xqindex idx)
+static void __xcache_entry_get_and_update(struct xcache *cache,
+                                          struct xcache_shard *shard,
+                                          xqindex idx)
 {
     __xcache_entry_get(cache, idx);
-    __update_access_time(cache, idx);
+    __update_access_time(cache, shard, idx);
 }
 
 /* after a succesfull call, the handler must be put */
-static int __xcache_remove_entries(struct xcache *cache, xcache_handler h)
+static int __xcache_remove_entries(struct xcache *cache,
+                                   struct xcache_shard *shard,
+                                   xcache_handler h)
 {
     int r;
     xqindex idx = (xqindex) h;
     struct xcache_entry *ce = &cache->nodes[idx];
 
-    r = __table_remove(cache->entries, ce->name);
+    __shard_write_begin(shard);
+    r = __table_remove(shard->entries, cache, ce->name);
+    __shard_write_end(shard);
     if (UNLIKELY(r < 0)) {
         XSEGLOG("Couldn't delete cache entry from hash table:\n"
                 "h: %llu, name: %s, cache->nodes[h].priv: %p, ref: %llu",
                 h, ce->name, cache->nodes[idx].priv, cache->nodes[idx].ref);
         return r;
     }
+    if (cache->flags & XCACHE_USE_FILTER) {
+        __filter_del(&shard->entries_filter, ce->hash);
+    }
+    shard->weight -= ce->cost;
 
     if (cache->flags & XCACHE_LRU_ARRAY) {
         cache->times[idx] = XCACHE_LRU_MAX;
     } else if (cache->flags & XCACHE_LRU_HEAP) {
         if (ce->h != NoNode) {
-            if (xbinheap_increasekey(&cache->binheap, ce->h, XCACHE_LRU_MAX) <
+            if (xbinheap_increasekey(&shard->binheap, ce->h, XCACHE_LRU_MAX) <
                 0) {
                 XSEGLOG("BUG: cannot increase key to XCACHE_LRU_MAX");
             }
-            if (xbinheap_extract(&cache->binheap) == NoNode) {
+            if (xbinheap_extract(&shard->binheap) == NoNode) {
                 XSEGLOG("BUG: cannot remove cache entry from lru");
             }
             ce->h = NoNode;
         }
+    } else if (cache->flags & LIST_POLICIES) {
+        if (ce->list != XCACHE_LIST_NONE) {
+            __list_unlink(cache, shard, idx);
+        }
     }
     //XSEGLOG("cache->times[%llu] = %llu", idx, cache->times[idx]);
     return 0;
 }
 
 /*
- * __xcache_remove_rm must always be called with cache->rm_lock held.
+ * __xcache_remove_rm must always be called with shard->rm_lock held.
  * It finalizes the removal of an entry from the cache.
  */
-static int __xcache_remove_rm(struct xcache *cache, xcache_handler h)
+static int __xcache_remove_rm(struct xcache *cache,
+                              struct xcache_shard *shard, xcache_handler h)
 {
     int r;
     xqindex idx = (xqindex) h;
     struct xcache_entry *ce = &cache->nodes[idx];
 
-    r = __table_remove(cache->rm_entries, ce->name);
+    r = __table_remove(shard->rm_entries, cache, ce->name);
     if (UNLIKELY(r < 0)) {
         XSEGLOG("Couldn't delete cache entry from hash table:\n"
                 "h: %llu, name: %s, cache->nodes[h].priv: %p, ref: %llu",
                 h, ce->name, cache->nodes[idx].priv, cache->nodes[idx].ref);
+    } else if (cache->flags & XCACHE_USE_FILTER) {
+        __filter_del(&shard->rm_filter, ce->hash);
     }
 
     return r;
 }
 
 /*
- * __xcache_lookup_rm must always be called with cache->rm_lock held.
+ * __xcache_lookup_rm must always be called with shard->rm_lock held.
  * It checks if name exists in "rm_entries"
  */
-static xcache_handler __xcache_lookup_rm(struct xcache *cache, char *name)
+static xcache_handler __xcache_lookup_rm(struct xcache_shard *shard,
+                                         char *name, xhashidx hash)
 {
-    return __table_lookup(cache->rm_entries, name);
+    if (shard->rm_filter.counters && !filter_test(&shard->rm_filter, hash)) {
+        return NoEntry;
+    }
+    return __table_lookup(shard->rm_entries, name, hash);
 }
 
 /*
@@ -285,38 +767,71 @@ static xcache_handler __xcache_lookup_and_get_rm(struct xcache *cache, char *nam
 }
 */
 
-static xcache_handler __xcache_lookup_entries(struct xcache *cache, char *name)
+static xcache_handler __xcache_lookup_entries(struct xcache_shard *shard,
+                                              char *name, xhashidx hash)
 {
-    return __table_lookup(cache->entries, name);
+    if (shard->entries_filter.counters &&
+        !filter_test(&shard->entries_filter, hash)) {
+        return NoEntry;
+    }
+    return __table_lookup(shard->entries, name, hash);
 }
 
 static xcache_handler __xcache_lookup_and_get_entries(struct xcache *cache,
-                                                      char *name)
+                                                      struct xcache_shard
+                                                      *shard, char *name,
+                                                      xhashidx hash)
 {
     xcache_handler h;
 
-    h = __xcache_lookup_entries(cache, name);
+    h = __xcache_lookup_entries(shard, name, hash);
     if (h != NoEntry) {
-        __xcache_entry_get_and_update(cache, h);
+        __xcache_entry_get_and_update(cache, shard, h);
     }
 
     return h;
 }
 
 static xcache_handler __xcache_insert_rm(struct xcache *cache,
+                                         struct xcache_shard *shard,
                                          xcache_handler h)
 {
-    return __table_insert(&cache->rm_entries, cache, h);
+    int r;
+    xhashidx hash = cache->nodes[h].hash;
+
+    if (cache->flags & XCACHE_USE_FILTER) {
+        __filter_add(&shard->rm_filter, hash);
+    }
+    r = __table_insert(&shard->rm_entries, cache, h);
+    if (r < 0 && cache->flags & XCACHE_USE_FILTER) {
+        __filter_del(&shard->rm_filter, hash);
+    }
+    return r;
 }
 
 static xcache_handler __xcache_insert_entries(struct xcache *cache,
+                                              struct xcache_shard *shard,
                                               xcache_handler h)
 {
-    return __table_insert(&cache->entries, cache, h);
+    int r;
+    xhashidx hash = cache->nodes[h].hash;
+
+    if (cache->flags & XCACHE_USE_FILTER) {
+        __filter_add(&shard->entries_filter, hash);
+    }
+    __shard_write_begin(shard);
+    r = __table_insert(&shard->entries, cache, h);
+    __shard_write_end(shard);
+    if (r >= 0) {
+        shard->weight += cache->nodes[h].cost;
+    } else if (cache->flags & XCACHE_USE_FILTER) {
+        __filter_del(&shard->entries_filter, hash);
+    }
+    return r;
 }
 
 /*
- * xcache_entry_put is thread-safe even without cache->lock (cache->rm_lock is
+ * xcache_entry_put is thread-safe even without shard->lock (shard->rm_lock is
  * crucial though). This is why:
  *
  * a. We put the entry's refcount. If it doesn't drop to zero, we can move on.
@@ -333,10 +848,11 @@ static xcache_handler __xcache_insert_entries(struct xcache *cache,
 static void xcache_entry_put(struct xcache *cache, xqindex idx)
 {
     struct xcache_entry *ce = &cache->nodes[idx];
+    struct xcache_shard *shard = __idx_shard(cache, idx);
     unsigned long ref;
 
     if (cache->flags & XCACHE_USE_RMTABLE) {
-        xlock_acquire(&cache->rm_lock);
+        xlock_acquire(&shard->rm_lock);
 
         ref = __sync_sub_and_fetch(&ce->ref, 1);
         if (ref > 0) {
@@ -356,11 +872,13 @@ static void xcache_entry_put(struct xcache *cache, xqindex idx)
         if (ce->ref != 0) {
             goto out;
         }
-        if (__xcache_remove_rm(cache, idx) < 0) {
+        /* entries removed from "entries" or invalidated are not there */
+        if (ce->state == NODE_EVICTED &&
+            __xcache_remove_rm(cache, shard, idx) < 0) {
             goto out;
         }
 
-        xlock_release(&cache->rm_lock);
+        xlock_release(&shard->rm_lock);
     } else if (__sync_sub_and_fetch(&ce->ref, 1) > 0) {
         return;
     }
@@ -374,10 +892,11 @@ static void xcache_entry_put(struct xcache *cache, xqindex idx)
     return;
 
   out:                         /* For XCACHE_USE_RMTABLE only */
-    xlock_release(&cache->rm_lock);
+    xlock_release(&shard->rm_lock);
 }
 
-static int xcache_entry_init(struct xcache *cache, xqindex idx, char *name)
+static int xcache_entry_init(struct xcache *cache, xqindex idx, char *name,
+                             xhashidx hash)
 {
     int r = 0;
     struct xcache_entry *ce = &cache->nodes[idx];
@@ -388,9 +907,17 @@ static int xcache_entry_init(struct xcache *cache, xqindex idx, char *name)
                 idx, ce->ref, ce->priv);
     }
     ce->ref = 1;
-    strncpy(ce->name, name, XSEG_MAX_TARGETLEN);
-    ce->name[XSEG_MAX_TARGETLEN] = 0;
+    ce->name = __names_alloc(&__idx_shard(cache, idx)->names, name);
+    if (!ce->name) {
+        return -1;
+    }
     ce->h = NoNode;
+    ce->lru_prev = Noneidx;
+    ce->lru_next = Noneidx;
+    ce->list = XCACHE_LIST_NONE;
+    ce->referenced = 0;
+    ce->hash = hash;
+    ce->cost = 1;
     ce->state = NODE_ACTIVE;
 
     if (cache->ops.on_init) {
@@ -401,14 +928,15 @@ static int xcache_entry_init(struct xcache *cache, xqindex idx, char *name)
 }
 
 
-static xqindex __xcache_lru(struct xcache *cache)
+static xqindex __xcache_lru(struct xcache *cache, struct xcache_shard *shard)
 {
     uint64_t min = -2;
-    xqindex i, lru = Noneidx;
+    xqindex i, end, lru = Noneidx;
     struct xcache_entry *ce;
 
     if (cache->flags & XCACHE_LRU_ARRAY) {
-        for (i = 0; i < cache->nr_nodes; i++) {
+        end = shard->first_node + (1 << cache->shard_shift);
+        for (i = shard->first_node; i < end; i++) {
             //XSEGLOG("cache->times[%llu] = %llu", i, cache->times[i]);
             if (min > cache->times[i]) {
                 min = cache->times[i];
@@ -419,17 +947,30 @@ static xqindex __xcache_lru(struct xcache *cache)
         //      lru = NoEntry;
         //XSEGLOG("Found lru cache->times[%llu] = %llu", lru, cache->times[lru]);
     } else if (cache->flags & XCACHE_LRU_HEAP) {
-        lru = xbinheap_extract(&cache->binheap);
+        lru = xbinheap_extract(&shard->binheap);
         if (lru == NoNode) {
             return Noneidx;
         }
         ce = &cache->nodes[lru];
         ce->h = NoNode;
+    } else if (cache->flags & LIST_POLICIES) {
+        if (cache->flags & XCACHE_LRU_CLOCK) {
+            lru = __clock_victim(cache, shard);
+        } else if (cache->flags & XCACHE_LRU_TINYLFU) {
+            lru = __tinylfu_victim(cache, shard);
+        } else {
+            lru = shard->lists[XCACHE_LIST_WINDOW].tail;
+        }
+        if (lru == Noneidx) {
+            return Noneidx;
+        }
+        __list_unlink(cache, shard, lru);
     }
     return lru;
 }
 
-static int __xcache_evict(struct xcache *cache, xcache_handler h)
+static int __xcache_evict(struct xcache *cache, struct xcache_shard *shard,
+                          xcache_handler h)
 {
     //pre_evict
     //remove from entries
@@ -439,7 +980,7 @@ static int __xcache_evict(struct xcache *cache, xcache_handler h)
     struct xcache_entry *ce;
     int r;
 
-    r = __xcache_remove_entries(cache, h);
+    r = __xcache_remove_entries(cache, shard, h);
     if (r < 0) {
         XSEGLOG("Failed to evict %llu from entries", h);
         return -1;
@@ -461,9 +1002,9 @@ static int __xcache_evict(struct xcache *cache, xcache_handler h)
     }
 
     ce->state = NODE_EVICTED;
-    xlock_acquire(&cache->rm_lock);
-    r = __xcache_insert_rm(cache, h);
-    xlock_release(&cache->rm_lock);
+    xlock_acquire(&shard->rm_lock);
+    r = __xcache_insert_rm(cache, shard, h);
+    xlock_release(&shard->rm_lock);
 
     if (r < 0) {
         ce->state = NODE_ACTIVE;
@@ -474,32 +1015,34 @@ static int __xcache_evict(struct xcache *cache, xcache_handler h)
     return 0;
 }
 
-static xcache_handler __xcache_evict_lru(struct xcache *cache)
+static xcache_handler __xcache_evict_lru(struct xcache *cache,
+                                         struct xcache_shard *shard)
 {
     int r;
     xcache_handler lru;
 
-    lru = __xcache_lru(cache);
+    lru = __xcache_lru(cache, shard);
     if (lru == NoEntry) {
         XSEGLOG("BUG: No lru found");
         return NoEntry;
     }
 
-    r = __xcache_evict(cache, lru);
+    r = __xcache_evict(cache, shard, lru);
     if (r < 0) {
         return NoEntry;
     }
     return lru;
 }
 
-static int __xcache_remove(struct xcache *cache, xcache_handler h)
+static int __xcache_remove(struct xcache *cache, struct xcache_shard *shard,
+                           xcache_handler h)
 {
-    return __xcache_remove_entries(cache, h);
+    return __xcache_remove_entries(cache, shard, h);
 }
 
 /*
- * __xcache_insert is called with cache->lock held and has to hold
- * cache->rm_lock too when looking/inserting an entry in rm_entries. The
+ * __xcache_insert is called with shard->lock held and has to hold
+ * shard->rm_lock too when looking/inserting an entry in rm_entries. The
  * process is the following:
  *
  * 1. First, we search in "entries" to check if there was a race. If so, we
@@ -519,19 +1062,24 @@ static int __xcache_remove(struct xcache *cache, xcache_handler h)
  * FIXME: Not the sanest decision to delete entries *first* from one table
  * *and then* copy them to other tables. Handle fails properly.
  */
-static xcache_handler __xcache_insert(struct xcache *cache, xcache_handler h,
+static xcache_handler __xcache_insert(struct xcache *cache,
+                                      struct xcache_shard *shard,
+                                      xcache_handler h,
                                       xcache_handler * lru_handler,
                                       xcache_handler * reinsert_handler)
 {
     int r;
     struct xcache_entry *ce;
     xcache_handler tmp_h, lru;
+    xhashidx hash;
 
     lru = NoEntry;
     ce = &cache->nodes[h];
+    /* both tables hash names the same way */
+    hash = xhash_hash(XHASH_STRING, (xhashidx) ce->name);
 
     /* lookup first to ensure we don't overwrite entries */
-    tmp_h = __xcache_lookup_and_get_entries(cache, ce->name);
+    tmp_h = __xcache_lookup_and_get_entries(cache, shard, ce->name, hash);
     if (tmp_h != NoEntry) {
         return tmp_h;
     }
@@ -540,16 +1088,25 @@ static xcache_handler __xcache_insert(struct xcache *cache, xcache_handler h,
         goto insert;
     }
 
+    /*
+     * Entries get in "rm_entries" only under the shard lock, which we hold,
+     * so a negative filter probe is final.
+     */
+    if (cache->flags & XCACHE_USE_FILTER &&
+        !filter_test(&shard->rm_filter, hash)) {
+        goto insert;
+    }
+
     /* check if our "older self" exists in the rm_entries */
-    xlock_acquire(&cache->rm_lock);
-    tmp_h = __xcache_lookup_rm(cache, ce->name);
+    xlock_acquire(&shard->rm_lock);
+    tmp_h = __xcache_lookup_rm(shard, ce->name, hash);
     if (tmp_h != NoEntry) {
         /* if so then remove it from rm table */
-        r = __xcache_remove_rm(cache, tmp_h);
+        r = __xcache_remove_rm(cache, shard, tmp_h);
         if (UNLIKELY(r < 0)) {
             XSEGLOG("Could not remove found entry (%llu) for %s"
                     "from rm_entries", tmp_h, ce->name);
-            xlock_release(&cache->rm_lock);
+            xlock_release(&shard->rm_lock);
             return NoEntry;
         }
 
@@ -565,13 +1122,13 @@ static xcache_handler __xcache_insert(struct xcache *cache, xcache_handler h,
         h = tmp_h;
         *reinsert_handler = tmp_h;
     }
-    xlock_release(&cache->rm_lock);
+    xlock_release(&shard->rm_lock);
 
   insert:
     /* insert new entry to cache */
-    r = __xcache_insert_entries(cache, h);
+    r = __xcache_insert_entries(cache, shard, h);
     if (r == -XHASH_ENOSPC) {
-        lru = __xcache_evict_lru(cache);
+        lru = __xcache_evict_lru(cache, shard);
         if (UNLIKELY(lru == NoEntry)) {
             XSEGLOG("BUG: Failed to evict lru entry");
             return NoEntry;
@@ -580,9 +1137,9 @@ static xcache_handler __xcache_insert(struct xcache *cache, xcache_handler h,
 
         /*
          * Cache entry is put when this function returns, without the
-         * cache lock held.
+         * shard lock held.
          */
-        r = __xcache_insert_entries(cache, h);
+        r = __xcache_insert_entries(cache, shard, h);
         if (r < 0) {
             XSEGLOG("BUG: failed to insert enries after eviction");
             return NoEntry;
@@ -595,89 +1152,507 @@ static xcache_handler __xcache_insert(struct xcache *cache, xcache_handler h,
     }
 
     if (r >= 0) {
-        __xcache_entry_get_and_update(cache, h);
+        __xcache_entry_get_and_update(cache, shard, h);
     }
 
     return (r < 0 ? NoEntry : h);
 }
 
 /*
- * xcache_insert tries to insert an xcache handler in cache.
- * On success, it returns either the same xcache handler or another one that is
- * associated with a cache entry with the same key (name).
- * If the cache node is marked as deleted, we return DelEntry.
- * If the insertion fails for any other reason, we return NoEntry.
+ * XCACHE_LOCKFREE_LOOKUP
  *
- * Finally, if a successful insertion results to an LRU eviction, we put the
- * LRU entry.
+ * Hits do not take the shard lock. A reader announces the cache epoch in its
+ * slot, so that tables it might see are not freed under it (see
+ * __wait_readers), and looks the name up optimistically, between two reads of
+ * the shard sequence number. The reference to a found entry is taken only if
+ * the entry is still referenced by the cache, and the result stands only if
+ * the sequence number did not change meanwhile. Otherwise the lookup is
+ * retried with the shard lock held.
+ *
+ * The access is recorded in a per thread buffer, which is merged into the
+ * eviction policy when it fills up, or when the thread inserts in a shard.
  */
-xcache_handler xcache_insert(struct xcache * cache, xcache_handler h)
-{
-    struct xcache_entry *ce;
-    xcache_handler ret = NoEntry;
-    xcache_handler lru = NoEntry;
-    xcache_handler reinsert_handler = NoEntry;
+#define XCACHE_HIT_BUFFER 16
 
-    xlock_acquire(&cache->lock);
-    ret = __xcache_insert(cache, h, &lru, &reinsert_handler);
-    xlock_release(&cache->lock);
+/*
+ * Reader ids index the reader slots of every cache. A thread takes a free one
+ * on its first lock-free lookup and gives it back when it exits, so that
+ * threads coming and going do not use up the slots.
+ */
+#if XCACHE_MAX_READERS % 64
+#error "XCACHE_MAX_READERS should be a multiple of 64"
+#endif
 
-    if (lru != NoEntry) {
-        if (UNLIKELY(ret == NoEntry)) {
-            XSEGLOG("BUG: Unsuccessful insertion lead to LRU eviction.");
-        }
-        ce = &cache->nodes[lru];
-        if (cache->ops.on_evict) {
-            cache->ops.on_evict(cache->priv, ce->priv);
-        }
-        xcache_entry_put(cache, lru);
-    }
+static volatile uint64_t reader_ids[XCACHE_MAX_READERS / 64];
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static int reader_key_ok = 0;
+static __thread int reader_id = -1;
 
-    if (reinsert_handler != NoEntry) {
-        if (UNLIKELY(ret != reinsert_handler)) {
-            XSEGLOG("BUG: Re-insert handler is different from returned handler"
-                    "(rei_h = %llu, ret_h = %llu)", reinsert_handler, ret);
-        }
-        ce = &cache->nodes[reinsert_handler];
-        if (cache->ops.on_reinsert) {
-            cache->ops.on_reinsert(cache->priv, ce->priv);
-        }
-    }
+/* the key holds the id plus one, since destructors only run for non NULL */
+static void __put_reader_id(void *arg)
+{
+    long id = (long) arg - 1;
 
-    return ret;
+    __sync_fetch_and_and(&reader_ids[id / 64], ~(1ULL << (id % 64)));
 }
 
-/*
- * xcache_lookup looks only in "entries". There are several arguments behind
+static void __make_reader_key(void)
+{
+    reader_key_ok = !pthread_key_create(&reader_key, __put_reader_id);
+}
+
+static int __get_reader_id(void)
+{
+    uint64_t word;
+    uint32_t i, bit;
+    long id;
+
+    pthread_once(&reader_once, __make_reader_key);
+    if (!reader_key_ok) {
+        return -1;
+    }
+    for (i = 0; i < XCACHE_MAX_READERS / 64; i++) {
+        word = reader_ids[i];
+        while (~word) {
+            bit = __builtin_ctzll(~word);
+            if (__sync_bool_compare_and_swap(&reader_ids[i], word,
+                                             word | (1ULL << bit))) {
+                id = i * 64 + bit;
+                if (pthread_setspecific(reader_key, (void *) (id + 1))) {
+                    __put_reader_id((void *) (id + 1));
+                    return -1;
+                }
+                return id;
+            }
+            word = reader_ids[i];
+        }
+    }
+    return -1;
+}
+
+/*
+ * The buffer is tagged with the id of its cache rather than its address,
+ * since a cache freed and initialized again at the same address is another
+ * cache, possibly of fewer nodes. Ids are never reused.
+ */
+static volatile uint64_t cache_ids = 0;
+
+static __thread struct {
+    uint64_t cache_id;
+    uint32_t count;
+    xqindex idx[XCACHE_HIT_BUFFER];
+} hits;
+
+static struct xcache_reader *__reader_enter(struct xcache *cache)
+{
+    struct xcache_reader *reader;
+
+    if (UNLIKELY(reader_id < 0)) {
+        reader_id = __get_reader_id();
+        if (reader_id < 0) {
+            return NULL;
+        }
+    }
+    reader = &cache->readers[reader_id];
+    reader->epoch = cache->epoch;
+    /* publish the epoch before reading any table */
+    MFENCE();
+    return reader;
+}
+
+static void __reader_exit(struct xcache_reader *reader)
+{
+    BARRIER();
+    reader->epoch = 0;
+}
+
+static int __xcache_entry_get_unless_zero(struct xcache *cache, xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+    uint32_t ref;
+
+    do {
+        ref = ce->ref;
+        if (!ref) {
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&ce->ref, ref, ref + 1));
+    return 1;
+}
+
+/* the access is only a hint, so skip entries that left the cache meanwhile */
+static void __touch_resident(struct xcache *cache, struct xcache_shard *shard,
+                             xqindex idx)
+{
+    struct xcache_entry *ce = &cache->nodes[idx];
+
+    if (cache->flags & LIST_POLICIES) {
+        if (ce->list == XCACHE_LIST_NONE) {
+            return;
+        }
+    } else if (cache->flags & XCACHE_LRU_HEAP) {
+        if (ce->h == NoNode) {
+            return;
+        }
+    } else if (cache->flags & XCACHE_LRU_ARRAY) {
+        if (cache->times[idx] == XCACHE_LRU_MAX) {
+            return;
+        }
+    }
+    __update_access_time(cache, shard, idx);
+}
+
+/*
+ * Merge the buffered hits of this thread. With a shard given, its lock is held
+ * and only its hits are merged. Otherwise all of them are, if the lock of their
+ * shard is free, and dropped if not.
+ */
+static void __merge_hits(struct xcache *cache, struct xcache_shard *locked)
+{
+    struct xcache_shard *shard;
+    uint32_t i, j, n = 0;
+    int taken;
+
+    if (hits.cache_id != cache->id) {
+        return;
+    }
+    for (i = 0; i < hits.count; i++) {
+        if (hits.idx[i] == Noneidx) {
+            continue;
+        }
+        if (UNLIKELY(hits.idx[i] >= cache->nr_nodes)) {
+            hits.idx[i] = Noneidx;
+            continue;
+        }
+        shard = __idx_shard(cache, hits.idx[i]);
+        if (locked && shard != locked) {
+            continue;
+        }
+        taken = locked || xlock_try_lock(&shard->lock);
+        for (j = i; j < hits.count; j++) {
+            if (hits.idx[j] == Noneidx ||
+                __idx_shard(cache, hits.idx[j]) != shard) {
+                continue;
+            }
+            if (taken) {
+                __touch_resident(cache, shard, hits.idx[j]);
+            }
+            hits.idx[j] = Noneidx;
+        }
+        if (!locked && taken) {
+            xlock_release(&shard->lock);
+        }
+    }
+    for (i = 0; i < hits.count; i++) {
+        if (hits.idx[i] != Noneidx) {
+            hits.idx[n++] = hits.idx[i];
+        }
+    }
+    hits.count = n;
+}
+
+static void __record_hit(struct xcache *cache, xqindex idx)
+{
+    if (hits.cache_id != cache->id) {
+        hits.cache_id = cache->id;
+        hits.count = 0;
+    }
+    hits.idx[hits.count++] = idx;
+    if (hits.count == XCACHE_HIT_BUFFER) {
+        __merge_hits(cache, NULL);
+    }
+}
+
+/*
+ * Return 0 if the lookup was validated, with the result in h_ret, or -1 if it
+ * must be done again under the shard lock.
+ */
+static int __xcache_lookup_lockfree(struct xcache *cache,
+                                    struct xcache_shard *shard, char *name,
+                                    xhashidx hash, xcache_handler * h_ret)
+{
+    struct xcache_reader *reader;
+    xcache_handler h;
+    uint32_t seq;
+
+    reader = __reader_enter(cache);
+    if (!reader) {
+        return -1;
+    }
+
+    seq = shard->seq;
+    BARRIER();
+    if (seq & 1) {
+        goto out_retry;
+    }
+
+    h = __table_lookup(shard->entries, name, hash);
+    if (h != NoEntry) {
+        if (h >= cache->nr_nodes || !__xcache_entry_get_unless_zero(cache, h)) {
+            goto out_retry;
+        }
+    }
+
+    BARRIER();
+    if (shard->seq != seq) {
+        __reader_exit(reader);
+        if (h != NoEntry) {
+            xcache_put(cache, h);
+        }
+        return -1;
+    }
+    __reader_exit(reader);
+
+    if (h != NoEntry) {
+        __record_hit(cache, h);
+    }
+    *h_ret = h;
+    return 0;
+
+  out_retry:
+    __reader_exit(reader);
+    return -1;
+}
+
+/*
+ * xcache_insert tries to insert an xcache handler in cache.
+ * On success, it returns either the same xcache handler or another one that is
+ * associated with a cache entry with the same key (name).
+ * If the cache node is marked as deleted, we return DelEntry.
+ * If the insertion fails for any other reason, we return NoEntry.
+ *
+ * Finally, if a successful insertion results to an LRU eviction, we put the
+ * LRU entry.
+ */
+/*
+ * Inform the peer about an evicted entry and drop the reference that the cache
+ * held. Called without the shard lock held.
+ */
+static void put_evicted(struct xcache *cache, xcache_handler lru)
+{
+    struct xcache_entry *ce = &cache->nodes[lru];
+
+    if (cache->ops.on_evict) {
+        cache->ops.on_evict(cache->priv, ce->priv);
+    }
+    xcache_entry_put(cache, lru);
+}
+
+/*
+ * Evict LRU entries until the weight of the shard is within its budget. The
+ * lock is dropped before each evicted entry is put, so a single heavy entry
+ * may push several light ones out one at a time.
+ */
+static void evict_overweight(struct xcache *cache, struct xcache_shard *shard)
+{
+    xcache_handler lru;
+
+    for (;;) {
+        xlock_acquire(&shard->lock);
+        if (shard->weight <= shard->max_weight) {
+            xlock_release(&shard->lock);
+            return;
+        }
+        lru = __xcache_evict_lru(cache, shard);
+        xlock_release(&shard->lock);
+
+        if (UNLIKELY(lru == NoEntry)) {
+            XSEGLOG("BUG: Failed to evict lru entry of overweight shard");
+            return;
+        }
+        put_evicted(cache, lru);
+    }
+}
+
+xcache_handler xcache_insert(struct xcache * cache, xcache_handler h)
+{
+    struct xcache_entry *ce;
+    xcache_handler ret = NoEntry;
+    xcache_handler lru = NoEntry;
+    xcache_handler reinsert_handler = NoEntry;
+    struct xcache_shard *shard = __idx_shard(cache, h);
+
+    xlock_acquire(&shard->lock);
+    if (cache->flags & XCACHE_LOCKFREE_LOOKUP) {
+        __merge_hits(cache, shard);
+    }
+    ret = __xcache_insert(cache, shard, h, &lru, &reinsert_handler);
+    xlock_release(&shard->lock);
+
+    if (lru != NoEntry) {
+        if (UNLIKELY(ret == NoEntry)) {
+            XSEGLOG("BUG: Unsuccessful insertion lead to LRU eviction.");
+        }
+        put_evicted(cache, lru);
+    }
+
+    /* racy check, repeated under the shard lock */
+    if (shard->max_weight && shard->weight > shard->max_weight) {
+        evict_overweight(cache, shard);
+    }
+
+    if (reinsert_handler != NoEntry) {
+        if (UNLIKELY(ret != reinsert_handler)) {
+            XSEGLOG("BUG: Re-insert handler is different from returned handler"
+                    "(rei_h = %llu, ret_h = %llu)", reinsert_handler, ret);
+        }
+        ce = &cache->nodes[reinsert_handler];
+        if (cache->ops.on_reinsert) {
+            cache->ops.on_reinsert(cache->priv, ce->priv);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Same as xcache_insert, but the entry weighs cost instead of 1 towards the
+ * max_weight of a weighted cache. An entry found in the cache or re-inserted
+ * from "rm_entries" keeps the cost it was inserted with.
+ */
+xcache_handler xcache_insert_weighted(struct xcache *cache, xcache_handler h,
+                                      uint64_t cost)
+{
+    if (!__validate_idx(cache, h)) {
+        return NoEntry;
+    }
+    cache->nodes[h].cost = cost;
+    return xcache_insert(cache, h);
+}
+
+/*
+ * xcache_lookup looks only in "entries". There are several arguments behind
  * this choice:
  *
  * a. Speed: xcache_lookup won't bother with geting rm->lock or re-inserting
  *    entries in other hash tables this way.
  * b. Common case: Rarely will we ever need to lookup in "rm_entries"
  * c. Simplicity: <self-explanatory>
+ *
+ * With XCACHE_LOCKFREE_LOOKUP, the shard lock is taken only if the lock-free
+ * lookup raced with a modification of "entries".
  */
 xcache_handler xcache_lookup(struct xcache * cache, char *name)
 {
     xcache_handler h = NoEntry;
+    /* hash outside the lock */
+    xhashidx hash = xhash_hash(XHASH_STRING, (xhashidx) name);
+    struct xcache_shard *shard = __hash_shard(cache, hash);
 
-    xlock_acquire(&cache->lock);
-    h = __xcache_lookup_and_get_entries(cache, name);
-    xlock_release(&cache->lock);
+    if (cache->flags & XCACHE_USE_FILTER &&
+        !filter_test(&shard->entries_filter, hash)) {
+        return NoEntry;
+    }
+
+    if (cache->flags & XCACHE_LOCKFREE_LOOKUP &&
+        !__xcache_lookup_lockfree(cache, shard, name, hash, &h)) {
+        return h;
+    }
+
+    xlock_acquire(&shard->lock);
+    h = __xcache_lookup_and_get_entries(cache, shard, name, hash);
+    xlock_release(&shard->lock);
 
     return h;
 }
 
+/*
+ * Look n names up, returning a handler for each of them in handlers, or
+ * NoEntry for a miss, and the number of hits. Found entries are got, as with
+ * xcache_lookup.
+ *
+ * Names are looked up in batches of XCACHE_LOOKUP_BATCH. All names of a batch
+ * are hashed and their table slots prefetched up front, and the names that
+ * belong to the same shard are resolved under a single hold of its lock.
+ */
+uint32_t xcache_lookup_many(struct xcache *cache, char **names, uint32_t n,
+                            xcache_handler * handlers)
+{
+    xhashidx hashes[XCACHE_LOOKUP_BATCH];
+    struct xcache_shard *shards[XCACHE_LOOKUP_BATCH];
+    uint32_t pending[XCACHE_LOOKUP_BATCH];
+    uint32_t b, i, j, nr, nr_pending, hits = 0;
+    struct xcache_shard *shard;
+    xcache_handler h;
+
+    for (b = 0; b < n; b += nr) {
+        nr = n - b < XCACHE_LOOKUP_BATCH ? n - b : XCACHE_LOOKUP_BATCH;
+
+        for (i = 0; i < nr; i++) {
+            hashes[i] = xhash_hash(XHASH_STRING, (xhashidx) names[b + i]);
+            shards[i] = __hash_shard(cache, hashes[i]);
+            /* racy, but a stale table is harmless to prefetch */
+            xhash_prefetch(shards[i]->entries, hashes[i]);
+        }
+
+        nr_pending = 0;
+        for (i = 0; i < nr; i++) {
+            h = NoEntry;
+            if (cache->flags & XCACHE_USE_FILTER &&
+                !filter_test(&shards[i]->entries_filter, hashes[i])) {
+                handlers[b + i] = NoEntry;
+                continue;
+            }
+            if (cache->flags & XCACHE_LOCKFREE_LOOKUP &&
+                !__xcache_lookup_lockfree(cache, shards[i], names[b + i],
+                                          hashes[i], &h)) {
+                handlers[b + i] = h;
+                hits += (h != NoEntry);
+                continue;
+            }
+            pending[nr_pending++] = i;
+        }
+
+        for (i = 0; i < nr_pending; i++) {
+            shard = shards[pending[i]];
+            if (!shard) {
+                continue;
+            }
+
+            xlock_acquire(&shard->lock);
+            for (j = i; j < nr_pending; j++) {
+                if (shards[pending[j]] != shard) {
+                    continue;
+                }
+                h = __xcache_lookup_entries(shard, names[b + pending[j]],
+                                            hashes[pending[j]]);
+                if (h != NoEntry) {
+                    __builtin_prefetch(&cache->nodes[h]);
+                }
+                handlers[b + pending[j]] = h;
+            }
+            for (j = i; j < nr_pending; j++) {
+                if (shards[pending[j]] != shard) {
+                    continue;
+                }
+                h = handlers[b + pending[j]];
+                if (h != NoEntry) {
+                    __xcache_entry_get_and_update(cache, shard, h);
+                    hits++;
+                }
+                shards[pending[j]] = NULL;
+            }
+            xlock_release(&shard->lock);
+        }
+    }
+
+    return hits;
+}
+
 xcache_handler xcache_alloc_init(struct xcache * cache, char *name)
 {
     int r;
     xcache_handler h;
-    xqindex idx = alloc_cache_entry(cache);
+    xhashidx hash = xhash_hash(XHASH_STRING, (xhashidx) name);
+    /* the node must come from the shard that will index the name */
+    xqindex idx = alloc_cache_entry(__hash_shard(cache, hash));
 
     if (idx == Noneidx) {
         return NoEntry;
     }
 
-    r = xcache_entry_init(cache, idx, name);
+    r = xcache_entry_init(cache, idx, name, hash);
     if (r < 0) {
         free_cache_entry(cache, idx);
         return NoEntry;
@@ -687,29 +1662,193 @@ xcache_handler xcache_alloc_init(struct xcache * cache, char *name)
     return h;
 }
 
+static int __shard_init(struct xcache *cache, struct xcache_shard *shard,
+                        uint32_t first_node, uint32_t size)
+{
+    uint32_t i, tmp_size, width;
+    xhashidx shift;
+
+    /*
+     * Here we choose a proper size for the hash table.
+     * It must be able to contain at least xcache_size elements, before
+     * returns an -EXHASH_RESIZE.
+     * Thus it must be at least 3/2 * xcache_size (OK, the minimum power of
+     * two that meets this requirement to be exact).
+     *
+     * By choosing a xhash size 8 times the minimum required, we drastically
+     * decrease the number or xhash rebuilts required by xhash for
+     * perfomance reasons, sacrificing a logical amount of memory.
+     *
+     */
+
+    tmp_size = 3 * size / 2;
+    if (!tmp_size) {
+        tmp_size = 1;
+    }
+    shift = sizeof(tmp_size) * 8 - __builtin_clz(tmp_size);
+    shift += 3;
+
+    xlock_release(&shard->lock);
+    xlock_release(&shard->rm_lock);
+    shard->seq = 0;
+    shard->size = size;
+    shard->first_node = first_node;
+    shard->time = 0;
+    shard->weight = 0;
+    shard->max_weight = (cache->max_weight + cache->nr_shards - 1) /
+        cache->nr_shards;
+    shard->rm_entries = NULL;
+    shard->entries_filter.counters = NULL;
+    shard->rm_filter.counters = NULL;
+    shard->sketch = NULL;
+    __names_init(&shard->names);
+    for (i = 0; i < XCACHE_NR_LISTS; i++) {
+        shard->lists[i].head = Noneidx;
+        shard->lists[i].tail = Noneidx;
+        shard->lists[i].count = 0;
+    }
+
+    /* 1% of the entries for the window, 80% of the rest protected */
+    shard->window_size = size / 100 ? size / 100 : 1;
+    shard->protected_size = (size - shard->window_size) * 8 / 10;
+
+    if (!xq_alloc_empty(&shard->free_nodes, 2 * size)) {
+        return -1;
+    }
+    for (i = 0; i < 2 * size; i++) {
+        __xq_append_tail(&shard->free_nodes, first_node + i);
+    }
+
+    shard->entries = xhash_new_flags(shift, size, XHASH_STRING, XHASH_SWISS);
+    if (!shard->entries) {
+        goto out_free_q;
+    }
+
+    if (cache->flags & XCACHE_USE_RMTABLE) {
+        /*
+         * "rm_entries" must have the same size as "entries" since each one
+         * indexes at most (shard nodes / 2) entries
+         */
+        shard->rm_entries = xhash_new_flags(shift, size, XHASH_STRING,
+                                            XHASH_SWISS);
+        if (!shard->rm_entries) {
+            goto out_free_entries;
+        }
+    }
+
+    if (cache->flags & XCACHE_LRU_TINYLFU) {
+        /* four counters per entry and row, so a word per entry in total */
+        width = 4 * size < 16 ? 16 : 4 * size;
+        shard->sketch_mask = width - 1;
+        shard->sketch_samples = 0;
+        shard->sketch = xtypes_malloc(SKETCH_ROWS * width / 2);
+        if (!shard->sketch) {
+            goto out_free_rm_entries;
+        }
+        memset(shard->sketch, 0, SKETCH_ROWS * width / 2);
+    }
+
+    if (cache->flags & XCACHE_LRU_HEAP) {
+        if (xbinheap_init(&shard->binheap, size,
+                          XBINHEAP_MIN | XBINHEAP_4ARY, NULL) < 0) {
+            goto out_free_sketch;
+        }
+    }
+
+    if (cache->flags & XCACHE_USE_FILTER) {
+        if (__filter_init(&shard->entries_filter, size) < 0) {
+            goto out_free_heap;
+        }
+        if (cache->flags & XCACHE_USE_RMTABLE &&
+            __filter_init(&shard->rm_filter, size) < 0) {
+            goto out_free_filter;
+        }
+    }
+
+    return 0;
+
+  out_free_filter:
+    __filter_free(&shard->entries_filter);
+  out_free_heap:
+    if (cache->flags & XCACHE_LRU_HEAP) {
+        xbinheap_free(&shard->binheap);
+    }
+  out_free_sketch:
+    xtypes_free(shard->sketch);
+  out_free_rm_entries:
+    if (shard->rm_entries) {
+        xhash_free(shard->rm_entries);
+    }
+  out_free_entries:
+    xhash_free(shard->entries);
+  out_free_q:
+    xq_free(&shard->free_nodes);
+    return -1;
+}
+
+static void __shard_free(struct xcache *cache, struct xcache_shard *shard)
+{
+    if (cache->flags & XCACHE_LRU_HEAP) {
+        xbinheap_free(&shard->binheap);
+    }
+    xtypes_free(shard->sketch);
+    __filter_free(&shard->entries_filter);
+    __filter_free(&shard->rm_filter);
+    if (shard->rm_entries) {
+        __table_reclaim(cache, shard->rm_entries);
+        xhash_free(shard->rm_entries);
+    }
+    __table_reclaim(cache, shard->entries);
+    xhash_free(shard->entries);
+    xq_free(&shard->free_nodes);
+    __names_destroy(&shard->names);
+}
+
 /*
- * xcache_init initializes the following:
- * a. Two xhash tables:
+ * xcache_init_weighted initializes the following:
+ * a. The cache shards. Each shard indexes an equal part of the cache size,
+ *    has its own lock and contains:
  *    i. "entries", which indexes the active cache entries.
  *    ii. "rm_entries", which indexes the removed cache entries that are on the
  *        process of flushing their dirty data and/or finishing their pending
  *        requests.
+ *    iii. The queue of its free cache nodes and its LRU.
  * b. The cache nodes. They are typically 2 x cache_size, since we need room for
- *    the removed cache entries too.
- * c. The LRU, which is chosen on compile time.
+ *    the removed cache entries too. Shard i owns the i-th contiguous range of
+ *    them.
+ * c. The eviction policy, which is chosen by the flags. XCACHE_LRU_LIST,
+ *    which touches and evicts entries in O(1), is used when none is given.
+ *    XCACHE_LRU_CLOCK makes hits cheaper, and XCACHE_LRU_TINYLFU resists
+ *    scans by admitting new entries based on their access frequency.
+ * d. With XCACHE_USE_FILTER, a counting Bloom filter for each of the tables of
+ *    a shard, so that most misses are answered without a lock or a probe.
+ *
+ * Entries are assigned to shards by the hash of their name. Since the size of
+ * each shard is fixed, a cache of many shards may evict an entry while other
+ * shards still have room.
+ *
+ * A non-zero max_weight bounds the sum of the costs of the cached entries
+ * (see xcache_insert_weighted), on top of the bound of xcache_size entries.
+ * Each shard gets an equal part of it. Evicted entries that are still
+ * referenced do not count towards it.
  */
-int xcache_init(struct xcache *cache, uint32_t xcache_size,
-                struct xcache_ops *ops, uint32_t flags, void *priv)
+int xcache_init_weighted(struct xcache *cache, uint32_t xcache_size,
+                         uint64_t max_weight, uint32_t nr_shards,
+                         struct xcache_ops *ops, uint32_t flags, void *priv)
 {
     struct xcache_entry *ce;
     unsigned long i;
-    xhashidx shift;
-    uint32_t tmp_size, floor_size, ceil_size;
+    uint32_t floor_size, ceil_size, shard_size;
 
     if (!xcache_size) {
         return -1;
     }
 
+    if (!nr_shards || (nr_shards & (nr_shards - 1))) {
+        XSEGLOG("Number of cache shards must be a power of 2");
+        return -1;
+    }
+
     /* xcache size must be a power of 2.
      * Enforce it, by choosing the power of two that is closer to the xcache
      * size requested.
@@ -729,61 +1868,37 @@ int xcache_init(struct xcache *cache, uint32_t xcache_size,
                 xcache_size, cache->size);
     }
 
-    /*
-     * Here we choose a proper size for the hash table.
-     * It must be able to contain at least xcache_size elements, before
-     * returns an -EXHASH_RESIZE.
-     * Thus it must be at least 3/2 * xcache_size (OK, the minimum power of
-     * two that meets this requirement to be exact).
-     *
-     * By choosing a xhash size 8 times the minimum required, we drastically
-     * decrease the number or xhash rebuilts required by xhash for
-     * perfomance reasons, sacrificing a logical amount of memory.
-     *
-     */
+    if (nr_shards > cache->size) {
+        XSEGLOG("Cache of %u entries cannot have %u shards",
+                cache->size, nr_shards);
+        return -1;
+    }
 
-    tmp_size = 3 * cache->size / 2;
-    shift = sizeof(tmp_size) * 8 - __builtin_clz(tmp_size);
-    shift += 3;
+    if (!(flags & (XCACHE_LRU_ARRAY | XCACHE_LRU_HEAP | LIST_POLICIES))) {
+        flags |= XCACHE_LRU_LIST;
+    }
 
-    xlock_release(&cache->lock);
-    xlock_release(&cache->rm_lock);
+    shard_size = cache->size / nr_shards;
     cache->nr_nodes = cache->size * 2;
-    cache->time = 0;
+    cache->nr_shards = nr_shards;
+    cache->max_weight = max_weight;
+    cache->shard_shift = __builtin_ctz(shard_size * 2);
     cache->ops = *ops;
     cache->priv = priv;
     cache->flags = flags;
+    cache->id = __sync_add_and_fetch(&cache_ids, 1);
 
     /* TODO: assert  cache->size is not UINT64_MAX */
     if (cache->size == (uint64_t) (-1)) {
         return -1;
     }
 
-    if (!xq_alloc_seq(&cache->free_nodes, cache->nr_nodes, cache->nr_nodes)) {
-        return -1;
-    }
-
-    cache->entries = xhash_new(shift, cache->size, XHASH_STRING);
-    if (!cache->entries) {
-        goto out_free_q;
-    }
-
-    if (flags & XCACHE_USE_RMTABLE) {
-        /*
-         * "rm_entries" must have the same size as "entries" since each one indexes
-         * at most (cache->nodes / 2) entries
-         */
-        cache->rm_entries = xhash_new(shift, cache->size, XHASH_STRING);
-        if (!cache->rm_entries) {
-            goto out_free_entries;
-        }
-    }
-
     cache->nodes =
         xtypes_malloc(cache->nr_nodes * sizeof(struct xcache_entry));
     if (!cache->nodes) {
-        goto out_free_rm_entries;
+        return -1;
     }
+    memset(cache->nodes, 0, cache->nr_nodes * sizeof(struct xcache_entry));
 
     if (flags & XCACHE_LRU_ARRAY) {
         cache->times = xtypes_malloc(cache->nr_nodes * sizeof(uint64_t));
@@ -806,36 +1921,71 @@ int xcache_init(struct xcache *cache, uint32_t xcache_size,
             }
         }
     }
-    if (flags & XCACHE_LRU_HEAP) {
-        if (xbinheap_init(&cache->binheap, cache->size, XBINHEAP_MIN,
-                          NULL) < 0) {
+
+    cache->epoch = 1;
+    cache->readers = NULL;
+    if (flags & XCACHE_LOCKFREE_LOOKUP) {
+        cache->readers = xtypes_malloc(XCACHE_MAX_READERS *
+                                       sizeof(struct xcache_reader));
+        if (!cache->readers) {
             goto out_free_times;
         }
+        memset(cache->readers, 0,
+               XCACHE_MAX_READERS * sizeof(struct xcache_reader));
+    }
+
+    cache->shards = xtypes_malloc(nr_shards * sizeof(struct xcache_shard));
+    if (!cache->shards) {
+        goto out_free_readers;
+    }
+
+    for (i = 0; i < nr_shards; i++) {
+        if (__shard_init(cache, &cache->shards[i], i * 2 * shard_size,
+                         shard_size) < 0) {
+            goto out_free_shards;
+        }
     }
 
     return 0;
 
+  out_free_shards:
+    while (i--) {
+        __shard_free(cache, &cache->shards[i]);
+    }
+    xtypes_free(cache->shards);
+  out_free_readers:
+    xtypes_free(cache->readers);
   out_free_times:
     if (flags & XCACHE_LRU_ARRAY)
         xtypes_free(cache->times);
   out_free_nodes:
     xtypes_free(cache->nodes);
-  out_free_rm_entries:
-    xhash_free(cache->rm_entries);
-  out_free_entries:
-    xhash_free(cache->entries);
-  out_free_q:
-    xq_free(&cache->free_nodes);
     return -1;
 
 }
 
+int xcache_init_shards(struct xcache *cache, uint32_t xcache_size,
+                       uint32_t nr_shards, struct xcache_ops *ops,
+                       uint32_t flags, void *priv)
+{
+    return xcache_init_weighted(cache, xcache_size, 0, nr_shards, ops, flags,
+                                priv);
+}
+
+int xcache_init(struct xcache *cache, uint32_t xcache_size,
+                struct xcache_ops *ops, uint32_t flags, void *priv)
+{
+    return xcache_init_shards(cache, xcache_size, 1, ops, flags, priv);
+}
+
 int xcache_remove(struct xcache *cache, xcache_handler h)
 {
     int r;
-    xlock_acquire(&cache->lock);
-    r = __xcache_remove(cache, h);
-    xlock_release(&cache->lock);
+    struct xcache_shard *shard = __idx_shard(cache, h);
+
+    xlock_acquire(&shard->lock);
+    r = __xcache_remove(cache, shard, h);
+    xlock_release(&shard->lock);
     return r;
 }
 
@@ -846,33 +1996,38 @@ int xcache_invalidate(struct xcache *cache, char *name)
 {
     int r = 0;
     xcache_handler h;
+    xhashidx hash = xhash_hash(XHASH_STRING, (xhashidx) name);
+    struct xcache_shard *shard = __hash_shard(cache, hash);
 
-    xlock_acquire(&cache->lock);
+    xlock_acquire(&shard->lock);
 
-    h = __xcache_lookup_entries(cache, name);
+    h = __xcache_lookup_entries(shard, name, hash);
     if (h != NoEntry) {
-        r = __xcache_remove_entries(cache, h);
+        r = __xcache_remove_entries(cache, shard, h);
         goto out_put;
     }
 
     if (cache->flags & XCACHE_USE_RMTABLE) {
-        xlock_acquire(&cache->rm_lock);
-        xlock_release(&cache->lock);
+        xlock_acquire(&shard->rm_lock);
+        xlock_release(&shard->lock);
 
-        h = __xcache_lookup_rm(cache, name);
+        h = __xcache_lookup_rm(shard, name, hash);
         if (h != NoEntry) {
-            r = __xcache_remove_rm(cache, h);
+            r = __xcache_remove_rm(cache, shard, h);
+            if (r >= 0) {
+                cache->nodes[h].state = NODE_REMOVED;
+            }
         }
 
-        xlock_release(&cache->rm_lock);
+        xlock_release(&shard->rm_lock);
     } else {
-        xlock_release(&cache->lock);
+        xlock_release(&shard->lock);
     }
 
     return r;
 
   out_put:
-    xlock_release(&cache->lock);
+    xlock_release(&shard->lock);
 
     if (r >= 0) {
         xcache_put(cache, h);
@@ -939,13 +2094,23 @@ void xcache_close(struct xcache *cache)
 
 void xcache_free(struct xcache *cache)
 {
-    if (cache->flags & XCACHE_LRU_HEAP) {
-        xbinheap_free(&cache->binheap);
-    } else if (cache->flags & XCACHE_LRU_ARRAY) {
+    uint32_t i;
+
+    /* other threads drop their buffered hits on their next lookup */
+    if (hits.cache_id == cache->id) {
+        hits.cache_id = 0;
+        hits.count = 0;
+    }
+
+    for (i = 0; i < cache->nr_shards; i++) {
+        __shard_free(cache, &cache->shards[i]);
+    }
+    xtypes_free(cache->shards);
+    xtypes_free(cache->readers);
+    if (cache->flags & XCACHE_LRU_ARRAY) {
         xtypes_free(cache->times);
     }
     xtypes_free(cache->nodes);
-    xhash_free(cache->entries);
 }
 
 /*
@@ -956,3 +2121,23 @@ uint64_t xcache_free_nodes(struct xcache *cache)
 {
     return (uint64_t) __count_free_nodes(cache);
 }
+
+/*
+ * Return the sum of the costs of the cached entries.
+ * Hint only, since its racy.
+ */
+uint64_t xcache_weight(struct xcache *cache)
+{
+    uint32_t i;
+    uint64_t weight = 0;
+
+    for (i = 0; i < cache->nr_shards; i++) {
+        weight += cache->shards[i].weight;
+    }
+    return weight;
+}
+
+uint64_t xcache_max_weight(struct xcache *cache)
+{
+    return cache->max_weight;
+}
@@ -0,0 +1,427 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sched.h>
+#include <xseg/xtypes.h>
+#include <xseg/xexec.h>
+
+/* ready xworkqs a deque holds before it first grows */
+#define XEXEC_DEQUE_SIZE 64
+
+static __thread struct xexec_worker *current_worker = NULL;
+
+static struct xexec_array *__array_alloc(long size)
+{
+    struct xexec_array *a;
+
+    a = xtypes_malloc(sizeof(struct xexec_array) +
+                      size * sizeof(struct xworkq *));
+    if (!a) {
+        return NULL;
+    }
+    a->size = size;
+    a->prev = NULL;
+    return a;
+}
+
+static int deque_init(struct xexec_deque *dq)
+{
+    dq->top = 0;
+    dq->bottom = 0;
+    dq->array = __array_alloc(XEXEC_DEQUE_SIZE);
+    if (!dq->array) {
+        return -1;
+    }
+    return 0;
+}
+
+static void deque_free(struct xexec_deque *dq)
+{
+    struct xexec_array *a, *prev;
+
+    for (a = dq->array; a; a = prev) {
+        prev = a->prev;
+        xtypes_free(a);
+    }
+    dq->array = NULL;
+}
+
+static int deque_empty(struct xexec_deque *dq)
+{
+    return dq->bottom <= dq->top;
+}
+
+/*
+ * Push at the bottom. Only the owner of the deque may push or pop. A full
+ * array is replaced by one of double size, and kept until the deque is freed,
+ * since thieves may still read from it.
+ */
+static int deque_push(struct xexec_deque *dq, struct xworkq *wq)
+{
+    struct xexec_array *a, *na;
+    long b, t, i;
+
+    b = dq->bottom;
+    t = dq->top;
+    a = dq->array;
+    if (b - t >= a->size) {
+        na = __array_alloc(a->size * 2);
+        if (!na) {
+            return -1;
+        }
+        for (i = t; i < b; i++) {
+            na->queues[i & (na->size - 1)] = a->queues[i & (a->size - 1)];
+        }
+        na->prev = a;
+        BARRIER();
+        dq->array = na;
+        a = na;
+    }
+    a->queues[b & (a->size - 1)] = wq;
+    BARRIER();
+    dq->bottom = b + 1;
+    return 0;
+}
+
+static struct xworkq *deque_pop(struct xexec_deque *dq)
+{
+    struct xexec_array *a;
+    struct xworkq *wq;
+    long b, t;
+
+    b = dq->bottom - 1;
+    a = dq->array;
+    dq->bottom = b;
+    MFENCE();
+    t = dq->top;
+    if (t > b) {
+        dq->bottom = b + 1;
+        return NULL;
+    }
+    wq = a->queues[b & (a->size - 1)];
+    if (t == b) {
+        /* the last one, race against thieves for it */
+        if (!__sync_bool_compare_and_swap(&dq->top, t, t + 1)) {
+            wq = NULL;
+        }
+        dq->bottom = b + 1;
+    }
+    return wq;
+}
+
+/* take from the top, or return NULL if empty or lost to another thief */
+static struct xworkq *deque_steal(struct xexec_deque *dq)
+{
+    struct xexec_array *a;
+    struct xworkq *wq;
+    long b, t;
+
+    t = dq->top;
+    MFENCE();
+    b = dq->bottom;
+    if (t >= b) {
+        return NULL;
+    }
+    a = dq->array;
+    wq = a->queues[t & (a->size - 1)];
+    if (!__sync_bool_compare_and_swap(&dq->top, t, t + 1)) {
+        return NULL;
+    }
+    return wq;
+}
+
+static int has_work(struct xexec *ex)
+{
+    uint32_t i;
+
+    if (!deque_empty(&ex->inject)) {
+        return 1;
+    }
+    for (i = 0; i < ex->nr_workers; i++) {
+        if (!deque_empty(&ex->workers[i].deque)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run the works of an xworkq held by the caller, and give it up. The queue is
+ * taken again if works were appended after the last check of xworkq_signal but
+ * before it was given up, since nobody else would make it ready.
+ *
+ * Returns -1 if works are still pending after the run, which happens when the
+ * user lock of the xworkq is held elsewhere. The queue is then kept, and the
+ * caller must requeue it instead of spinning on it.
+ */
+static int run_queue(struct xworkq *wq)
+{
+    do {
+        xworkq_signal(wq);
+        if (xworkq_pending(wq)) {
+            return -1;
+        }
+        wq->sched = 0;
+        MFENCE();
+    } while (xworkq_pending(wq) &&
+             __sync_bool_compare_and_swap(&wq->sched, 0, 1));
+    return 0;
+}
+
+/*
+ * Put back an xworkq that could not be run, behind the ones already injected,
+ * and yield so that the holder of its lock can make progress.
+ */
+static void requeue(struct xexec *ex, struct xworkq *wq)
+{
+    int r;
+
+    for (;;) {
+        sched_yield();
+        xlock_acquire(&ex->inject_lock);
+        r = deque_push(&ex->inject, wq);
+        xlock_release(&ex->inject_lock);
+        if (LIKELY(r >= 0) || run_queue(wq) >= 0) {
+            return;
+        }
+    }
+}
+
+static void make_ready(struct xexec *ex, struct xworkq *wq)
+{
+    struct xexec_worker *w = current_worker;
+    int r;
+
+    MFENCE();
+    if (wq->sched || !__sync_bool_compare_and_swap(&wq->sched, 0, 1)) {
+        return;
+    }
+
+    if (w && w->ex == ex) {
+        r = deque_push(&w->deque, wq);
+    } else {
+        xlock_acquire(&ex->inject_lock);
+        r = deque_push(&ex->inject, wq);
+        xlock_release(&ex->inject_lock);
+    }
+    if (UNLIKELY(r < 0)) {
+        /* no memory to grow the deque, run it here */
+        while (run_queue(wq) < 0) {
+            sched_yield();
+        }
+        return;
+    }
+
+    MFENCE();
+    if (ex->sleepers) {
+        pthread_mutex_lock(&ex->idle_mutex);
+        pthread_cond_signal(&ex->idle_cond);
+        pthread_mutex_unlock(&ex->idle_mutex);
+    }
+}
+
+static unsigned long xorshift(unsigned long *seed)
+{
+    unsigned long x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    return x;
+}
+
+static struct xworkq *find_work(struct xexec_worker *w)
+{
+    struct xexec *ex = w->ex;
+    struct xexec_worker *victim;
+    struct xworkq *wq;
+    uint32_t i, start;
+
+    wq = deque_pop(&w->deque);
+    if (wq) {
+        return wq;
+    }
+    wq = deque_steal(&ex->inject);
+    if (wq) {
+        return wq;
+    }
+    start = xorshift(&w->seed) % ex->nr_workers;
+    for (i = 0; i < ex->nr_workers; i++) {
+        victim = &ex->workers[(start + i) % ex->nr_workers];
+        if (victim == w) {
+            continue;
+        }
+        wq = deque_steal(&victim->deque);
+        if (wq) {
+            return wq;
+        }
+    }
+    return NULL;
+}
+
+static void *worker_loop(void *arg)
+{
+    struct xexec_worker *w = (struct xexec_worker *) arg;
+    struct xexec *ex = w->ex;
+    struct xworkq *wq;
+    unsigned long spins = 0;
+
+    current_worker = w;
+    for (;;) {
+        wq = find_work(w);
+        if (wq) {
+            if (UNLIKELY(run_queue(wq) < 0)) {
+                requeue(ex, wq);
+            }
+            spins = 0;
+            continue;
+        }
+        if (ex->stop && !has_work(ex)) {
+            break;
+        }
+        if (spins < XEXEC_IDLE_SPINS) {
+            spins++;
+            sched_yield();
+            continue;
+        }
+
+        /*
+         * Count ourselves as a sleeper before the last look for work, so
+         * that a concurrent make_ready either sees us and wakes us up, or
+         * has pushed before we look.
+         */
+        pthread_mutex_lock(&ex->idle_mutex);
+        __sync_fetch_and_add(&ex->sleepers, 1);
+        if (!ex->stop && !has_work(ex)) {
+            pthread_cond_wait(&ex->idle_cond, &ex->idle_mutex);
+        }
+        __sync_fetch_and_sub(&ex->sleepers, 1);
+        pthread_mutex_unlock(&ex->idle_mutex);
+        spins = 0;
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+static void __stop_workers(struct xexec *ex, uint32_t started)
+{
+    uint32_t i;
+
+    ex->stop = 1;
+    MFENCE();
+    pthread_mutex_lock(&ex->idle_mutex);
+    pthread_cond_broadcast(&ex->idle_cond);
+    pthread_mutex_unlock(&ex->idle_mutex);
+    for (i = 0; i < started; i++) {
+        pthread_join(ex->workers[i].thread, NULL);
+    }
+}
+
+int xexec_init(struct xexec *ex, uint32_t nr_workers)
+{
+    uint32_t i, started = 0;
+
+    if (!nr_workers) {
+        return -1;
+    }
+    ex->workers = xtypes_malloc(nr_workers * sizeof(struct xexec_worker));
+    if (!ex->workers) {
+        return -1;
+    }
+    ex->nr_workers = nr_workers;
+    ex->sleepers = 0;
+    ex->stop = 0;
+    xlock_release(&ex->inject_lock);
+    for (i = 0; i < nr_workers; i++) {
+        ex->workers[i].deque.array = NULL;
+    }
+    if (deque_init(&ex->inject) < 0) {
+        goto out_free;
+    }
+    for (i = 0; i < nr_workers; i++) {
+        if (deque_init(&ex->workers[i].deque) < 0) {
+            goto out_deques;
+        }
+        ex->workers[i].ex = ex;
+        ex->workers[i].seed = 2654435761UL * (i + 1);
+    }
+    pthread_mutex_init(&ex->idle_mutex, NULL);
+    pthread_cond_init(&ex->idle_cond, NULL);
+
+    for (started = 0; started < nr_workers; started++) {
+        if (pthread_create(&ex->workers[started].thread, NULL, worker_loop,
+                           &ex->workers[started])) {
+            goto out_threads;
+        }
+    }
+    return 0;
+
+  out_threads:
+    __stop_workers(ex, started);
+    pthread_cond_destroy(&ex->idle_cond);
+    pthread_mutex_destroy(&ex->idle_mutex);
+  out_deques:
+    for (i = 0; i < nr_workers; i++) {
+        deque_free(&ex->workers[i].deque);
+    }
+    deque_free(&ex->inject);
+  out_free:
+    xtypes_free(ex->workers);
+    return -1;
+}
+
+/*
+ * Append a job to an xworkq and make the queue ready, so that a worker of the
+ * executor runs it. The job never runs in the calling thread, unless the
+ * executor cannot grow its deques.
+ */
+int xexec_enqueue(struct xexec *ex, struct xworkq *wq,
+                  void (*job_fn) (void *q, void *arg), void *job)
+{
+    if (xworkq_append(wq, job_fn, job) < 0) {
+        return -1;
+    }
+    make_ready(ex, wq);
+    return 0;
+}
+
+int xexec_enqueue_work(struct xexec *ex, struct xworkq *wq, struct work *w)
+{
+    xworkq_append_work(wq, w);
+    make_ready(ex, wq);
+    return 0;
+}
+
+/*
+ * Wait for the workers to run all works enqueued so far, and stop them. No
+ * works may be enqueued from other threads after this is called.
+ */
+void xexec_destroy(struct xexec *ex)
+{
+    uint32_t i;
+
+    __stop_workers(ex, ex->nr_workers);
+    pthread_cond_destroy(&ex->idle_cond);
+    pthread_mutex_destroy(&ex->idle_mutex);
+    for (i = 0; i < ex->nr_workers; i++) {
+        deque_free(&ex->workers[i].deque);
+    }
+    deque_free(&ex->inject);
+    xtypes_free(ex->workers);
+    ex->workers = NULL;
+}
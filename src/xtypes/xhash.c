@@ -22,6 +22,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <xseg/xhash.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define UNUSED (~(xhashidx)0)   /* this entry was never used */
 #define DUMMY  ((~(xhashidx)0)-1)       /* this entry was used, but now its empty */
@@ -42,17 +45,113 @@ static inline int cmp_int(xhashidx key1, xhashidx key2)
     return (key1 == key2);
 }
 
+/*
+ * String hashing, based on wyhash by Wang Yi (public domain).
+ * Keys are read a word at a time, so that hashing a target name of a few
+ * hundred bytes costs a handful of multiplications.
+ */
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void wymum(uint64_t * a, uint64_t * b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t) * a, lb = (uint32_t) * b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t * p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t * p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t * p, size_t k)
+{
+    return (((uint64_t) p[0]) << 16) | (((uint64_t) p[k >> 1]) << 8) |
+        p[k - 1];
+}
+
+static uint64_t wyhash(const void *key, size_t len)
+{
+    const uint8_t *p = key;
+    uint64_t seed = wymix(wyp[0], wyp[1]);
+    uint64_t a, b, see1, see2;
+    size_t i;
+
+    if (LIKELY(len <= 16)) {
+        if (LIKELY(len >= 4)) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) |
+                wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (LIKELY(len > 0)) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = len;
+        if (UNLIKELY(i > 48)) {
+            see1 = see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (LIKELY(i > 48));
+            seed ^= see1 ^ see2;
+        }
+        while (UNLIKELY(i > 16)) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
 static inline xhashidx hash_string(xhashidx key)
 {
     //assume a valid NULL terminated string
 
     //function to access key if in container
     char *string = (char *) key;
-    unsigned int i, len = strlen(string);
-    xhashidx hv = string[0] << 7;
-    for (i = 1; i <= len; i++) {
-        hv = (hv * 1000003) ^ string[i];
-    }
+    xhashidx hv = wyhash(string, strlen(string));
     if (hv == Noxhashidx) {
         hv = Noxhashidx - 1;
     }
@@ -169,11 +268,280 @@ static bool item_unused(xhash_t * xhash, xhashidx idx, bool vals)
 
 }
 
+/*
+ * Swiss table layout (XHASH_SWISS).
+ *
+ * A control byte array follows the keys and the values. A control byte is
+ * either CTRL_EMPTY, CTRL_DELETED, or for used slots the low 7 bits of the
+ * (mixed) key hash. The rest of the hash selects a group of 16 slots, and a
+ * lookup matches the tag against all control bytes of a group at once, so
+ * that keys are compared only for the few slots whose tag matches. Groups
+ * are probed quadratically, until a group with an empty slot is met.
+ *
+ * Tables smaller than a group have a single group, whose control bytes past
+ * the end of the table are CTRL_SENTINEL and never match.
+ */
+#define SWISS_GROUP_SHIFT 4
+#define SWISS_GROUP_WIDTH (1 << SWISS_GROUP_SHIFT)
+
+#define CTRL_EMPTY      ((int8_t) -128)
+#define CTRL_DELETED    ((int8_t) -2)
+#define CTRL_SENTINEL   ((int8_t) -1)
+
+static inline xhashidx ctrl_bytes(xhashidx nr_items)
+{
+    return nr_items < SWISS_GROUP_WIDTH ? SWISS_GROUP_WIDTH : nr_items;
+}
+
+static inline int8_t *xhash_ctrl(xhash_t * xhash)
+{
+    return (int8_t *) (xhash_vals(xhash) + xhash_size(xhash));
+}
+
+/* the full hash of every used slot, after the control bytes */
+static inline xhashidx *xhash_hashes(xhash_t * xhash)
+{
+    return (xhashidx *) (xhash_ctrl(xhash) + ctrl_bytes(xhash_size(xhash)));
+}
+
+static inline bool is_swiss(xhash_t * xhash)
+{
+    return (xhash->flags & XHASH_SWISS);
+}
+
+#ifdef __SSE2__
+static inline uint32_t group_match(const int8_t * g, int8_t tag)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) g);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl));
+}
+
+/* empty or deleted slots */
+static inline uint32_t group_match_free(const int8_t * g)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) g);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(CTRL_SENTINEL),
+                                            ctrl));
+}
+#else
+static inline uint32_t group_match(const int8_t * g, int8_t tag)
+{
+    uint32_t i, m = 0;
+    for (i = 0; i < SWISS_GROUP_WIDTH; i++) {
+        m |= (uint32_t) (g[i] == tag) << i;
+    }
+    return m;
+}
+
+static inline uint32_t group_match_free(const int8_t * g)
+{
+    uint32_t i, m = 0;
+    for (i = 0; i < SWISS_GROUP_WIDTH; i++) {
+        m |= (uint32_t) (g[i] < CTRL_SENTINEL) << i;
+    }
+    return m;
+}
+#endif
+
+static inline uint32_t group_match_empty(const int8_t * g)
+{
+    return group_match(g, CTRL_EMPTY);
+}
+
+/* spread the key hash over all bits, since the integer hash is the identity
+ * and the tag is taken from the low bits.
+ */
+static inline xhashidx swiss_mix(xhashidx hv)
+{
+    hv ^= hv >> 33;
+    hv *= 0xff51afd7ed558ccdULL;
+    hv ^= hv >> 33;
+    return hv;
+}
+
+static inline int8_t swiss_tag(xhashidx hv)
+{
+    return (int8_t) (hv & 0x7f);
+}
+
+static inline xhashidx swiss_groups(xhash_t * xhash)
+{
+    xhashidx size_shift = xhash->size_shift;
+    if (size_shift < SWISS_GROUP_SHIFT) {
+        return 1;
+    }
+    return (xhashidx) 1 << (size_shift - SWISS_GROUP_SHIFT);
+}
+
 static inline unsigned item_valid(xhash_t * xhash, xhashidx idx, bool vals)
 {
+    if (is_swiss(xhash)) {
+        return xhash_ctrl(xhash)[idx] >= 0;
+    }
     return !(item_dummy(xhash, idx, vals) || item_unused(xhash, idx, vals));
 }
 
+/*
+ * swiss_find__ is specialized at compile time for each key type, so that the
+ * hash and compare functions are inlined instead of called through
+ * types_fun.
+ *
+ * The full hash of each slot is kept, so that string keys are compared only
+ * when their hashes match, and resizing never touches the keys.
+ */
+static inline __attribute__ ((always_inline))
+xhashidx swiss_hv__(xhashidx hash, const enum xhash_type type)
+{
+    /* string hashes are already well mixed */
+    if (type == XHASH_INTEGER) {
+        return swiss_mix(hash);
+    }
+    return hash;
+}
+
+static inline __attribute__ ((always_inline))
+xhashidx swiss_hash__(xhashidx key, const enum xhash_type type)
+{
+    if (type == XHASH_INTEGER) {
+        return swiss_hv__(hash_int(key), type);
+    }
+    return swiss_hv__(hash_string(key), type);
+}
+
+static inline __attribute__ ((always_inline))
+int swiss_find__(xhash_t * xhash, xhashidx key, xhashidx hv,
+                 xhashidx * idx_ret, const enum xhash_type type)
+{
+    xhashidx *kvs = xhash_kvs(xhash);
+    xhashidx *hashes = xhash_hashes(xhash);
+    int8_t *ctrl = xhash_ctrl(xhash);
+    int8_t tag = swiss_tag(hv);
+    xhashidx nr_groups = swiss_groups(xhash);
+    xhashidx gmask = nr_groups - 1;
+    xhashidx g = (hv >> 7) & gmask;
+    xhashidx probe, idx;
+    const int8_t *group;
+    uint32_t m;
+    int eq;
+
+    INCSTAT(xhash->lookups);
+    for (probe = 0; probe < nr_groups; probe++) {
+        group = ctrl + (g << SWISS_GROUP_SHIFT);
+        m = group_match(group, tag);
+        while (m) {
+            idx = (g << SWISS_GROUP_SHIFT) + __builtin_ctz(m);
+            if (type == XHASH_INTEGER) {
+                eq = cmp_int(kvs[idx], key);
+            } else {
+                eq = hashes[idx] == hv && cmp_string(kvs[idx], key);
+            }
+            if (eq) {
+                *idx_ret = idx;
+                return 0;
+            }
+            m &= m - 1;
+        }
+        if (group_match_empty(group)) {
+            break;
+        }
+        INCSTAT(xhash->bounces);
+        g = (g + probe + 1) & gmask;
+    }
+    return -XHASH_ENOENT;
+}
+
+static inline xhashidx swiss_hv(xhash_t * xhash, xhashidx hash)
+{
+    if (xhash->type == XHASH_INTEGER) {
+        return swiss_hv__(hash, XHASH_INTEGER);
+    }
+    return swiss_hv__(hash, XHASH_STRING);
+}
+
+static inline xhashidx swiss_hash(xhash_t * xhash, xhashidx key)
+{
+    if (xhash->type == XHASH_INTEGER) {
+        return swiss_hash__(key, XHASH_INTEGER);
+    }
+    return swiss_hash__(key, XHASH_STRING);
+}
+
+static inline int swiss_find(xhash_t * xhash, xhashidx key, xhashidx hv,
+                             xhashidx * idx_ret)
+{
+    if (xhash->type == XHASH_INTEGER) {
+        return swiss_find__(xhash, key, hv, idx_ret, XHASH_INTEGER);
+    }
+    return swiss_find__(xhash, key, hv, idx_ret, XHASH_STRING);
+}
+
+/* first empty or deleted slot on the probe sequence of hv */
+static xhashidx swiss_find_free(xhash_t * xhash, xhashidx hv)
+{
+    int8_t *ctrl = xhash_ctrl(xhash);
+    xhashidx nr_groups = swiss_groups(xhash);
+    xhashidx gmask = nr_groups - 1;
+    xhashidx g = (hv >> 7) & gmask;
+    xhashidx probe;
+    uint32_t m;
+
+    for (probe = 0; probe < nr_groups; probe++) {
+        m = group_match_free(ctrl + (g << SWISS_GROUP_SHIFT));
+        if (m) {
+            return (g << SWISS_GROUP_SHIFT) + __builtin_ctz(m);
+        }
+        g = (g + probe + 1) & gmask;
+    }
+    return Noxhashidx;
+}
+
+static void swiss_set(xhash_t * xhash, xhashidx idx, xhashidx hv,
+                      xhashidx key, xhashidx val)
+{
+    int8_t *ctrl = xhash_ctrl(xhash);
+    if (ctrl[idx] == CTRL_DELETED) {
+        xhash->dummies--;
+    }
+    xhash->used++;
+    xhash_hashes(xhash)[idx] = hv;
+    xhash_kvs(xhash)[idx] = key;
+    xhash_vals(xhash)[idx] = val;
+    /*
+     * Publish the tag last, so that an optimistic reader racing with us never
+     * matches a slot whose key is not written yet.
+     */
+    __asm__ __volatile__("":::"memory");
+    ctrl[idx] = swiss_tag(hv);
+}
+
+/*
+ * A slot can be marked empty again, if its group still has an empty slot.
+ * No probe sequence continues past such a group, so no lookup can be cut
+ * short by the new empty slot.
+ */
+static void swiss_clear(xhash_t * xhash, xhashidx idx)
+{
+    int8_t *ctrl = xhash_ctrl(xhash);
+    int8_t *group = ctrl + (idx & ~((xhashidx) SWISS_GROUP_WIDTH - 1));
+    if (group_match_empty(group)) {
+        ctrl[idx] = CTRL_EMPTY;
+    } else {
+        ctrl[idx] = CTRL_DELETED;
+        xhash->dummies++;
+    }
+    xhash->used--;
+}
+
+static void swiss_init(xhash_t * xhash, xhashidx nr_items)
+{
+    int8_t *ctrl = xhash_ctrl(xhash);
+    memset(ctrl, CTRL_EMPTY, nr_items);
+    if (nr_items < SWISS_GROUP_WIDTH) {
+        memset(ctrl + nr_items, CTRL_SENTINEL,
+               SWISS_GROUP_WIDTH - nr_items);
+    }
+}
+
 /*
 static void __attribute__((unused))
 assert_key(xhashidx key)
@@ -200,14 +568,20 @@ assert_kv(xhashidx k, xhashidx v)
 
 void
 xhash_init__(xhash_t * xhash, xhashidx size_shift, xhashidx minsize_shift,
-             xhashidx limit, enum xhash_type type, bool vals)
+             xhashidx limit, enum xhash_type type, uint32_t flags, bool vals)
 {
     xhashidx nr_items = 1UL << size_shift;
     xhashidx *kvs = (xhashidx *) ((char *) xhash + sizeof(struct xhash));
     xhashidx i;
 
     XPTRSET(&xhash->kvs, kvs);
+    xhash->size_shift = size_shift;
+    xhash->flags = flags;
 
+    if (is_swiss(xhash)) {
+        swiss_init(xhash, nr_items);
+        goto out;
+    }
 
     if (!vals) {
         for (i = 0; i < nr_items; i++) {
@@ -226,7 +600,8 @@ xhash_init__(xhash_t * xhash, xhashidx size_shift, xhashidx minsize_shift,
 
   out:
     xhash->dummies = xhash->used = 0;
-    xhash->size_shift = size_shift;
+    xhash->old.x = 0;
+    xhash->migrate_idx = 0;
     xhash->minsize_shift = minsize_shift;
     xhash->limit = limit;
     xhash->type = type;
@@ -237,26 +612,31 @@ xhash_init__(xhash_t * xhash, xhashidx size_shift, xhashidx minsize_shift,
     ZEROSTAT(xhash->bounces);
 }
 
-static ssize_t get_alloc_size(xhashidx size_shift, bool vals)
+/* swiss tables also hold a control byte and a cached hash per slot */
+static ssize_t get_alloc_size(xhashidx size_shift, bool vals, uint32_t flags)
 {
     xhashidx nr_items = 1UL << size_shift;
     size_t keys_size = nr_items * sizeof(xhashidx);
     size_t alloc_size = vals ? keys_size << 1 : keys_size;
+    if (flags & XHASH_SWISS) {
+        alloc_size += ctrl_bytes(nr_items) + keys_size;
+    }
     return sizeof(struct xhash) + alloc_size;
 }
 
 
 xhash_t *xhash_new__(xhashidx size_shift, xhashidx minsize_shift,
-                     xhashidx limit, enum xhash_type type, bool vals)
+                     xhashidx limit, enum xhash_type type, uint32_t flags,
+                     bool vals)
 {
     struct xhash *xhash;
-    xhash = xtypes_malloc(get_alloc_size(size_shift, vals));
+    xhash = xtypes_malloc(get_alloc_size(size_shift, vals, flags));
     if (!xhash) {
         XSEGLOG("couldn't malloc\n");
         return NULL;
     }
 
-    xhash_init__(xhash, size_shift, minsize_shift, limit, type, vals);
+    xhash_init__(xhash, size_shift, minsize_shift, limit, type, flags, vals);
 
     return xhash;
 }
@@ -266,7 +646,18 @@ xhash_t *xhash_resize__(struct xhash * xhash, xhashidx new_size_shift,
                         xhashidx new_limit, bool vals)
 {
     return xhash_new__(new_size_shift, xhash->minsize_shift, new_limit,
-                       xhash->type, vals);
+                       xhash->type, xhash->flags, vals);
+}
+
+static int swiss_delete(xhash_t * xhash, xhashidx key)
+{
+    xhashidx idx;
+    if (swiss_find(xhash, key, swiss_hash(xhash, key), &idx) < 0) {
+        return -XHASH_ENOENT;
+    }
+    INCSTAT(xhash->deletes);
+    swiss_clear(xhash, idx);
+    return 0;
 }
 
 int xhash_delete__(xhash_t * xhash, xhashidx key, bool vals)
@@ -274,11 +665,17 @@ int xhash_delete__(xhash_t * xhash, xhashidx key, bool vals)
 //    XSEGLOG("Deleting %lx", key);
     xhash_cmp_fun_t cmp_fun = types_fun[xhash->type].cmp_fun;
     xhash_hash_fun_t hash_fun = types_fun[xhash->type].hash_fun;
-    xhashidx perturb = hash_fun(key);
-    xhashidx mask = xhash_size(xhash) - 1;
-    xhashidx idx = hash_fun(key) & mask;
+    xhashidx perturb, mask, idx;
     xhashidx *kvs = xhash_kvs(xhash);
 
+    if (is_swiss(xhash)) {
+        return swiss_delete(xhash, key);
+    }
+
+    perturb = hash_fun(key);
+    mask = xhash_size(xhash) - 1;
+    idx = perturb & mask;
+
     for (;;) {
         if (item_unused(xhash, idx, vals)) {
             return -XHASH_ENOENT;
@@ -305,7 +702,7 @@ xhashidx xhash_grow_size_shift(xhash_t * xhash)
     xhashidx new_size_shift;
     xhashidx u;
 
-    u = xhash->used;
+    u = xhash_elements(xhash);
     //printf("used: %lu\n", u);
     if (u / 2 + u >= ((xhashidx) 1 << old_size_shift)) {
         new_size_shift = old_size_shift + 1;
@@ -327,20 +724,27 @@ xhashidx xhash_shrink_size_shift(xhash_t * xhash)
     return new_size_shift;
 }
 
+/* items still to be migrated from a drained table count as used */
 static bool grow_check(xhash_t * xhash)
 {
     xhashidx size_shift = xhash->size_shift;
-    xhashidx u = xhash->used + xhash->dummies;
+    xhashidx u = xhash_elements(xhash) + xhash->dummies;
     xhashidx size = (xhashidx) 1UL << size_shift;
     return ((u / 2 + u) >= size) ? true : false;
 }
 
+/*
+ * Tables grow when 2/3 full and shrink when less than 1/8 full, to half
+ * their size. A table left 1/4 full by shrinking, or 1/3 full by growing,
+ * must more than double or halve its items before it is resized again, so
+ * that alternating insertions and deletions do not thrash between sizes.
+ */
 static bool shrink_check(xhash_t * xhash)
 {
     xhashidx size_shift = xhash->size_shift;
     xhashidx size = (xhashidx) 1 << size_shift;
     xhashidx u = xhash->used;
-    return (4 * u < size && size_shift > xhash->minsize_shift) ? true : false;
+    return (8 * u < size && size_shift > xhash->minsize_shift) ? true : false;
 }
 
 
@@ -350,13 +754,25 @@ static bool shrink_check(xhash_t * xhash)
 
 ssize_t xhash_get_alloc_size(xhashidx size_shift)
 {
-    return get_alloc_size(size_shift, true);
+    return get_alloc_size(size_shift, true, 0);
+}
+
+ssize_t xhash_get_alloc_size_flags(xhashidx size_shift, uint32_t flags)
+{
+    return get_alloc_size(size_shift, true, flags);
 }
 
 xhash_t *xhash_new(xhashidx minsize_shift, xhashidx limit,
                    enum xhash_type type)
 {
-    return xhash_new__(minsize_shift, minsize_shift, limit, type, true);
+    return xhash_new__(minsize_shift, minsize_shift, limit, type, 0, true);
+}
+
+xhash_t *xhash_new_flags(xhashidx minsize_shift, xhashidx limit,
+                         enum xhash_type type, uint32_t flags)
+{
+    return xhash_new__(minsize_shift, minsize_shift, limit, type, flags,
+                       true);
 }
 
 void xhash_free(struct xhash *xhash)
@@ -367,7 +783,14 @@ void xhash_free(struct xhash *xhash)
 void xhash_init(struct xhash *xhash, xhashidx minsize_shift, xhashidx limit,
                 enum xhash_type type)
 {
-    xhash_init__(xhash, minsize_shift, minsize_shift, limit, type, true);
+    xhash_init__(xhash, minsize_shift, minsize_shift, limit, type, 0, true);
+}
+
+void xhash_init_flags(struct xhash *xhash, xhashidx minsize_shift,
+                      xhashidx limit, enum xhash_type type, uint32_t flags)
+{
+    xhash_init__(xhash, minsize_shift, minsize_shift, limit, type, flags,
+                 true);
 }
 
 /*
@@ -453,10 +876,63 @@ static inline void inc_val(xhash_t * p, xhashidx idx, xhashidx val)
     vals[idx] += val;
 }
 
+/*
+ * insert or update key in a swiss table. When inc is set, val is added to
+ * the value of an existing key instead of replacing it.
+ */
+static void swiss_upsert(xhash_t * xhash, xhashidx key, xhashidx val,
+                         bool inc)
+{
+    xhashidx hv = swiss_hash(xhash, key);
+    xhashidx idx;
+
+    INCSTAT(xhash->inserts);
+    if (!swiss_find(xhash, key, hv, &idx)) {
+        if (inc) {
+            inc_val(xhash, idx, val);
+        } else {
+            set_val(xhash, idx, key, val);
+        }
+        return;
+    }
+    idx = swiss_find_free(xhash, hv);
+    if (idx == Noxhashidx) {
+        XSEGLOG("BUG: no free slot in xhash %p", (void *) xhash);
+        return;
+    }
+    swiss_set(xhash, idx, hv, key, val);
+}
+
+/* keys are unique, so they are placed by their cached hashes alone */
+static void swiss_rehash(xhash_t * xhash, xhash_t * new)
+{
+    xhashidx *kvs = xhash_kvs(xhash);
+    xhashidx *vals = xhash_vals(xhash);
+    xhashidx *hashes = xhash_hashes(xhash);
+    int8_t *ctrl = xhash_ctrl(xhash);
+    xhashidx i, idx;
+
+    for (i = 0; i < xhash_size(xhash); i++) {
+        if (ctrl[i] < 0) {
+            continue;
+        }
+        idx = swiss_find_free(new, hashes[i]);
+        if (idx == Noxhashidx) {
+            XSEGLOG("BUG: no free slot in xhash %p", (void *) new);
+            continue;
+        }
+        swiss_set(new, idx, hashes[i], kvs[i], vals[i]);
+    }
+}
+
 void xhash_insert__(struct xhash *xhash, xhashidx key, xhashidx val)
 {
     //XSEGLOG("inserting %lx", key);
     //fprintf(stderr, "insert: (%lu,%lu)\n", key, val);
+    if (is_swiss(xhash)) {
+        swiss_upsert(xhash, key, val, false);
+        return;
+    }
 #define PHUPD_UPDATE__(_p, _i, _k, _v) set_val(_p, _i, _k, _v)
 #define PHUPD_SET__(_p, _i, _k, _v)    xhash_upd_set(_p, _i, _k, _v)
     PHASH_UPDATE(xhash, key, val, true)
@@ -464,14 +940,87 @@ void xhash_insert__(struct xhash *xhash, xhashidx key, xhashidx val)
 #undef PHUPD_SET__
 }
 
+int xhash_lookup__(xhash_t * xhash, xhashidx key, xhashidx * idx_ret,
+                   bool vals);
+
+/*
+ * Incremental resize helpers.
+ *
+ * A key lives either in xhash or in the table it drains, never in both.
+ * Insertions go to xhash and remove the key from the drained table, and
+ * every insertion or deletion migrates the next XHASH_MIGRATE_SLOTS slots.
+ */
+#define XHASH_MIGRATE_SLOTS 64
+
+/* the table drained by xhash, if it still has items */
+static inline xhash_t *draining(xhash_t * xhash)
+{
+    xhash_t *old = xhash_old(xhash);
+    return (old && old->used) ? old : NULL;
+}
+
+static void migrate_slot(xhash_t * xhash, xhash_t * old, xhashidx idx)
+{
+    xhashidx key = xhash_kvs(old)[idx];
+    xhashidx val = xhash_vals(old)[idx];
+    xhashidx hv, free_idx;
+
+    if (!is_swiss(old)) {
+        set_dummy_item(old, idx, true);
+        old->dummies++;
+        old->used--;
+        xhash_insert__(xhash, key, val);
+        return;
+    }
+
+    /* both tables have the same layout, place the key by its hash */
+    hv = xhash_hashes(old)[idx];
+    swiss_clear(old, idx);
+    free_idx = swiss_find_free(xhash, hv);
+    if (free_idx == Noxhashidx) {
+        XSEGLOG("BUG: no free slot in xhash %p", (void *) xhash);
+        return;
+    }
+    swiss_set(xhash, free_idx, hv, key, val);
+}
+
+/* migrate the next nr slots of the drained table */
+static void migrate(xhash_t * xhash, xhashidx nr)
+{
+    xhash_t *old = draining(xhash);
+    xhashidx end;
+
+    if (!old) {
+        return;
+    }
+    end = xhash_size(old);
+    if (nr < end - xhash->migrate_idx) {
+        end = xhash->migrate_idx + nr;
+    }
+    for (; xhash->migrate_idx < end && old->used; xhash->migrate_idx++) {
+        if (item_valid(old, xhash->migrate_idx, true)) {
+            migrate_slot(xhash, old, xhash->migrate_idx);
+        }
+    }
+}
+
 int xhash_insert(struct xhash *xhash, xhashidx key, xhashidx val)
 {
-    if (xhash->limit && xhash->used >= xhash->limit) {
+    xhash_t *old;
+
+    if (xhash->limit && xhash_elements(xhash) >= xhash->limit) {
         return -XHASH_ENOSPC;
     }
+    migrate(xhash, XHASH_MIGRATE_SLOTS);
     if (grow_check(xhash)) {
+        /* drain the old table, so that it can be reclaimed before resizing */
+        migrate(xhash, Noxhashidx);
         return -XHASH_ERESIZE;
     }
+    old = draining(xhash);
+    if (old) {
+        xhash_delete__(old, key, true);
+    }
     xhash_insert__(xhash, key, val);
     return 0;
 }
@@ -479,6 +1028,10 @@ int xhash_insert(struct xhash *xhash, xhashidx key, xhashidx val)
 
 void xhash_freql_update__(struct xhash *xhash, xhashidx key, xhashidx val)
 {
+    if (is_swiss(xhash)) {
+        swiss_upsert(xhash, key, val, true);
+        return;
+    }
 #define PHUPD_UPDATE__(_p, _i, _k, _v) inc_val(_p, _i, _v)
 #define PHUPD_SET__(_p, _i, _k, _v)    xhash_upd_set(_p, _i, _k, _v)
     PHASH_UPDATE(xhash, key, val, true)
@@ -488,51 +1041,130 @@ void xhash_freql_update__(struct xhash *xhash, xhashidx key, xhashidx val)
 
 int xhash_freql_update(struct xhash *xhash, xhashidx key, xhashidx val)
 {
+    xhash_t *old;
+    xhashidx idx;
+
+    migrate(xhash, XHASH_MIGRATE_SLOTS);
     if (grow_check(xhash)) {
+        migrate(xhash, Noxhashidx);
         return -XHASH_ERESIZE;
     }
+    old = draining(xhash);
+    if (old && !xhash_lookup__(old, key, &idx, true)) {
+        val += xhash_vals(old)[idx];
+        xhash_delete__(old, key, true);
+        xhash_insert__(xhash, key, val);
+        return 0;
+    }
     xhash_freql_update__(xhash, key, val);
     return 0;
 }
 
+static void copy_items(xhash_t * xhash, xhash_t * new)
+{
+    xhashidx i;
+
+    if (is_swiss(xhash)) {
+        swiss_rehash(xhash, new);
+        return;
+    }
+    for (i = 0; i < xhash_size(xhash); i++) {
+        if (item_valid(xhash, i, true)) {
+            //fprintf(stderr, "rs: inserting (%lu,%lu)\n", item->k, item->v);
+            xhash_insert__(new, *(xhash_kvs(xhash) + i),
+                           *(xhash_vals(xhash) + i));
+        }
+    }
+}
+
+/*
+ * The items of a table drained by xhash are copied as well. If new is NULL,
+ * the drained table is freed along with xhash, otherwise it is left to be
+ * reclaimed.
+ */
 xhash_t *xhash_resize(xhash_t * xhash, xhashidx new_size_shift,
                       xhashidx new_limit, xhash_t * new)
 {
     //XSEGLOG("Resizing xhash from %llu to %llu", xhash->size_shift, new_size_shift);
-    xhashidx i;
+    xhash_t *old = xhash_old(xhash);
     int f = ! !new;
     if (!f) {
         new = xhash_new__(new_size_shift, xhash->minsize_shift, new_limit,
-                          xhash->type, true);
+                          xhash->type, xhash->flags, true);
     } else {
         xhash_init__(new, new_size_shift, xhash->minsize_shift, new_limit,
-                     xhash->type, true);
+                     xhash->type, xhash->flags, true);
     }
 
     if (!new) {
         return NULL;
     }
     //fprintf(stderr, "resizing: (%lu,%lu,%lu)\n", xhash->size_shift, xhash->used, xhash->dummies);
-    for (i = 0; i < xhash_size(xhash); i++) {
-        if (item_valid(xhash, i, true)) {
-            //fprintf(stderr, "rs: inserting (%lu,%lu)\n", item->k, item->v);
-            xhash_insert__(new, *(xhash_kvs(xhash) + i),
-                           *(xhash_vals(xhash) + i));
-        }
+    copy_items(xhash, new);
+    if (old) {
+        copy_items(old, new);
+        old->used = 0;
     }
 
     if (!f) {
+        xtypes_free(old);
         xtypes_free(xhash);
     }
     return new;
 }
 
+xhash_t *xhash_resize_incremental(xhash_t * xhash, xhashidx new_size_shift,
+                                  xhashidx new_limit, xhash_t * new)
+{
+    if (xhash_old(xhash)) {
+        XSEGLOG("BUG: xhash %p has a table to be reclaimed", (void *) xhash);
+        return NULL;
+    }
+    if (!new) {
+        new = xhash_new__(new_size_shift, xhash->minsize_shift, new_limit,
+                          xhash->type, xhash->flags, true);
+        if (!new) {
+            return NULL;
+        }
+    } else {
+        xhash_init__(new, new_size_shift, xhash->minsize_shift, new_limit,
+                     xhash->type, xhash->flags, true);
+    }
+    XPTRSET(&new->old, xhash);
+    return new;
+}
+
+xhash_t *xhash_reclaim(xhash_t * xhash)
+{
+    xhash_t *old = xhash_old(xhash);
+    if (!old || old->used) {
+        return NULL;
+    }
+    xhash->old.x = 0;
+    xhash->migrate_idx = 0;
+    return old;
+}
+
 /*
  * note that his function does not modify the internal structure of the hash
  * and thus its safe to use it for updating values during a xhash_iterate()
  */
 int xhash_update(struct xhash *xhash, xhashidx key, xhashidx val)
 {
+    xhash_t *old = draining(xhash);
+    xhashidx idx;
+
+    if (old && !xhash_lookup__(old, key, &idx, true)) {
+        set_val(old, idx, key, val);
+        return 1;
+    }
+    if (is_swiss(xhash)) {
+        if (swiss_find(xhash, key, swiss_hash(xhash, key), &idx) < 0) {
+            return -XHASH_ENOENT;
+        }
+        set_val(xhash, idx, key, val);
+        return 1;
+    }
 
     //fprintf(stderr, "update: (%lu,%lu)\n", key, val);
 #define PHUPD_UPDATE__(_p, _i, _k, _v) set_val(_p, _i, _k, _v)
@@ -544,27 +1176,59 @@ int xhash_update(struct xhash *xhash, xhashidx key, xhashidx val)
 }
 
 
+static int delete_both(struct xhash *xhash, xhashidx key)
+{
+    xhash_t *old;
+    int r;
+
+    migrate(xhash, XHASH_MIGRATE_SLOTS);
+    r = xhash_delete__(xhash, key, true);
+    old = draining(xhash);
+    if (r == -XHASH_ENOENT && old) {
+        r = xhash_delete__(old, key, true);
+    }
+    return r;
+}
+
+/* no shrinking while a table is drained, or not yet reclaimed */
 int xhash_delete(struct xhash *xhash, xhashidx key)
 {
+    if (xhash_old(xhash)) {
+        return delete_both(xhash, key);
+    }
     if (shrink_check(xhash)) {
         return -XHASH_ERESIZE;
     }
     return xhash_delete__(xhash, key, true);
 }
 
-int xhash_lookup__(xhash_t * xhash, xhashidx key, xhashidx * idx_ret,
-                   bool vals)
+int xhash_delete_noshrink(struct xhash *xhash, xhashidx key)
+{
+    if (xhash_old(xhash)) {
+        return delete_both(xhash, key);
+    }
+    return xhash_delete__(xhash, key, true);
+}
+
+static int xhash_lookup_hash__(xhash_t * xhash, xhashidx key, xhashidx hash,
+                               xhashidx * idx_ret, bool vals)
 {
     //XSEGLOG("looking up %lx", key);
     xhash_cmp_fun_t cmp_fun = types_fun[xhash->type].cmp_fun;
-    xhash_hash_fun_t hash_fun = types_fun[xhash->type].hash_fun;
     xhashidx size_shift = xhash->size_shift;
     xhashidx size = (1UL) << size_shift;
-    xhashidx perturb = hash_fun(key);
+    xhashidx perturb = hash;
     xhashidx mask = size - 1;
-    xhashidx idx = hash_fun(key) & mask;
+    xhashidx idx = hash & mask;
     xhashidx *kvs = xhash_kvs(xhash);
 
+    if (is_swiss(xhash)) {
+        if (swiss_find(xhash, key, swiss_hv(xhash, hash), idx_ret) < 0) {
+            return -XHASH_EEXIST;
+        }
+        return 0;
+    }
+
     INCSTAT(xhash->lookups);
     for (;;) {
         //XSEGLOG("size %llu, perturb %llu idx %llu mask %llu",
@@ -584,10 +1248,28 @@ int xhash_lookup__(xhash_t * xhash, xhashidx key, xhashidx * idx_ret,
     }
 }
 
+int xhash_lookup__(xhash_t * xhash, xhashidx key, xhashidx * idx_ret,
+                   bool vals)
+{
+    if (is_swiss(xhash)) {
+        if (swiss_find(xhash, key, swiss_hash(xhash, key), idx_ret) < 0) {
+            return -XHASH_EEXIST;
+        }
+        return 0;
+    }
+    return xhash_lookup_hash__(xhash, key, xhash_hash(xhash->type, key),
+                               idx_ret, vals);
+}
+
 int xhash_lookup(struct xhash *xhash, xhashidx key, xhashidx * val)
 {
     xhashidx idx;
+    xhash_t *old;
     int ret = xhash_lookup__(xhash, key, &idx, true);
+    if (ret && (old = draining(xhash))) {
+        xhash = old;
+        ret = xhash_lookup__(xhash, key, &idx, true);
+    }
     if (ret == 0) {
         xhashidx *values = xhash_vals(xhash);
         *val = values[idx];
@@ -595,6 +1277,51 @@ int xhash_lookup(struct xhash *xhash, xhashidx key, xhashidx * val)
     return ret;
 }
 
+xhashidx xhash_hash(enum xhash_type type, xhashidx key)
+{
+    if (type == XHASH_INTEGER) {
+        return hash_int(key);
+    }
+    return hash_string(key);
+}
+
+int xhash_lookup_hash(xhash_t * xhash, xhashidx key, xhashidx hash,
+                      xhashidx * val)
+{
+    xhashidx idx;
+    xhash_t *old;
+    int ret = xhash_lookup_hash__(xhash, key, hash, &idx, true);
+    if (ret && (old = draining(xhash))) {
+        xhash = old;
+        ret = xhash_lookup_hash__(xhash, key, hash, &idx, true);
+    }
+    if (ret == 0) {
+        xhashidx *values = xhash_vals(xhash);
+        *val = values[idx];
+    }
+    return ret;
+}
+
+/*
+ * Prefetch the slots that a lookup of a key with this hash probes first, so
+ * that the lookups of a batch of keys can overlap their cache misses.
+ */
+void xhash_prefetch(xhash_t * xhash, xhashidx hash)
+{
+    xhashidx idx;
+
+    if (is_swiss(xhash)) {
+        idx = (swiss_hv(xhash, hash) >> 7) & (swiss_groups(xhash) - 1);
+        idx <<= SWISS_GROUP_SHIFT;
+        __builtin_prefetch(xhash_ctrl(xhash) + idx);
+        __builtin_prefetch(xhash_hashes(xhash) + idx);
+    } else {
+        idx = hash & (((xhashidx) 1 << xhash->size_shift) - 1);
+    }
+    __builtin_prefetch(xhash_kvs(xhash) + idx);
+    __builtin_prefetch(xhash_vals(xhash) + idx);
+}
+
 //FIXME iteration broken
 void xhash_iter_init(xhash_t * xhash, xhash_iter_t * pi)
 {
@@ -626,16 +1353,44 @@ xhash_iterate__(xhash_t * xhash, bool vals,
     }
 }
 
+/* the slots of a drained table follow the slots of xhash */
 int xhash_iterate(xhash_t * xhash, xhash_iter_t * pi, xhashidx * key,
                   xhashidx * val)
 {
-    xhashidx idx;
-    int ret = xhash_iterate__(xhash, true, pi, key, &idx);
-    if (ret) {
-        xhashidx *vals = xhash_vals(xhash);
-        *val = vals[idx];
+    xhash_t *t, *old = xhash_old(xhash);
+    xhashidx idx, size = xhash_size(xhash);
+
+    if (!old) {
+        int ret = xhash_iterate__(xhash, true, pi, key, &idx);
+        if (ret) {
+            xhashidx *vals = xhash_vals(xhash);
+            *val = vals[idx];
+        }
+        return ret;
+    }
+
+    INCSTAT(xhash->lookups);
+    for (;;) {
+        if (xhash_elements(xhash) == pi->cnt) {
+            return 0;
+        }
+        t = xhash;
+        idx = pi->loc;
+        if (idx >= size) {
+            t = old;
+            idx -= size;
+            if (idx >= xhash_size(old)) {
+                return 0;
+            }
+        }
+        pi->loc++;
+        if (item_valid(t, idx, true)) {
+            *key = xhash_kvs(t)[idx];
+            *val = xhash_vals(t)[idx];
+            pi->cnt++;
+            return 1;
+        }
     }
-    return ret;
 }
 
 void xhash_print(xhash_t * xhash)
@@ -18,6 +18,41 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xobj.h>
 #include <xseg/xhash.h>
 #include <xseg/xtypes.h>
+#include <stdlib.h>
+
+/* free objects that must be put since the last trim, before an automatic
+ * trim is considered again. Matches the minimum allocation of xobj_get_obj.
+ */
+#define XOBJ_TRIM_INTERVAL 64
+
+struct xobj_chunk {
+    unsigned long start;
+    unsigned long end;
+    uint64_t nr_objs;
+    uint64_t nr_free;
+    int released;
+};
+
+/* replaces the allocated chunks table with one of the given sizeshift.
+ * obj_h->lock must be held.
+ */
+static xhash_t *__resize_allocated(struct xobject_h *obj_h, xhashidx sizeshift)
+{
+    void *container = XPTR(&obj_h->container);
+    struct xheap *heap = XPTR_TAKE(obj_h->heap, container);
+    xhash_t *allocated = XPTR_TAKE(obj_h->allocated, container);
+    xhash_t *new;
+
+    new = xheap_allocate(heap, xhash_get_alloc_size_flags(sizeshift,
+                                                          allocated->flags));
+    if (!new) {
+        return NULL;
+    }
+    xhash_resize(allocated, sizeshift, 0, new);
+    xheap_free(allocated);
+    obj_h->allocated = XPTR_MAKE(new, container);
+    return new;
+}
 
 int xobj_handler_init(struct xobject_h *obj_h, void *container,
                       uint32_t magic, uint64_t size, struct xheap *heap)
@@ -34,7 +69,8 @@ int xobj_handler_init(struct xobject_h *obj_h, void *container,
 
     //TODO convert this to xset
     /* request space of an xhash of sizeshift 3 */
-    xhash = (xhash_t *) xheap_allocate(heap, xhash_get_alloc_size(3));
+    xhash = (xhash_t *) xheap_allocate(heap, xhash_get_alloc_size_flags(3,
+                                                            XHASH_SWISS));
     if (!xhash) {
         return -1;
     }
@@ -44,13 +80,15 @@ int xobj_handler_init(struct xobject_h *obj_h, void *container,
      */
     //bytes = xheap_get_chunk_size(xhash);
 
-    xhash_init(xhash, 3, 0, XHASH_INTEGER);
+    xhash_init_flags(xhash, 3, 0, XHASH_INTEGER, XHASH_SWISS);
     obj_h->allocated = XPTR_MAKE(xhash, container);
     obj_h->list = 0;
     obj_h->flags = 0;
     obj_h->nr_free = 0;
     obj_h->nr_allocated = 0;
     obj_h->allocated_space = 0;
+    obj_h->trim_ratio = 0;
+    obj_h->trim_mark = 0;
     obj_h->heap = XPTR_MAKE(heap, container);
     XPTRSET(&obj_h->container, container);
     xlock_release(&obj_h->lock);
@@ -76,7 +114,7 @@ int xobj_alloc_obj(struct xobject_h *obj_h, uint64_t nr)
 
     bytes = xheap_get_chunk_size(mem);
     used = 0;
-    while (used + obj_h->obj_size < bytes) {
+    while (used + obj_h->obj_size <= bytes) {
         objptr = XPTR_MAKE(((unsigned long) mem) + used, container);
         obj = XPTR_TAKE(objptr, container);
         used += obj_h->obj_size;
@@ -95,20 +133,11 @@ int xobj_alloc_obj(struct xobject_h *obj_h, uint64_t nr)
      */
     ptr = XPTR_MAKE(mem, container);
     r = xhash_insert(allocated, ptr, ptr);
-    //ugly
     if (r == -XHASH_ERESIZE) {
-        xhashidx sizeshift = xhash_grow_size_shift(allocated);
-        uint64_t size;
-        xhash_t *new;
-        size = xhash_get_alloc_size(sizeshift);
-        new = xheap_allocate(heap, size);
-        if (!new) {
+        allocated = __resize_allocated(obj_h, xhash_grow_size_shift(allocated));
+        if (!allocated) {
             goto err;
         }
-        xhash_resize(allocated, sizeshift, 0, new);
-        xheap_free(allocated);
-        allocated = new;
-        obj_h->allocated = XPTR_MAKE(allocated, container);
         r = xhash_insert(allocated, ptr, ptr);
     }
     if (r < 0) {
@@ -141,6 +170,18 @@ void xobj_put_obj(struct xobject_h *obj_h, void *ptr)
     obj->next = list;
     obj_h->list = objptr;
     obj_h->nr_free++;
+    if (obj_h->trim_ratio && obj_h->nr_free >= obj_h->trim_mark &&
+        obj_h->nr_free * 100 >= obj_h->nr_allocated * obj_h->trim_ratio) {
+        /* back off geometrically when nothing could be released, to
+         * bound the cost of trimming a fragmented handler
+         */
+        if (__xobj_trim(obj_h) > 0) {
+            obj_h->trim_mark = obj_h->nr_free + XOBJ_TRIM_INTERVAL;
+        } else {
+            obj_h->trim_mark = obj_h->nr_free + obj_h->nr_free / 2 +
+                XOBJ_TRIM_INTERVAL;
+        }
+    }
     xlock_release(&obj_h->lock);
 }
 
@@ -179,6 +220,197 @@ void *xobj_get_obj(struct xobject_h *obj_h, uint32_t flags)
     return obj;
 }
 
+static int __chunk_cmp(const void *a, const void *b)
+{
+    const struct xobj_chunk *c1 = a, *c2 = b;
+
+    if (c1->start < c2->start) {
+        return -1;
+    }
+    return (c1->start > c2->start);
+}
+
+static struct xobj_chunk *__find_chunk(struct xobj_chunk *chunks,
+                                       uint64_t nr_chunks, unsigned long addr)
+{
+    uint64_t lo = 0, hi = nr_chunks, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr < chunks[mid].start) {
+            hi = mid;
+        } else if (addr >= chunks[mid].end) {
+            lo = mid + 1;
+        } else {
+            return &chunks[mid];
+        }
+    }
+    return NULL;
+}
+
+/* shrinks the allocated chunks table after chunks have been released.
+ * Failing to allocate a smaller table is not an error, the old one is kept.
+ */
+static void __shrink_allocated(struct xobject_h *obj_h)
+{
+    void *container = XPTR(&obj_h->container);
+    xhash_t *allocated = XPTR_TAKE(obj_h->allocated, container);
+    xhashidx sizeshift = allocated->size_shift;
+
+    while (sizeshift > allocated->minsize_shift &&
+           4 * xhash_elements(allocated) < ((xhashidx) 1 << sizeshift)) {
+        sizeshift--;
+    }
+    if (sizeshift != allocated->size_shift) {
+        __resize_allocated(obj_h, sizeshift);
+    }
+}
+
+/*
+ * __xobj_trim must be called with obj_h->lock held.
+ *
+ * A chunk can be released only when every object carved out of it is on the
+ * free list. Free objects are counted per chunk, fully free chunks are
+ * removed from the allocated table, their objects are unlinked from the free
+ * list and their memory is handed back to the heap. The allocated table is
+ * shrunk last, so that trimming works even on an exhausted heap.
+ */
+int __xobj_trim(struct xobject_h *obj_h)
+{
+    void *container = XPTR(&obj_h->container);
+    xhash_t *allocated = XPTR_TAKE(obj_h->allocated, container);
+    struct xobj_chunk *chunks, *c;
+    struct xobject *obj;
+    xhash_iter_t it;
+    xhashidx key, val;
+    uint64_t i, nr_chunks;
+    xptr node, *prev;
+    void *mem;
+    int nr_released = 0;
+
+    nr_chunks = xhash_elements(allocated);
+    if (!nr_chunks || !obj_h->nr_free) {
+        return 0;
+    }
+
+    chunks = xtypes_malloc(sizeof(struct xobj_chunk) * nr_chunks);
+    if (!chunks) {
+        return -1;
+    }
+
+    i = 0;
+    xhash_iter_init(allocated, &it);
+    while (i < nr_chunks && xhash_iterate(allocated, &it, &key, &val)) {
+        mem = XPTR_TAKE(key, container);
+        c = &chunks[i++];
+        c->start = (unsigned long) mem;
+        c->nr_objs = xheap_get_chunk_size(mem) / obj_h->obj_size;
+        c->end = c->start + c->nr_objs * obj_h->obj_size;
+        c->nr_free = 0;
+        c->released = 0;
+    }
+    nr_chunks = i;
+    qsort(chunks, nr_chunks, sizeof(struct xobj_chunk), __chunk_cmp);
+
+    for (node = obj_h->list; node; node = obj->next) {
+        obj = XPTR_TAKE(node, container);
+        c = __find_chunk(chunks, nr_chunks, (unsigned long) obj);
+        if (c) {
+            c->nr_free++;
+        }
+    }
+
+    for (i = 0; i < nr_chunks; i++) {
+        c = &chunks[i];
+        if (!c->nr_objs || c->nr_free != c->nr_objs) {
+            continue;
+        }
+        if (xhash_delete_noshrink(allocated,
+                                  XPTR_MAKE(c->start, container)) < 0) {
+            XSEGLOG("Could not remove chunk %lx from allocated table",
+                    c->start);
+            continue;
+        }
+        c->released = 1;
+        nr_released++;
+    }
+
+    if (!nr_released) {
+        goto out;
+    }
+
+    prev = &obj_h->list;
+    for (node = obj_h->list; node; node = obj->next) {
+        obj = XPTR_TAKE(node, container);
+        c = __find_chunk(chunks, nr_chunks, (unsigned long) obj);
+        if (c && c->released) {
+            *prev = obj->next;
+        } else {
+            prev = &obj->next;
+        }
+    }
+
+    for (i = 0; i < nr_chunks; i++) {
+        c = &chunks[i];
+        if (!c->released) {
+            continue;
+        }
+        mem = (void *) c->start;
+        obj_h->allocated_space -= xheap_get_chunk_size(mem);
+        obj_h->nr_free -= c->nr_objs;
+        obj_h->nr_allocated -= c->nr_objs;
+        xheap_free(mem);
+    }
+    __shrink_allocated(obj_h);
+
+  out:
+    xtypes_free(chunks);
+    return nr_released;
+}
+
+int xobj_trim(struct xobject_h *obj_h)
+{
+    int r;
+    xlock_acquire(&obj_h->lock);
+    r = __xobj_trim(obj_h);
+    obj_h->trim_mark = obj_h->nr_free + XOBJ_TRIM_INTERVAL;
+    xlock_release(&obj_h->lock);
+    return r;
+}
+
+void xobj_set_trim_ratio(struct xobject_h *obj_h, uint64_t ratio)
+{
+    xlock_acquire(&obj_h->lock);
+    obj_h->trim_ratio = ratio;
+    obj_h->trim_mark = 0;
+    xlock_release(&obj_h->lock);
+}
+
+/* Releases all chunks of the handler, along with its allocated table.
+ * All objects must have been put back, or at least must not be used again.
+ */
+void xobj_handler_destroy(struct xobject_h *obj_h)
+{
+    void *container = XPTR(&obj_h->container);
+    xhash_t *allocated;
+    xhash_iter_t it;
+    xhashidx key, val;
+
+    xlock_acquire(&obj_h->lock);
+    allocated = XPTR_TAKE(obj_h->allocated, container);
+    xhash_iter_init(allocated, &it);
+    while (xhash_iterate(allocated, &it, &key, &val)) {
+        xheap_free(XPTR_TAKE(key, container));
+    }
+    xheap_free(allocated);
+    obj_h->allocated = 0;
+    obj_h->list = 0;
+    obj_h->nr_free = 0;
+    obj_h->nr_allocated = 0;
+    obj_h->allocated_space = 0;
+    xlock_release(&obj_h->lock);
+}
+
 /* lock must be held, while using iteration on object handler
  * or we risk hash resize and invalid memory access
  */
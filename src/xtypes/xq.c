@@ -446,10 +446,11 @@ xqindex __xq_resize(struct xq * xq, struct xq * newxq)
 
     mask = xq->size - 1;
     mask_new = newxq->size - 1;
-    head = __xq_peek_head_idx(xq, nr);
+    /* copy from the head down, so that the order of the queue is kept */
+    head = __xq_peek_head_idx(xq, 1);
     tail = __xq_append_tail_idx(newxq, nr) + nr - 1;
     for (i = 0; i < nr; i++) {
-        val = XPTR(&xq->queue)[(head + i) & mask];
+        val = XPTR(&xq->queue)[(head - i) & mask];
         XPTR(&newxq->queue)[(tail - i) & mask_new] = val;
     }
 
@@ -0,0 +1,284 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xseg/xradixheap.h>
+
+#define FREE_BUCKET (uint32_t)(-1)
+#define MIN_CAPACITY 16
+
+/* keys below the last extracted one are kept as equal to it */
+static inline uint32_t bucket_of(struct xradixheap *h, xradixheapidx key)
+{
+    if (key == h->last) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(key ^ h->last);
+}
+
+/* make room for n more entries in bucket b */
+static int reserve(struct xradixheap *h, uint32_t b, xradixheapidx n)
+{
+    struct xradixheap_bucket *bk = &h->buckets[b];
+    struct xradixheap_entry *entries;
+    xradixheapidx capacity = bk->capacity ? bk->capacity : MIN_CAPACITY;
+
+    if (bk->count + n <= bk->capacity) {
+        return 0;
+    }
+    while (capacity < bk->count + n) {
+        capacity *= 2;
+    }
+    entries = xtypes_realloc(bk->entries,
+                             capacity * sizeof(struct xradixheap_entry));
+    if (!entries) {
+        return -1;
+    }
+    bk->entries = entries;
+    bk->capacity = capacity;
+    return 0;
+}
+
+/* bucket b must have room for the node */
+static void link_node(struct xradixheap *h, xradixheapidx i,
+                      xradixheapidx key, uint32_t b)
+{
+    struct xradixheap_bucket *bk = &h->buckets[b];
+
+    bk->entries[bk->count].key = key;
+    bk->entries[bk->count].node = i;
+    h->nodes[i].bucket = b;
+    h->nodes[i].pos = bk->count++;
+    if (b) {
+        h->bitmap |= 1ULL << (b - 1);
+    }
+}
+
+static void unlink_node(struct xradixheap *h, xradixheapidx i)
+{
+    struct xradixheap_node *n = &h->nodes[i];
+    struct xradixheap_bucket *bk = &h->buckets[n->bucket];
+    struct xradixheap_entry *last = &bk->entries[--bk->count];
+
+    if (n->pos != bk->count) {
+        bk->entries[n->pos] = *last;
+        h->nodes[last->node].pos = n->pos;
+    }
+    if (n->bucket && !bk->count) {
+        h->bitmap &= ~(1ULL << (n->bucket - 1));
+    }
+}
+
+static void free_node(struct xradixheap *h, xradixheapidx i)
+{
+    h->nodes[i].bucket = FREE_BUCKET;
+    h->nodes[i].pos = h->free;
+    h->free = i;
+    h->count--;
+}
+
+static int valid_node(struct xradixheap *h, xradixheap_handler idx)
+{
+    return idx < h->size && h->nodes[idx].bucket != FREE_BUCKET;
+}
+
+/*
+ * Make the minimum key the last extracted one, so that bucket 0 holds the
+ * nodes to extract next. The first non empty bucket holds the minimum, and
+ * since all of its keys share the bits above the one it stands for, they all
+ * fall to lower buckets against the new minimum.
+ */
+static int settle(struct xradixheap *h)
+{
+    xradixheapidx i, min = NoNode, count[XRADIXHEAP_BUCKETS] = { 0 };
+    struct xradixheap_bucket *bk;
+    struct xradixheap_entry *e;
+    uint32_t b, t;
+
+    if (h->buckets[0].count || !h->bitmap) {
+        return 0;
+    }
+    b = __builtin_ctzll(h->bitmap) + 1;
+    bk = &h->buckets[b];
+    for (i = 0; i < bk->count; i++) {
+        if (bk->entries[i].key < min) {
+            min = bk->entries[i].key;
+        }
+    }
+    h->last = min;
+
+    for (i = 0; i < bk->count; i++) {
+        count[bucket_of(h, bk->entries[i].key)]++;
+    }
+    for (t = 0; t < b; t++) {
+        if (count[t] && reserve(h, t, count[t]) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < bk->count; i++) {
+        e = &bk->entries[i];
+        link_node(h, e->node, e->key, bucket_of(h, e->key));
+    }
+    bk->count = 0;
+    h->bitmap &= ~(1ULL << (b - 1));
+    return 0;
+}
+
+xradixheap_handler xradixheap_insert(struct xradixheap *h, xradixheapidx key,
+                                     xradixheapidx value)
+{
+    xradixheapidx i = h->free;
+    uint32_t b;
+
+    if (i == NoNode) {
+        return NoNode;
+    }
+    if (key < h->last) {
+        key = h->last;
+    }
+    b = bucket_of(h, key);
+    if (reserve(h, b, 1) < 0) {
+        return NoNode;
+    }
+    h->free = h->nodes[i].pos;
+    h->nodes[i].value = value;
+    link_node(h, i, key, b);
+    h->count++;
+    return i;
+}
+
+int xradixheap_empty(struct xradixheap *h)
+{
+    return (h->count == 0);
+}
+
+/* peek min */
+xradixheapidx xradixheap_peak(struct xradixheap * h)
+{
+    if (xradixheap_empty(h) || settle(h) < 0) {
+        return NoNode;
+    }
+    return h->nodes[h->buckets[0].entries[0].node].value;
+}
+
+/* extract min */
+xradixheapidx xradixheap_extract(struct xradixheap * h)
+{
+    xradixheapidx i;
+
+    if (xradixheap_empty(h) || settle(h) < 0) {
+        return NoNode;
+    }
+    i = h->buckets[0].entries[0].node;
+    unlink_node(h, i);
+    free_node(h, i);
+    return h->nodes[i].value;
+}
+
+static int change_key(struct xradixheap *h, xradixheap_handler idx,
+                      xradixheapidx newkey)
+{
+    uint32_t b;
+
+    if (!valid_node(h, idx)) {
+        return -1;
+    }
+    if (newkey < h->last) {
+        newkey = h->last;
+    }
+    b = bucket_of(h, newkey);
+    if (reserve(h, b, 1) < 0) {
+        return -1;
+    }
+    unlink_node(h, idx);
+    link_node(h, idx, newkey, b);
+    return 0;
+}
+
+int xradixheap_increasekey(struct xradixheap *h, xradixheap_handler idx,
+                           xradixheapidx newkey)
+{
+    return change_key(h, idx, newkey);
+}
+
+/* the new key is raised to the last extracted one, if it is below it */
+int xradixheap_decreasekey(struct xradixheap *h, xradixheap_handler idx,
+                           xradixheapidx newkey)
+{
+    return change_key(h, idx, newkey);
+}
+
+int xradixheap_remove(struct xradixheap *h, xradixheap_handler idx)
+{
+    if (!valid_node(h, idx)) {
+        return -1;
+    }
+    unlink_node(h, idx);
+    free_node(h, idx);
+    return 0;
+}
+
+xradixheapidx xradixheap_getkey(struct xradixheap * h, xradixheap_handler idx)
+{
+    struct xradixheap_node *n;
+
+    if (!valid_node(h, idx)) {
+        return NoNode;
+    }
+    n = &h->nodes[idx];
+    return h->buckets[n->bucket].entries[n->pos].key;
+}
+
+int xradixheap_init(struct xradixheap *h, xradixheapidx size, void *mem)
+{
+    xradixheapidx i;
+
+    h->alloc = NULL;
+    if (!mem) {
+        h->alloc = xtypes_malloc(sizeof(struct xradixheap_node) * size);
+        if (!h->alloc) {
+            return -1;
+        }
+    }
+    h->nodes = mem ? mem : h->alloc;
+    for (i = 0; i < XRADIXHEAP_BUCKETS; i++) {
+        h->buckets[i].entries = NULL;
+        h->buckets[i].count = 0;
+        h->buckets[i].capacity = 0;
+    }
+    h->free = NoNode;
+    for (i = size; i > 0; i--) {
+        h->nodes[i - 1].bucket = FREE_BUCKET;
+        h->nodes[i - 1].pos = h->free;
+        h->free = i - 1;
+    }
+    h->size = size;
+    h->count = 0;
+    h->last = 0;
+    h->bitmap = 0;
+    return 0;
+}
+
+void xradixheap_free(struct xradixheap *h)
+{
+    uint32_t i;
+
+    for (i = 0; i < XRADIXHEAP_BUCKETS; i++) {
+        xtypes_free(h->buckets[i].entries);
+    }
+    xtypes_free(h->alloc);
+    h->alloc = NULL;
+}
@@ -15,6 +15,11 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <xseg/xtypes.h>
 #include <xseg/xwaitq.h>
 
@@ -29,6 +34,8 @@ int xwaitq_init(struct xwaitq *wq, int (*cond_fn) (void *arg), void *arg,
     wq->cond_fn = cond_fn;
     wq->cond_arg = arg;
     wq->flags = flags;
+    wq->seq = 0;
+    wq->sleepers = 0;
     wq->q = xtypes_malloc(sizeof(struct xq));
     if (!wq->q) {
         return -1;
@@ -89,21 +96,39 @@ int xwaitq_enqueue(struct xwaitq *wq, struct work *w)
     return r;
 }
 
+/* wake up to nr threads blocked in xwaitq_wait */
+static void __wake(struct xwaitq *wq, int nr)
+{
+    /* order the change of the condition before the check for sleepers */
+    MFENCE();
+    if (!wq->sleepers) {
+        return;
+    }
+    __sync_fetch_and_add(&wq->seq, 1);
+    syscall(SYS_futex, &wq->seq, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
+static int __lock(struct xwaitq *wq)
+{
+    if (wq->flags & XWAIT_SIGNAL_ONE) {
+        return xlock_try_lock(&wq->lock);
+    }
+    xlock_acquire(&wq->lock);
+    return 1;
+}
+
 void xwaitq_signal(struct xwaitq *wq)
 {
     xqindex xqi;
     struct work *w;
 
+    __wake(wq, INT_MAX);
     if (!xq_count(wq->q)) {
         return;
     }
 
-    if (wq->flags & XWAIT_SIGNAL_ONE) {
-        if (!xlock_try_lock(&wq->lock)) {
-            return;
-        }
-    } else {
-        xlock_acquire(&wq->lock);
+    if (!__lock(wq)) {
+        return;
     }
     while (xq_count(wq->q) && __check_cond(wq)) {
         xqi = __xq_pop_head(wq->q);
@@ -113,13 +138,109 @@ void xwaitq_signal(struct xwaitq *wq)
         xlock_release(&wq->lock);
         w = (struct work *) xqi;
         w->job_fn(wq, w->job);
-        if (wq->flags & XWAIT_SIGNAL_ONE) {
-            if (!xlock_try_lock(&wq->lock)) {
-                return;
-            }
-        } else {
-            xlock_acquire(&wq->lock);
+        if (!__lock(wq)) {
+            return;
         }
     }
     xlock_release(&wq->lock);
 }
+
+/*
+ * Run up to n works of the xwaitq, and wake up to n blocked threads, for a
+ * caller that made the condition true for n waiters, e.g. by freeing n
+ * resources. The condition is checked once per batch of XWAITQ_BATCH works,
+ * which are popped in one hold of the lock. Returns the number of works run.
+ */
+uint32_t xwaitq_signal_n(struct xwaitq *wq, uint32_t n)
+{
+    struct work *batch[XWAITQ_BATCH];
+    uint32_t i, nr, done = 0;
+    xqindex xqi;
+
+    __wake(wq, n > INT_MAX ? INT_MAX : n);
+    while (done < n && xq_count(wq->q)) {
+        if (!__lock(wq)) {
+            break;
+        }
+        nr = 0;
+        if (__check_cond(wq)) {
+            while (nr < XWAITQ_BATCH && done + nr < n) {
+                xqi = __xq_pop_head(wq->q);
+                if (xqi == Noneidx) {
+                    break;
+                }
+                batch[nr++] = (struct work *) xqi;
+            }
+        }
+        xlock_release(&wq->lock);
+        if (!nr) {
+            break;
+        }
+        for (i = 0; i < nr; i++) {
+            batch[i]->job_fn(wq, batch[i]->job);
+        }
+        done += nr;
+    }
+    return done;
+}
+
+static uint64_t __now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Block until cond_fn(arg) holds, or usec_timeout microseconds pass, checking
+ * the condition each time the xwaitq is signaled. Returns 0 if the condition
+ * holds, -1 on timeout.
+ */
+int xwaitq_wait_cond(struct xwaitq *wq, int (*cond_fn) (void *arg), void *arg,
+                     uint32_t usec_timeout)
+{
+    struct timespec ts, *tsp = NULL;
+    uint64_t deadline = 0, now;
+    uint32_t seq;
+    int r = 0;
+
+    if (cond_fn(arg)) {
+        return 0;
+    }
+    if (usec_timeout != XWAIT_FOREVER) {
+        deadline = __now_usec() + usec_timeout;
+        tsp = &ts;
+    }
+
+    /*
+     * Read seq before announcing ourselves and checking the condition again,
+     * so that a signal in between makes the futex wait return at once.
+     */
+    for (;;) {
+        seq = wq->seq;
+        __sync_fetch_and_add(&wq->sleepers, 1);
+        if (cond_fn(arg)) {
+            break;
+        }
+        if (tsp) {
+            now = __now_usec();
+            if (now >= deadline) {
+                r = -1;
+                break;
+            }
+            ts.tv_sec = (deadline - now) / 1000000;
+            ts.tv_nsec = ((deadline - now) % 1000000) * 1000;
+        }
+        syscall(SYS_futex, &wq->seq, FUTEX_WAIT_PRIVATE, seq, tsp, NULL, 0);
+        __sync_fetch_and_sub(&wq->sleepers, 1);
+    }
+    __sync_fetch_and_sub(&wq->sleepers, 1);
+    return r;
+}
+
+/* block until the condition of the xwaitq holds, as xwaitq_wait_cond */
+int xwaitq_wait(struct xwaitq *wq, uint32_t usec_timeout)
+{
+    return xwaitq_wait_cond(wq, wq->cond_fn, wq->cond_arg, usec_timeout);
+}
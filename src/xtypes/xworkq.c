@@ -19,102 +19,171 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xworkq.h>
 
 
-int xworkq_init(struct xworkq *wq, struct xlock *lock, uint32_t flags)
+/* called with q_lock held */
+static int __grow_pool(struct xworkq *wq)
 {
-    wq->lock = lock;
-    wq->flags = flags;
-    xlock_release(&wq->q_lock);
-    wq->q = xtypes_malloc(sizeof(struct xq));
-    if (!wq->q) {
+    struct xworkq_chunk *chunk;
+    int i;
+
+    chunk = xtypes_malloc(sizeof(struct xworkq_chunk));
+    if (!chunk) {
         return -1;
     }
-    if (!xq_alloc_empty(wq->q, 8)) {
-        xtypes_free(wq->q);
-        return -1;
+    for (i = 0; i < XWORKQ_POOL_CHUNK; i++) {
+        chunk->works[i].flags = XWORK_POOLED;
+        chunk->works[i].next = wq->free;
+        wq->free = &chunk->works[i];
     }
+    chunk->next = wq->chunks;
+    wq->chunks = chunk;
     return 0;
 }
 
+int xworkq_init(struct xworkq *wq, struct xlock *lock, uint32_t flags)
+{
+    wq->lock = lock;
+    wq->flags = flags;
+    xlock_release(&wq->q_lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+    wq->free = NULL;
+    wq->chunks = NULL;
+    wq->sched = 0;
+    return __grow_pool(wq);
+}
+
 void xworkq_destroy(struct xworkq *wq)
 {
+    struct xworkq_chunk *chunk;
+
     //what about pending works ?
-    xq_free(wq->q);
-    xtypes_free(wq->q);
+    while (wq->chunks) {
+        chunk = wq->chunks;
+        wq->chunks = chunk->next;
+        xtypes_free(chunk);
+    }
+}
+
+/* called with q_lock held */
+static void __xworkq_append(struct xworkq *wq, struct work *w)
+{
+    w->next = NULL;
+    if (wq->tail) {
+        wq->tail->next = w;
+    } else {
+        wq->head = w;
+    }
+    wq->tail = w;
 }
 
-int __xworkq_enqueue(struct xworkq *wq, struct work *w)
+/*
+ * Append a work owned by the caller, with its job and job_fn set, without
+ * running the queue. The work is not touched after its job_fn is called, so
+ * job_fn may free or reuse it.
+ */
+int xworkq_append_work(struct xworkq *wq, struct work *w)
 {
-    //enqueue and resize if necessary
-    xqindex r;
-    struct xq *newq;
+    w->flags = 0;
     xlock_acquire(&wq->q_lock);
-    r = __xq_append_tail(wq->q, (xqindex) w);
-    if (r == Noneidx) {
-        newq = xtypes_malloc(sizeof(struct xq));
-        if (!newq) {
-            r = Noneidx;
-            goto out;
-        }
-        if (!xq_alloc_empty(newq, wq->q->size * 2)) {
-            xtypes_free(newq);
-            r = Noneidx;
-            goto out;
-        }
-        if (__xq_resize(wq->q, newq) == Noneidx) {
-            xq_free(newq);
-            xtypes_free(newq);
-            r = Noneidx;
-            goto out;
-        }
-        xtypes_free(wq->q);
-        wq->q = newq;
-        r = __xq_append_tail(wq->q, (xqindex) w);
+    __xworkq_append(wq, w);
+    xlock_release(&wq->q_lock);
+    return 0;
+}
+
+int xworkq_append(struct xworkq *wq, void (*job_fn) (void *q, void *arg),
+                  void *job)
+{
+    struct work *w;
+
+    xlock_acquire(&wq->q_lock);
+    if (!wq->free && __grow_pool(wq) < 0) {
+        xlock_release(&wq->q_lock);
+        return -1;
     }
-  out:
+    w = wq->free;
+    wq->free = w->next;
+    w->job_fn = job_fn;
+    w->job = job;
+    __xworkq_append(wq, w);
     xlock_release(&wq->q_lock);
+    return 0;
+}
 
-    return ((r == Noneidx) ? -1 : 0);
+int xworkq_enqueue_work(struct xworkq *wq, struct work *w)
+{
+    xworkq_append_work(wq, w);
+    xworkq_signal(wq);
+    return 0;
 }
 
 int xworkq_enqueue(struct xworkq *wq, void (*job_fn) (void *q, void *arg),
                    void *job)
 {
-    //maybe use xobj
-    struct work *work = xtypes_malloc(sizeof(struct work));
-    if (!work) {
-        return -1;
-    }
-    work->job_fn = job_fn;
-    work->job = job;
-    if (__xworkq_enqueue(wq, work) < 0) {
+    if (xworkq_append(wq, job_fn, job) < 0) {
         return -1;
     }
+    xworkq_signal(wq);
     return 0;
 }
 
+int xworkq_pending(struct xworkq *wq)
+{
+    return *(struct work * volatile *) &wq->head != NULL;
+}
+
+/*
+ * Run the pending works, in order, unless another thread holds wq->lock and
+ * is already running them. All pending works are taken off the queue in one
+ * hold of q_lock, and the pooled ones among them go back to the pool in one
+ * more, after the whole batch has run.
+ */
 void xworkq_signal(struct xworkq *wq)
 {
-    xqindex xqi;
-    struct work *w;
-    while (xq_count(wq->q)) {
+    struct work *w, *next, *done, *done_tail;
+    uint32_t pooled;
+
+    while (xworkq_pending(wq)) {
         if (wq->lock && !xlock_try_lock(wq->lock)) {
             return;
         }
 
         xlock_acquire(&wq->q_lock);
-        xqi = __xq_pop_head(wq->q);
+        w = wq->head;
+        wq->head = NULL;
+        wq->tail = NULL;
         xlock_release(&wq->q_lock);
 
-        while (xqi != Noneidx) {
-            w = (struct work *) xqi;
+        done = NULL;
+        done_tail = NULL;
+        for (; w; w = next) {
+            /* a work of the caller may be gone once its job_fn returns */
+            next = w->next;
+            pooled = w->flags & XWORK_POOLED;
             w->job_fn(wq, w->job);
-            xtypes_free(w);
+            if (!pooled) {
+                continue;
+            }
+            w->next = done;
+            done = w;
+            if (!done_tail) {
+                done_tail = w;
+            }
+        }
+
+        if (done) {
             xlock_acquire(&wq->q_lock);
-            xqi = __xq_pop_head(wq->q);
+            done_tail->next = wq->free;
+            wq->free = done;
             xlock_release(&wq->q_lock);
         }
+
         if (wq->lock) {
             xlock_release(wq->lock);
+            /*
+             * An enqueuer that failed to take wq->lock relies on us to
+             * see its work.
+             */
+            MFENCE();
         }
     }
 
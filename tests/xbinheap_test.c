@@ -21,13 +21,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <xseg/xbinheap.h>
 
 xbinheap_handler *handlers;
+uint32_t arity = 0;
+
 int test1(unsigned long n)
 {
 	struct xbinheap h;
 	xbinheapidx i, r;
 	long j;
 	handlers = malloc(sizeof(xbinheap_handler) * n);
-	xbinheap_init(&h, n, XBINHEAP_MAX, NULL);
+	xbinheap_init(&h, n, XBINHEAP_MAX | arity, NULL);
 	for (i = 0; i < n; i++) {
 		handlers[i] = xbinheap_insert(&h, i, i);
 		if (handlers[i] == NoNode){
@@ -78,8 +80,58 @@ int test1(unsigned long n)
 		return -1;
 	}
 
+	xbinheap_free(&h);
+	free(handlers);
+	return 0;
+}
 
+/*
+ * Build a min heap of n random keys, change the key of every other node and
+ * check that the nodes are extracted in order.
+ */
+int test2(unsigned long n)
+{
+	struct xbinheap h;
+	xbinheapidx i, r, prev, *keys, *values;
 
+	keys = malloc(sizeof(xbinheapidx) * n);
+	values = malloc(sizeof(xbinheapidx) * n);
+	handlers = malloc(sizeof(xbinheap_handler) * n);
+	xbinheap_init(&h, n, XBINHEAP_MIN | arity, NULL);
+	srand(n);
+	for (i = 0; i < n; i++) {
+		keys[i] = rand() % (4 * n);
+		values[i] = i;
+	}
+	if (xbinheap_build(&h, keys, values, n, handlers) < 0){
+		fprintf(stderr, "Error building heap of %lu nodes\n", n);
+		return -1;
+	}
+	for (i = 0; i < n; i += 2) {
+		keys[i] = rand() % (4 * n);
+		if (keys[i] > xbinheap_getkey(&h, handlers[i]))
+			xbinheap_increasekey(&h, handlers[i], keys[i]);
+		else
+			xbinheap_decreasekey(&h, handlers[i], keys[i]);
+	}
+	prev = 0;
+	for (i = 0; i < n; i++) {
+		r = xbinheap_extract(&h);
+		if (r == NoNode || keys[r] < prev){
+			fprintf(stderr, "Extracted %llu out of order\n", r);
+			return -1;
+		}
+		prev = keys[r];
+	}
+	if (xbinheap_extract(&h) != NoNode){
+		fprintf(stderr, "Extracted from empty heap\n");
+		return -1;
+	}
+
+	xbinheap_free(&h);
+	free(keys);
+	free(values);
+	free(handlers);
 	return 0;
 }
 
@@ -89,16 +141,30 @@ int main(int argc, const char *argv[])
 	int r;
 	int n = atoi(argv[1]);
 
-	fprintf(stderr, "Running test1\n");
-	gettimeofday(&start, NULL);
-	r = test1(n);
-	if (r < 0){
-		fprintf(stderr, "Test1: FAILED\n");
-		return -1;
+	for (arity = 0; arity <= XBINHEAP_4ARY; arity += XBINHEAP_4ARY) {
+		fprintf(stderr, "Running test1 (%s)\n", arity ? "4-ary" : "binary");
+		gettimeofday(&start, NULL);
+		r = test1(n);
+		if (r < 0){
+			fprintf(stderr, "Test1: FAILED\n");
+			return -1;
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &tv);
+		fprintf(stderr, "Test1: PASSED\n");
+		fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+		fprintf(stderr, "Running test2 (%s)\n", arity ? "4-ary" : "binary");
+		gettimeofday(&start, NULL);
+		r = test2(n);
+		if (r < 0){
+			fprintf(stderr, "Test2: FAILED\n");
+			return -1;
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &tv);
+		fprintf(stderr, "Test2: PASSED\n");
+		fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 	}
-	gettimeofday(&end, NULL);
-	timersub(&end, &start, &tv);
-	fprintf(stderr, "Test1: PASSED\n");
-	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 	return 0;
 }
@@ -21,6 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <xseg/xlock.h>
 #include <sys/time.h>
+#include <string.h>
+#include <math.h>
 
 
 unsigned long sum_put = 0;
@@ -28,6 +30,7 @@ unsigned long sum_free = 0;
 unsigned long sum = 0;
 struct xlock lock;
 uint32_t lru = 0;
+unsigned long nr_ops = 0;
 unsigned long k, l, m;
 pthread_barrier_t barr;
 
@@ -193,6 +196,14 @@ void *node_init(void *c, void *xh)
 	return malloc(sizeof(struct ce));
 }
 
+/* names of every size class of the names arena, up to the longest one */
+static void test1_name(char *name, unsigned long i)
+{
+	int widths[] = {1, 40, 100, XSEG_MAX_TARGETLEN};
+
+	sprintf(name, "%0*lu", widths[i % 4], i);
+}
+
 int test1(unsigned long n)
 {
 	struct xcache cache;
@@ -207,13 +218,15 @@ int test1(unsigned long n)
 	sum_put = 0;
 	sum_free = 0;
 	char name[XSEG_MAX_TARGETLEN + 1];
+	char **names;
+	xcache_handler *handlers;
 	unsigned long i;
 
 	xcache_init(&cache, n, &c_ops, lru, NULL);
 	n = cache.size;
 
 	for (i = 0; i < n; i++) {
-		sprintf(name, "%lu", i);
+		test1_name(name, i);
 		h = xcache_lookup(&cache, name);
 		if (h != NoEntry){
 			fprintf(stderr, "Cache return cache entry\n");
@@ -236,7 +249,7 @@ int test1(unsigned long n)
 	}
 
 	for (i = 0; i < n; i++) {
-		sprintf(name, "%lu", i);
+		test1_name(name, i);
 		h = xcache_lookup(&cache, name);
 		if (h == NoEntry){
 			fprintf(stderr, "Cache lookup failed for %s\n", name);
@@ -245,8 +258,32 @@ int test1(unsigned long n)
 		xcache_put(&cache, h);
 	}
 
+	/* the same in batches, along with as many names that are not cached */
+	names = malloc(2 * n * sizeof(char *));
+	handlers = malloc(2 * n * sizeof(xcache_handler));
+	for (i = 0; i < 2 * n; i++) {
+		test1_name(name, i);
+		names[i] = strdup(name);
+	}
+	if (xcache_lookup_many(&cache, names, 2 * n, handlers) != n) {
+		fprintf(stderr, "Batched lookup did not find %lu entries\n", n);
+		return -1;
+	}
+	for (i = 0; i < 2 * n; i++) {
+		if ((handlers[i] == NoEntry) != (i >= n)) {
+			fprintf(stderr, "Batched lookup failed for %s\n",
+					names[i]);
+			return -1;
+		}
+		if (handlers[i] != NoEntry)
+			xcache_put(&cache, handlers[i]);
+		free(names[i]);
+	}
+	free(names);
+	free(handlers);
+
 	for (i = n; i < 2*n; i++) {
-		sprintf(name, "%lu", i);
+		test1_name(name, i);
 		h = xcache_lookup(&cache, name);
 		if (h != NoEntry){
 			fprintf(stderr, "Cache return cache entry\n");
@@ -266,6 +303,26 @@ int test1(unsigned long n)
 			xcache_free_new(&cache, h);
 		}
 		xcache_put(&cache, h);
+
+		/*
+		 * entries were last looked up in order, so evicted in order,
+		 * unless admission depends on their frequency
+		 */
+		if (i == n && !(lru & XCACHE_LRU_TINYLFU)) {
+			test1_name(name, 0);
+			h = xcache_lookup(&cache, name);
+			if (h != NoEntry){
+				fprintf(stderr, "LRU entry was not evicted\n");
+				return -1;
+			}
+			test1_name(name, n - 1);
+			h = xcache_lookup(&cache, name);
+			if (h == NoEntry){
+				fprintf(stderr, "MRU entry was evicted\n");
+				return -1;
+			}
+			xcache_put(&cache, h);
+		}
 	}
 	xcache_close(&cache);
 	if (sum_put != 2*n || sum_free != 2*n){
@@ -357,7 +414,8 @@ void *thread_test2_part3(void *arg)
 	return (void *)invalidations;
 }
 
-int test2(unsigned long cache_size, unsigned long nr_threads)
+int test2(unsigned long cache_size, unsigned long nr_threads,
+		unsigned long nr_shards)
 {
 	struct xcache cache;
 	struct xcache_ops c_ops = {
@@ -375,8 +433,14 @@ int test2(unsigned long cache_size, unsigned long nr_threads)
 	unsigned long invalidations = 0;
 	unsigned long lookups = 0;
 
-	xcache_init(&cache, cache_size, &c_ops, lru, NULL);
+	if (xcache_init_shards(&cache, cache_size, nr_shards, &c_ops, lru,
+				NULL) < 0) {
+		fprintf(stderr, "Could not initialize cache\n");
+		return -1;
+	}
 	n = cache.size;
+	/* six passes of n operations per thread */
+	nr_ops = 6 * nr_threads * n;
 
 	struct thread_arg *targs = malloc(nr_threads * sizeof(struct thread_arg));
 	pthread_t *threads = malloc(nr_threads * sizeof(pthread_t));
@@ -568,7 +632,11 @@ int test2(unsigned long cache_size, unsigned long nr_threads)
 		lookups += (unsigned long)ret;
 	}
 
-	if (lookups != n) {
+	/*
+	 * Only the latest entries are left, unless admission depends on
+	 * their frequency
+	 */
+	if (lookups > n || (lookups != n && !(lru & XCACHE_LRU_TINYLFU))) {
 		fprintf(stderr, "lookups: %lu, expected %lu\n",
 				lookups, n);
 		return -1;
@@ -579,6 +647,7 @@ int test2(unsigned long cache_size, unsigned long nr_threads)
 	free(threads);
 	/* This should do nothing */
 	xcache_close(&cache);
+	xcache_free(&cache);
 
 /*
 	if (sum_put != 2*n || sum_free != 2*n){
@@ -889,7 +958,12 @@ int test3(unsigned long cache_size, unsigned long nr_threads)
 		lookups += (unsigned long)ret;
 	}
 
-	if (lookups != n * nr_threads) {
+	/*
+	 * Only the latest entries are left, unless admission depends on
+	 * their frequency
+	 */
+	if (lookups > n * nr_threads ||
+			(lookups != n * nr_threads && !(lru & XCACHE_LRU_TINYLFU))) {
 		fprintf(stderr, "lookups: %lu, expected %lu\n",
 				lookups, n * nr_threads);
 		return -1;
@@ -913,29 +987,446 @@ int test3(unsigned long cache_size, unsigned long nr_threads)
 	return 0;
 }
 
+/*
+ * Zipf distributed trace over nr_keys names. When scan_every is set, a
+ * sequential scan of scan_len names that are never accessed again is
+ * interleaved every scan_every accesses, like a full volume copy would.
+ */
+char **make_trace(unsigned long len, unsigned long nr_keys,
+		unsigned long scan_every, unsigned long scan_len)
+{
+	char **trace = malloc(len * sizeof(char *));
+	double *cdf = malloc(nr_keys * sizeof(double));
+	double sum = 0, u;
+	unsigned long i, j, lo, hi, scanned = 0;
+	unsigned int seed = 42;
+	char name[XSEG_MAX_TARGETLEN];
+
+	if (!trace || !cdf)
+		return NULL;
+
+	for (i = 0; i < nr_keys; i++) {
+		sum += 1 / pow(i + 1, 0.9);
+		cdf[i] = sum;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (scan_every && i % scan_every == 0) {
+			for (j = 0; j < scan_len && i < len; j++, i++) {
+				sprintf(name, "scan_%lu", scanned++);
+				trace[i] = strdup(name);
+			}
+			if (i == len)
+				break;
+		}
+		u = (double)rand_r(&seed) / RAND_MAX * sum;
+		lo = 0;
+		hi = nr_keys - 1;
+		while (lo < hi) {
+			j = (lo + hi) / 2;
+			if (cdf[j] < u)
+				lo = j + 1;
+			else
+				hi = j;
+		}
+		sprintf(name, "obj_%lu", lo);
+		trace[i] = strdup(name);
+	}
+
+	free(cdf);
+	return trace;
+}
+
+/* one name per line */
+char **read_trace(const char *path, unsigned long *len)
+{
+	FILE *f = fopen(path, "r");
+	char **trace = NULL, **tmp;
+	char name[XSEG_MAX_TARGETLEN + 2];
+	unsigned long n = 0, size = 0;
+
+	if (!f)
+		return NULL;
+	while (fgets(name, sizeof(name), f)) {
+		name[strcspn(name, "\n")] = 0;
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			tmp = realloc(trace, size * sizeof(char *));
+			if (!tmp)
+				break;
+			trace = tmp;
+		}
+		trace[n++] = strdup(name);
+	}
+	fclose(f);
+	*len = n;
+	return trace;
+}
+
+void free_trace(char **trace, unsigned long len)
+{
+	unsigned long i;
+
+	for (i = 0; i < len; i++)
+		free(trace[i]);
+	free(trace);
+}
+
+/* Replay a trace on a cold cache. Return the number of hits. */
+long replay(unsigned long cache_size, uint32_t policy, char **trace,
+		unsigned long len)
+{
+	struct xcache cache;
+	struct xcache_ops c_ops = {
+		.on_init = init,
+		.on_node_init = node_init
+	};
+	xcache_handler h, nh;
+	unsigned long i, hits = 0;
+
+	if (xcache_init(&cache, cache_size, &c_ops, policy, NULL) < 0)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		h = xcache_lookup(&cache, trace[i]);
+		if (h != NoEntry) {
+			hits++;
+			xcache_put(&cache, h);
+			continue;
+		}
+		h = xcache_alloc_init(&cache, trace[i]);
+		if (h == NoEntry){
+			fprintf(stderr, "Could not allocate cache entry\n");
+			return -1;
+		}
+		nh = xcache_insert(&cache, h);
+		if (nh == NoEntry){
+			fprintf(stderr, "Could not insert cache entry\n");
+			return -1;
+		}
+		xcache_put(&cache, h);
+	}
+
+	xcache_close(&cache);
+	xcache_free(&cache);
+	return hits;
+}
+
+int test4(unsigned long cache_size, const char *trace_file)
+{
+	struct {
+		const char *name;
+		uint32_t flags;
+	} policies[] = {
+		{ "array", XCACHE_LRU_ARRAY },
+		{ "heap", XCACHE_LRU_HEAP },
+		{ "list", XCACHE_LRU_LIST },
+		{ "clock", XCACHE_LRU_CLOCK },
+		{ "tinylfu", XCACHE_LRU_TINYLFU },
+	};
+	const char *traces[] = { "zipf", "zipf+scans", trace_file };
+	char **trace;
+	unsigned long len, nr_traces = trace_file ? 3 : 2;
+	unsigned long i, j;
+	long hits;
+
+	for (i = 0; i < nr_traces; i++) {
+		len = 40 * cache_size;
+		if (i == 0)
+			trace = make_trace(len, 16 * cache_size, 0, 0);
+		else if (i == 1)
+			trace = make_trace(len, 16 * cache_size, 8 * cache_size,
+					2 * cache_size);
+		else
+			trace = read_trace(trace_file, &len);
+		if (!trace || !len) {
+			fprintf(stderr, "Could not prepare trace %s\n", traces[i]);
+			return -1;
+		}
+
+		for (j = 0; j < sizeof(policies) / sizeof(policies[0]); j++) {
+			/* the array policy is O(n) per eviction */
+			if (policies[j].flags == XCACHE_LRU_ARRAY && cache_size > 4096)
+				continue;
+			hits = replay(cache_size, policies[j].flags, trace, len);
+			if (hits < 0) {
+				free_trace(trace, len);
+				return -1;
+			}
+			fprintf(stderr, "trace: %-10s policy: %-7s hit ratio: %.2f%%\n",
+					traces[i], policies[j].name,
+					100.0 * hits / len);
+		}
+		free_trace(trace, len);
+	}
+	return 0;
+}
+
+unsigned long sum_evict = 0;
+
+int evict_unsafe(void *c, void *e)
+{
+	sum_evict++;
+	return 0;
+}
+
+/*
+ * Insert 4 x <cache_size> entries of varying cost in a cache whose weight
+ * limit is reached long before its entry limit, and check that the weight
+ * never exceeds it.
+ */
+int test5(unsigned long n)
+{
+	struct xcache cache;
+	struct xcache_ops c_ops = {
+		.on_init = NULL,
+		.on_evict = evict_unsafe,
+		.on_free = free_unsafe,
+		.on_node_init = NULL,
+		.on_put = put_safe
+	};
+	xcache_handler h, nh;
+	char name[XSEG_MAX_TARGETLEN + 1];
+	uint64_t max_weight = 2 * n;
+	unsigned long i, nr_allocs = 0;
+
+	sum_put = 0;
+	sum_free = 0;
+	sum_evict = 0;
+	if (xcache_init_weighted(&cache, n, max_weight, 1, &c_ops, lru,
+				NULL) < 0) {
+		fprintf(stderr, "Could not initialize weighted cache\n");
+		return -1;
+	}
+	n = cache.size;
+
+	for (i = 0; i <= 4 * n; i++) {
+		sprintf(name, "%lu", i);
+		h = xcache_alloc_init(&cache, name);
+		if (h == NoEntry){
+			fprintf(stderr, "Could not allocate cache entry\n");
+			return -1;
+		}
+		nr_allocs++;
+		/* the last one weighs half the cache */
+		nh = xcache_insert_weighted(&cache, h,
+				i < 4 * n ? 1 + i % 7 : max_weight / 2);
+		if (nh == NoEntry){
+			fprintf(stderr, "Could not insert cache entry\n");
+			return -1;
+		} else if (nh != h) {
+			xcache_free_new(&cache, h);
+		}
+		xcache_put(&cache, h);
+
+		if (xcache_weight(&cache) > max_weight) {
+			fprintf(stderr, "Cache weight %llu exceeds %llu\n",
+					(unsigned long long)xcache_weight(&cache),
+					(unsigned long long)max_weight);
+			return -1;
+		}
+	}
+
+	/* evicted to make room, the heavy entry stays if it is the MRU one */
+	if (lru & (XCACHE_LRU_ARRAY | XCACHE_LRU_HEAP | XCACHE_LRU_LIST)) {
+		h = xcache_lookup(&cache, name);
+		if (h == NoEntry){
+			fprintf(stderr, "Heavy entry was evicted\n");
+			return -1;
+		}
+		xcache_put(&cache, h);
+	}
+	if (!sum_evict) {
+		fprintf(stderr, "Weight limit did not evict any entry\n");
+		return -1;
+	}
+
+	xcache_close(&cache);
+	if (xcache_weight(&cache) != 0 || sum_put != nr_allocs ||
+			sum_free != nr_allocs) {
+		fprintf(stderr, "Closed cache weighs %llu, sum_put: %lu, "
+				"sum_free: %lu instead of %lu\n",
+				(unsigned long long)xcache_weight(&cache),
+				sum_put, sum_free, nr_allocs);
+		return -1;
+	}
+	xcache_free(&cache);
+	return 0;
+}
+
+int test6(unsigned long n)
+{
+	struct xcache cache;
+	struct xcache_ops c_ops = {
+		.on_init = NULL,
+		.on_evict = evict_unsafe,
+		.on_free = free_unsafe,
+		.on_node_init = NULL,
+		.on_put = put_safe
+	};
+	xcache_handler h, *held;
+	char name[XSEG_MAX_TARGETLEN + 1];
+	unsigned long i;
+
+	sum_put = 0;
+	sum_free = 0;
+	sum_evict = 0;
+	if (xcache_init(&cache, n, &c_ops, lru | XCACHE_USE_RMTABLE,
+				NULL) < 0) {
+		fprintf(stderr, "Could not initialize cache\n");
+		return -1;
+	}
+	n = cache.size / 2;
+	held = malloc(n * sizeof(xcache_handler));
+	if (!held)
+		return -1;
+
+	/* fill half the cache, keeping a reference to every entry */
+	for (i = 0; i < n; i++) {
+		sprintf(name, "held:%lu", i);
+		h = xcache_alloc_init(&cache, name);
+		if (h == NoEntry || xcache_insert(&cache, h) != h) {
+			fprintf(stderr, "Could not insert cache entry\n");
+			return -1;
+		}
+		held[i] = h;
+	}
+	/* push them out to "rm_entries" */
+	for (i = 0; i < 2 * n; i++) {
+		sprintf(name, "new:%lu", i);
+		h = xcache_alloc_init(&cache, name);
+		if (h == NoEntry || xcache_insert(&cache, h) != h) {
+			fprintf(stderr, "Could not insert cache entry\n");
+			return -1;
+		}
+		xcache_put(&cache, h);
+	}
+	if (sum_evict < n) {
+		fprintf(stderr, "%lu evictions instead of at least %lu\n",
+				sum_evict, n);
+		return -1;
+	}
+
+	/* invalidate half of the evicted entries, then drop them all */
+	for (i = 0; i < n / 2; i++) {
+		sprintf(name, "held:%lu", i);
+		if (xcache_invalidate(&cache, name) < 0) {
+			fprintf(stderr, "Could not invalidate %s\n", name);
+			return -1;
+		}
+	}
+	for (i = 0; i < n; i++)
+		xcache_put(&cache, held[i]);
+	free(held);
+
+	xcache_close(&cache);
+	if (sum_put != 3 * n || sum_free != 3 * n) {
+		fprintf(stderr, "sum_put: %lu, sum_free: %lu instead of %lu\n",
+				sum_put, sum_free, 3 * n);
+		return -1;
+	}
+	xcache_free(&cache);
+	return 0;
+}
+
+int test7(unsigned long n)
+{
+	struct xcache cache;
+	struct xcache_ops c_ops = {
+		.on_init = NULL,
+		.on_evict = evict_unsafe,
+		.on_free = free_unsafe,
+		.on_node_init = NULL,
+		.on_put = put_safe
+	};
+	xcache_handler h;
+	char name[XSEG_MAX_TARGETLEN + 1];
+	unsigned long i, round;
+
+	/*
+	 * Leave hits of a large cache buffered, then free it and use a small
+	 * one at the same address. The old hits must not be merged into it.
+	 */
+	for (round = 0; round < 2; round++) {
+		if (xcache_init(&cache, round ? 16 : n, &c_ops,
+					lru | XCACHE_LOCKFREE_LOOKUP, NULL) < 0) {
+			fprintf(stderr, "Could not initialize cache\n");
+			return -1;
+		}
+		for (i = 0; i < cache.size; i++) {
+			sprintf(name, "%lu", i);
+			h = xcache_alloc_init(&cache, name);
+			if (h == NoEntry) {
+				fprintf(stderr, "Could not allocate cache entry\n");
+				return -1;
+			}
+			if (xcache_insert(&cache, h) != h) {
+				fprintf(stderr, "Could not insert cache entry\n");
+				return -1;
+			}
+			xcache_put(&cache, h);
+		}
+		for (i = cache.size - 8; i < cache.size; i++) {
+			sprintf(name, "%lu", i);
+			h = xcache_lookup(&cache, name);
+			if (h == NoEntry) {
+				fprintf(stderr, "Entry %s not found\n", name);
+				return -1;
+			}
+			xcache_put(&cache, h);
+		}
+		xcache_close(&cache);
+		xcache_free(&cache);
+	}
+	return 0;
+}
+
 void usage()
 {
-	fprintf(stdout, "Usage: ./xcache_test <cache_size> <lru> <nr_threads> <n>\n"
+	fprintf(stdout, "Usage: ./xcache_test <cache_size> <lru> <nr_threads> <n> "
+			"[<trace>]\n"
+			"<lru>: 0 for array, 1 for binary heap, 2 for list, 3 for clock, "
+			"4 for tinylfu,\n\tplus 8 for lock-free lookups, 16 for negative lookup "
+			"filters\n\tand 32 for the table of removed entries\n"
 			"----------------------------------------------------------\n"
 			"[test1]\tLookup in cold cache if any entry is there. There must be "
 			"none.\n\tThen, insert <cache_size> entries in cache and check for "
 			"errors.\n\tLookup these new entries and verify that they're "
-			"in cache.\n\tFinally, close the cache.\n"
+			"in cache, one by one and in batches.\n\tFinally, close the cache.\n"
 			"\n"
 			"[test2]\tCreate <nr_threads> threads and assign the work of test1 "
 			"to them.\n\tThese threads greedily try to compete for every "
 			" xcache_* operation of test1,\n\twhile trying to insert exactly "
 			"the same number of entries.\n\tThe sole synchronization "
 			"between threads are two barriers and some atomic operations,\n\t"
-			"so it is a good indication of how well xcache scales.\n"
+			"so it is a good indication of how well xcache scales.\n\t"
+			"It is repeated for 2 up to <nr_threads> threads and for 1 up to "
+			"16 cache shards,\n\treporting the throughput of each run.\n"
 			"\n"
 			"[test3]\tCreate <nr_threads> threads and order each of them to do "
-			"<n> insertions in cache.\n");
+			"<n> insertions in cache.\n"
+			"\n"
+			"[test4]\tReplay a zipf trace, the same trace interleaved with "
+			"sequential scans\n\tand optionally <trace> (one name per line) "
+			"on every eviction policy,\n\treporting the hit ratio of each.\n"
+			"\n"
+			"[test5]\tInsert entries of varying cost in a weighted cache "
+			"and check that\n\tits weight stays within its limit.\n"
+			"\n"
+			"[test6]\tEvict referenced entries to \"rm_entries\", "
+			"invalidate some of them\n\tand check that all of them are "
+			"freed once put.\n"
+			"\n"
+			"[test7]\tBuffer hits of a lock-free cache, free it and "
+			"initialize a smaller cache\n\tat the same address, which must "
+			"not see them.\n");
 }
 
 int main(int argc, const char *argv[])
 {
 	struct timeval start, end, tv;
+	unsigned long usec;
+	int shards, threads;
 	int r;
 
 	if (argc < 5) {
@@ -949,8 +1440,20 @@ int main(int argc, const char *argv[])
 	int n = atoi(argv[4]);
 
 	lru = XCACHE_LRU_ARRAY;
-	if (lru_type)
+	if ((lru_type & 7) == 1)
 		lru = XCACHE_LRU_HEAP;
+	else if ((lru_type & 7) == 2)
+		lru = XCACHE_LRU_LIST;
+	else if ((lru_type & 7) == 3)
+		lru = XCACHE_LRU_CLOCK;
+	else if ((lru_type & 7) == 4)
+		lru = XCACHE_LRU_TINYLFU;
+	if (lru_type & 8)
+		lru |= XCACHE_LOCKFREE_LOOKUP;
+	if (lru_type & 16)
+		lru |= XCACHE_USE_FILTER;
+	if (lru_type & 32)
+		lru |= XCACHE_USE_RMTABLE;
 
 	fprintf(stderr, "Running test1\n");
 	gettimeofday(&start, NULL);
@@ -965,16 +1468,33 @@ int main(int argc, const char *argv[])
 	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 
 	fprintf(stderr, "running test2\n");
-	gettimeofday(&start, NULL);
-	r = test2(cache_size, t);
-	gettimeofday(&end, NULL);
-	timersub(&end, &start, &tv);
-	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
-	if (r < 0){
-		fprintf(stderr, "test2: failed\n");
-		return -1;
+	/*
+	 * Each shard must see more insertions than it can hold, for the
+	 * eviction counts to match those of an unsharded cache. Hence at
+	 * least two threads, and at least 64 entries per shard.
+	 */
+	for (shards = 1; shards <= 16 && shards * 64 <= cache_size;
+			shards *= 2) {
+		for (threads = (t < 2 ? t : 2); threads <= t; threads *= 2) {
+			gettimeofday(&start, NULL);
+			r = test2(cache_size, threads, threads < 2 ? 1 : shards);
+			gettimeofday(&end, NULL);
+			timersub(&end, &start, &tv);
+			if (r < 0){
+				fprintf(stderr, "test2: failed (shards: %d, "
+						"threads: %d)\n", shards, threads);
+				return -1;
+			}
+			usec = tv.tv_sec * 1000000UL + tv.tv_usec;
+			fprintf(stderr, "shards: %2d, threads: %2d, time: %ds "
+					"%dusec, %lu ops/sec\n", shards, threads,
+					(int)tv.tv_sec, (int)tv.tv_usec,
+					usec ? nr_ops * 1000000UL / usec : 0);
+			if (threads < t && threads * 2 > t)
+				threads = t / 2;
+		}
 	}
-	fprintf(stderr, "test2: PASSED\n");
+	fprintf(stderr, "test2: PASSED\n\n");
 
 	fprintf(stderr, "running test3\n");
 	gettimeofday(&start, NULL);
@@ -987,5 +1507,37 @@ int main(int argc, const char *argv[])
 	timersub(&end, &start, &tv);
 	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 	fprintf(stderr, "test3: PASSED\n");
+
+	fprintf(stderr, "running test4\n");
+	r = test4(cache_size, argc > 5 ? argv[5] : NULL);
+	if (r < 0){
+		fprintf(stderr, "test4: failed\n");
+		return -1;
+	}
+	fprintf(stderr, "test4: PASSED\n");
+
+	fprintf(stderr, "running test5\n");
+	r = test5(cache_size);
+	if (r < 0){
+		fprintf(stderr, "test5: failed\n");
+		return -1;
+	}
+	fprintf(stderr, "test5: PASSED\n");
+
+	fprintf(stderr, "running test6\n");
+	r = test6(cache_size);
+	if (r < 0){
+		fprintf(stderr, "test6: failed\n");
+		return -1;
+	}
+	fprintf(stderr, "test6: PASSED\n");
+
+	fprintf(stderr, "running test7\n");
+	r = test7(cache_size);
+	if (r < 0){
+		fprintf(stderr, "test7: failed\n");
+		return -1;
+	}
+	fprintf(stderr, "test7: PASSED\n");
 	return 0;
 }
@@ -0,0 +1,244 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <xseg/xexec.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define NR_QUEUES 64
+#define MAX_THREADS 16
+
+struct object {
+	struct xworkq wq;
+	unsigned long count;
+	unsigned long next_seq[MAX_THREADS];
+	unsigned long bad;
+};
+
+struct object objects[NR_QUEUES];
+struct xexec ex;
+
+struct job {
+	struct work w;
+	struct object *obj;
+	unsigned long producer;
+	unsigned long seq;
+	unsigned long hops;
+};
+
+void init_objects(void)
+{
+	int i, j;
+	for (i = 0; i < NR_QUEUES; i++) {
+		xworkq_init(&objects[i].wq, NULL, 0);
+		objects[i].count = 0;
+		objects[i].bad = 0;
+		for (j = 0; j < MAX_THREADS; j++) {
+			objects[i].next_seq[j] = 0;
+		}
+	}
+}
+
+unsigned long check_objects(void)
+{
+	unsigned long sum = 0;
+	int i;
+	for (i = 0; i < NR_QUEUES; i++) {
+		if (objects[i].bad) {
+			fprintf(stderr, "object %d: %lu jobs out of order\n",
+					i, objects[i].bad);
+			return 0;
+		}
+		sum += objects[i].count;
+		xworkq_destroy(&objects[i].wq);
+	}
+	return sum;
+}
+
+/* jobs of an object run one at a time, in the order each producer sent them */
+void jobfn(void *q, void *arg)
+{
+	struct job *j = (struct job *)arg;
+	struct object *obj = j->obj;
+
+	if (q != &obj->wq || j->seq != obj->next_seq[j->producer]) {
+		obj->bad++;
+	}
+	obj->next_seq[j->producer]++;
+	obj->count++;
+	free(j);
+}
+
+/* jobs that move on to the next object, from within a worker */
+void hopfn(void *q, void *arg)
+{
+	struct job *j = (struct job *)arg;
+	struct object *obj = j->obj;
+
+	obj->count++;
+	if (!j->hops) {
+		free(j);
+		return;
+	}
+	j->hops--;
+	j->obj = &objects[(obj - objects + 1) % NR_QUEUES];
+	j->w.job_fn = hopfn;
+	j->w.job = j;
+	xexec_enqueue_work(&ex, &j->obj->wq, &j->w);
+}
+
+struct thread_arg {
+	unsigned long id;
+	unsigned long n;
+};
+
+void *thread_test1(void *arg)
+{
+	struct thread_arg *targ = (struct thread_arg *)arg;
+	unsigned long seq[NR_QUEUES] = { 0 };
+	unsigned long i, o;
+	struct job *j;
+
+	for (i = 0; i < targ->n; i++) {
+		o = (i + targ->id) % NR_QUEUES;
+		j = malloc(sizeof(struct job));
+		j->obj = &objects[o];
+		j->producer = targ->id;
+		j->seq = seq[o]++;
+		xexec_enqueue(&ex, &j->obj->wq, jobfn, j);
+	}
+	return NULL;
+}
+
+void *thread_test2(void *arg)
+{
+	struct thread_arg *targ = (struct thread_arg *)arg;
+	unsigned long i;
+	struct job *j;
+
+	for (i = 0; i < targ->n; i++) {
+		j = malloc(sizeof(struct job));
+		j->obj = &objects[(i + targ->id) % NR_QUEUES];
+		j->hops = 9;
+		j->w.job_fn = hopfn;
+		j->w.job = j;
+		xexec_enqueue_work(&ex, &j->obj->wq, &j->w);
+	}
+	return NULL;
+}
+
+int run_threads(void *(*fn)(void *), unsigned long n,
+		unsigned long nr_threads)
+{
+	struct thread_arg *targs = malloc(sizeof(struct thread_arg) * nr_threads);
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	unsigned long i;
+	int r;
+
+	for (i = 0; i < nr_threads; i++) {
+		targs[i].id = i;
+		targs[i].n = n;
+		r = pthread_create(&threads[i], NULL, fn, &targs[i]);
+		if (r) {
+			fprintf(stderr, "error pthread_create\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(targs);
+	free(threads);
+	return 0;
+}
+
+/* producers outside the executor, jobs serialized per object */
+int test1(unsigned long n, unsigned long nr_threads, unsigned long nr_workers)
+{
+	init_objects();
+	if (xexec_init(&ex, nr_workers) < 0) {
+		fprintf(stderr, "xexec_init failed\n");
+		return -1;
+	}
+	if (run_threads(thread_test1, n, nr_threads) < 0) {
+		return -1;
+	}
+	xexec_destroy(&ex);
+
+	return ((check_objects() == n * nr_threads) ? 0 : -1);
+}
+
+/* jobs that make other queues ready from the workers */
+int test2(unsigned long n, unsigned long nr_threads, unsigned long nr_workers)
+{
+	init_objects();
+	if (xexec_init(&ex, nr_workers) < 0) {
+		fprintf(stderr, "xexec_init failed\n");
+		return -1;
+	}
+	if (run_threads(thread_test2, n, nr_threads) < 0) {
+		return -1;
+	}
+	xexec_destroy(&ex);
+
+	return ((check_objects() == 10 * n * nr_threads) ? 0 : -1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct timeval start, end, tv;
+	int r;
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <jobs per thread> <threads> <workers>\n",
+				argv[0]);
+		return -1;
+	}
+	unsigned long n = atol(argv[1]);
+	unsigned long t = atol(argv[2]);
+	unsigned long w = atol(argv[3]);
+	if (t > MAX_THREADS) {
+		t = MAX_THREADS;
+	}
+
+	fprintf(stderr, "running test1\n");
+	gettimeofday(&start, NULL);
+	r = test1(n, t, w);
+	if (r < 0){
+		fprintf(stderr, "test1: failed\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "test1: passed\n");
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	fprintf(stderr, "running test2\n");
+	gettimeofday(&start, NULL);
+	r = test2(n, t, w);
+	if (r < 0){
+		fprintf(stderr, "test2: failed\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "test2: passed\n");
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	return 0;
+}
@@ -25,7 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 xhash_t *my_resize(xhash_t *h, xhashidx sizeshift)
 {
-	ssize_t bytes = xhash_get_alloc_size(sizeshift);
+	ssize_t bytes = xhash_get_alloc_size_flags(sizeshift, h->flags);
 	xhash_t *new = malloc(bytes);
 	if (!new) {
 		perror("malloc");
@@ -59,7 +59,7 @@ int chekck_chunk(char *string, xhashidx s)
 	return 0;
 }
 
-int test_string(xhashidx loops)
+int test_string(xhashidx loops, uint32_t flags)
 {
     xhashidx i, v;
     struct xhash *h;
@@ -78,12 +78,12 @@ int test_string(xhashidx loops)
 	make_chunk(string[i], i);
     }
     
-    h = malloc(xhash_get_alloc_size(2));
+    h = malloc(xhash_get_alloc_size_flags(2, flags));
     if (!h){
         perror("malloc");
 	exit(1);
     }
-    xhash_init(h, 2, 0, XHASH_STRING);
+    xhash_init_flags(h, 2, 0, XHASH_STRING, flags);
     for (i = 10; i < loops; i++) {
 	int ret;
         xhashidx r;
@@ -109,6 +109,14 @@ int test_string(xhashidx loops)
             getchar();
         }
     }
+    for (i = 0; i < loops; i++) {
+        xhashidx hash = xhash_hash(XHASH_STRING, (xhashidx)string[i]);
+        int ret = xhash_lookup_hash(h, (xhashidx)string[i], hash, &v);
+        if ((i >= 10 && (ret || i != v)) || (i < 10 && !ret)) {
+            printf("string hash lookup error in %lu (ret: %d)\n", i, ret);
+            return -1;
+        }
+    }
     for (i = 10; i < loops; i++) {
 	int ret;
         xhashidx r;
@@ -193,6 +201,235 @@ int test_string2()
     return 0;
 }
 
+int test_swiss(xhashidx loops)
+{
+    xhashidx i, v;
+    struct xhash *h;
+    int rr, ret;
+
+    h = malloc(xhash_get_alloc_size_flags(2, XHASH_SWISS));
+    if (!h){
+        perror("malloc");
+	exit(1);
+    }
+    xhash_init_flags(h, 2, 0, XHASH_INTEGER, XHASH_SWISS);
+    for (i = 0; i < loops; i++) {
+        /* aligned keys, as the pointers kept by xobj */
+        rr = xhash_insert(h, i << 12, i);
+	if (rr == -XHASH_ERESIZE){
+		h = my_resize(h, xhash_grow_size_shift(h));
+		rr = xhash_insert(h, i << 12, i);
+	}
+        if (rr != 0) {
+            printf("swiss insert error in %lx\n", i);
+            return -1;
+        }
+    }
+    if (xhash_elements(h) != loops) {
+        printf("swiss elements %lu != %lu\n", xhash_elements(h), loops);
+        return -1;
+    }
+    /* delete every other key, and check that the rest stay reachable */
+    for (i = 0; i < loops; i += 2) {
+        rr = xhash_delete(h, i << 12);
+	if (rr == -XHASH_ERESIZE){
+		h = my_resize(h, xhash_shrink_size_shift(h));
+		rr = xhash_delete(h, i << 12);
+	}
+        if (rr != 0) {
+            printf("swiss delete error in %lx\n", i);
+            return -1;
+        }
+    }
+    for (i = 0; i < loops; i++) {
+        ret = xhash_lookup(h, i << 12, &v);
+        if ((i & 1) && (ret || v != i)) {
+            printf("swiss lookup error in %lx\n", i);
+            return -1;
+        }
+        if (!(i & 1) && !ret) {
+            printf("swiss deleted key %lx found\n", i);
+            return -1;
+        }
+    }
+    /* reinsert over deleted slots and update in place */
+    for (i = 0; i < loops; i += 2) {
+        rr = xhash_insert(h, i << 12, -i);
+	if (rr == -XHASH_ERESIZE){
+		h = my_resize(h, xhash_grow_size_shift(h));
+		rr = xhash_insert(h, i << 12, -i);
+	}
+        if (rr != 0) {
+            printf("swiss reinsert error in %lx\n", i);
+            return -1;
+        }
+    }
+    for (i = 1; i < loops; i += 2) {
+        xhash_update(h, i << 12, -i);
+    }
+    for (i = 0; i < loops; i++) {
+        ret = xhash_lookup(h, i << 12, &v);
+        if (ret || v != -i) {
+            printf("swiss update error in %lx\n", i);
+            return -1;
+        }
+    }
+    if (xhash_elements(h) != loops) {
+        printf("swiss elements %lu != %lu\n", xhash_elements(h), loops);
+        return -1;
+    }
+    free(h);
+
+    return test_string(loops, XHASH_SWISS);
+}
+
+xhash_t *my_resize_incremental(xhash_t *h, xhashidx sizeshift)
+{
+	ssize_t bytes = xhash_get_alloc_size_flags(sizeshift, h->flags);
+	xhash_t *new = malloc(bytes);
+	if (!new) {
+		perror("malloc");
+		exit(1);
+	}
+	free(xhash_reclaim(h));
+	if (!xhash_resize_incremental(h, sizeshift, 0, new)) {
+		printf("incremental resize failed\n");
+		exit(1);
+	}
+	return new;
+}
+
+int check_iterate(xhash_t *h, xhashidx expected)
+{
+	xhash_iter_t it;
+	xhashidx key, val, cnt = 0;
+
+	xhash_iter_init(h, &it);
+	while (xhash_iterate(h, &it, &key, &val)) {
+		if (key != val) {
+			printf("iterate error: %lx != %lx\n", key, val);
+			return -1;
+		}
+		cnt++;
+	}
+	if (cnt != expected) {
+		printf("iterated %lu items instead of %lu\n", cnt, expected);
+		return -1;
+	}
+	return 0;
+}
+
+int test_incremental(xhashidx loops, uint32_t flags)
+{
+	xhashidx i, j, v;
+	struct xhash *h;
+	int rr, migrating = 0;
+
+	h = malloc(xhash_get_alloc_size_flags(2, flags));
+	if (!h){
+		perror("malloc");
+		exit(1);
+	}
+	xhash_init_flags(h, 2, 0, XHASH_INTEGER, flags);
+	for (i = 0; i < loops; i++) {
+		rr = xhash_insert(h, i, i);
+		if (rr == -XHASH_ERESIZE) {
+			h = my_resize_incremental(h, xhash_grow_size_shift(h));
+			rr = xhash_insert(h, i, i);
+		}
+		if (rr != 0) {
+			printf("incremental insert error in %lx\n", i);
+			return -1;
+		}
+		free(xhash_reclaim(h));
+		if (xhash_old(h) && !migrating) {
+			/* all items must be reachable while migrating */
+			migrating = 1;
+			for (j = 0; j <= i; j++) {
+				if (xhash_lookup(h, j, &v) || v != j) {
+					printf("incremental lookup error in %lx\n", j);
+					return -1;
+				}
+			}
+			if (check_iterate(h, i + 1) < 0)
+				return -1;
+		} else if (!xhash_old(h)) {
+			migrating = 0;
+		}
+	}
+	if (xhash_elements(h) != loops || check_iterate(h, loops) < 0) {
+		printf("incremental elements %lu != %lu\n",
+				xhash_elements(h), loops);
+		return -1;
+	}
+	for (i = 0; i < loops; i++) {
+		rr = xhash_delete(h, i);
+		if (rr == -XHASH_ERESIZE) {
+			h = my_resize_incremental(h, xhash_shrink_size_shift(h));
+			rr = xhash_delete(h, i);
+		}
+		if (rr != 0) {
+			printf("incremental delete error in %lx\n", i);
+			return -1;
+		}
+		free(xhash_reclaim(h));
+		if (!xhash_lookup(h, i, &v)) {
+			printf("incremental deleted key %lx found\n", i);
+			return -1;
+		}
+	}
+	if (xhash_elements(h)) {
+		printf("incremental elements %lu after deleting all\n",
+				xhash_elements(h));
+		return -1;
+	}
+	free(xhash_reclaim(h));
+	free(h);
+	return 0;
+}
+
+/* alternating insertions and deletions around a size boundary */
+int test_hysteresis(void)
+{
+	xhashidx i, resizes = 0;
+	struct xhash *h;
+	int rr;
+
+	h = malloc(xhash_get_alloc_size_flags(3, XHASH_SWISS));
+	if (!h){
+		perror("malloc");
+		exit(1);
+	}
+	xhash_init_flags(h, 3, 0, XHASH_INTEGER, XHASH_SWISS);
+	for (i = 0; i < 1000; i++) {
+		xhashidx k, n = (i & 1) ? 3 : 6;
+		for (k = 0; k < 64; k++) {
+			if (k < n) {
+				rr = xhash_insert(h, k, k);
+				if (rr == -XHASH_ERESIZE) {
+					h = my_resize(h, xhash_grow_size_shift(h));
+					rr = xhash_insert(h, k, k);
+					resizes++;
+				}
+			} else {
+				rr = xhash_delete(h, k);
+				if (rr == -XHASH_ERESIZE) {
+					h = my_resize(h, xhash_shrink_size_shift(h));
+					rr = xhash_delete(h, k);
+					resizes++;
+				}
+			}
+		}
+	}
+	free(h);
+	if (resizes > 2) {
+		printf("%lu resizes for alternating insertions and deletions\n",
+				resizes);
+		return -1;
+	}
+	return 0;
+}
+
 //TODO add test for limit
 int main(int argc, char **argv) {
     xhashidx loops, i, v;
@@ -254,8 +491,24 @@ int main(int argc, char **argv) {
         //printf(" ->got(%lx, %lx)\n", i, r);
     }
     free(h);
-    test_string(loops);
+    if (test_string(loops, 0) < 0) {
+        printf("string test failed\n");
+        return -1;
+    }
     test_string2();
+    if (test_swiss(loops) < 0) {
+        printf("swiss test failed\n");
+        return -1;
+    }
+    if (test_incremental(loops, 0) < 0 ||
+        test_incremental(loops, XHASH_SWISS) < 0) {
+        printf("incremental test failed\n");
+        return -1;
+    }
+    if (test_hysteresis() < 0) {
+        printf("hysteresis test failed\n");
+        return -1;
+    }
     printf("test completed successfully\n");
     return 0;
 }
@@ -232,6 +232,94 @@ int get_put_test()
 	return 0;
 }
 
+int trim_test()
+{
+	unsigned long c = 0;
+	struct foo *foo_obj;
+	int r;
+	void **buf;
+	unsigned long i;
+	buf = malloc(sizeof(void *) * allocations);
+	if (!buf) {
+		printf("error malloc\n");
+		return -1;
+	}
+
+	r = xheap_init(heap, size, al_unit, mem);
+	if (r < 0) {
+		printf("error heap_init\n");
+		return -1;
+	}
+
+	xobj_handler_init(&obj_h, mem, FOO_OBJ_H_MAGIC, sizeof(struct foo), heap);
+
+	foo_obj = xobj_get_obj(&obj_h, X_ALLOC);
+	while (foo_obj){
+		buf[c] = foo_obj;
+		c++;
+		foo_obj = xobj_get_obj(&obj_h, X_ALLOC);
+	}
+
+	/* nothing is free, so nothing can be released */
+	r = xobj_trim(&obj_h);
+	if (r != 0) {
+		printf("trimmed %d chunks while all objects are in use\n", r);
+		return -1;
+	}
+
+	/* keep one object in use, so that its chunk survives */
+	for (i = 1; i < c; i++) {
+		xobj_put_obj(&obj_h, buf[i]);
+	}
+	r = xobj_trim(&obj_h);
+	if (r <= 0) {
+		printf("trim released no chunks\n");
+		return -1;
+	}
+	if (obj_h.nr_allocated - obj_h.nr_free != 1) {
+		printf("%lu objects in use after trim instead of 1\n",
+				obj_h.nr_allocated - obj_h.nr_free);
+		return -1;
+	}
+	if (!xobj_check(&obj_h, buf[0])) {
+		printf("object in use was released\n");
+		return -1;
+	}
+
+	xobj_put_obj(&obj_h, buf[0]);
+	r = xobj_trim(&obj_h);
+	if (r != 1 || obj_h.nr_allocated || obj_h.allocated_space) {
+		printf("handler not empty after last trim (r: %d)\n", r);
+		return -1;
+	}
+
+	/* released memory must be reusable */
+	i = 0;
+	foo_obj = xobj_get_obj(&obj_h, X_ALLOC);
+	while (foo_obj){
+		buf[i] = foo_obj;
+		i++;
+		foo_obj = xobj_get_obj(&obj_h, X_ALLOC);
+	}
+	if (i != c) {
+		printf("reallocated %lu instead of expected %lu\n", i, c);
+		return -1;
+	}
+
+	/* automatic trimming must release memory while objects are put */
+	xobj_set_trim_ratio(&obj_h, 50);
+	for (i = 0; i < c; i++) {
+		xobj_put_obj(&obj_h, buf[i]);
+	}
+	if (obj_h.nr_allocated > c / 2) {
+		printf("%lu objects still allocated after automatic trim\n",
+				obj_h.nr_allocated);
+		return -1;
+	}
+
+	free(buf);
+	return 0;
+}
 
 int main(int argc, const char *argv[])
 {
@@ -262,5 +350,11 @@ int main(int argc, const char *argv[])
 	else
 		printf("Threaded test completed\n");
 
+	r = trim_test();
+	if (r < 0)
+		printf("Trim test failed\n");
+	else
+		printf("Trim test completed\n");
+
 	return 0;
 }
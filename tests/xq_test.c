@@ -164,6 +164,44 @@ int basic_sanity_test(struct xq *q) {
     return 0;
 }
 
+/* resize a partly filled queue whose items wrap around its end */
+int resize_test(void) {
+    struct xq xq, big, small;
+    xqindex t, r;
+
+    xq_alloc_empty(&xq, 16);
+    xq_alloc_empty(&big, 64);
+    xq_alloc_empty(&small, 8);
+
+    for (t = 0; t < 12; t += 1) {
+         r = xq_append_tail(&xq, 100 + t);
+         assert(r != Noneidx);
+         r = xq_pop_head(&xq);
+         assert(r == 100 + t);
+    }
+    for (t = 0; t < 8; t += 1) {
+         r = xq_append_tail(&xq, t);
+         assert(r != Noneidx);
+    }
+
+    r = xq_resize(&xq, &big);
+    assert(r == 8);
+    r = xq_resize(&big, &small);
+    assert(r == 8);
+    assert(xq_count(&small) == 8);
+
+    for (t = 0; t < 8; t += 1) {
+         r = xq_pop_head(&small);
+         assert(r == t);
+    }
+    assert(xq_pop_head(&small) == Noneidx);
+
+    xq_free(&xq);
+    xq_free(&big);
+    xq_free(&small);
+    return 0;
+}
+
 struct thread_data {
     long loops;
     struct xq *q;
@@ -331,6 +369,10 @@ int main(int argc, char **argv) {
     if (r) return r;
     printf("basic sanity test complete.\n");
 
+    r = resize_test();
+    if (r) return r;
+    printf("resize test complete.\n");
+
     struct timeval tv0, tv1;
     gettimeofday(&tv0, NULL);
     r = random_test(seed, nr_threads, loops, qsize, q);
@@ -0,0 +1,224 @@
+/*
+Copyright (C) 2010-2014 GRNET S.A.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <xseg/xbinheap.h>
+#include <xseg/xradixheap.h>
+
+/*
+ * Insert n keys in random order, interleaved with extractions, change the key
+ * of some of them and remove others, and check that the remaining nodes come
+ * out in order.
+ */
+int test1(unsigned long n)
+{
+	struct xradixheap h;
+	xradixheap_handler *handlers;
+	xradixheapidx i, r, key, *keys, prev = 0;
+	unsigned long extracted = 0, removed = 0;
+
+	handlers = malloc(sizeof(xradixheap_handler) * n);
+	keys = malloc(sizeof(xradixheapidx) * n);
+	if (xradixheap_init(&h, n, NULL) < 0){
+		fprintf(stderr, "Could not initialize radix heap\n");
+		return -1;
+	}
+	srand(n);
+	for (i = 0; i < n; i++) {
+		/* around a slowly increasing time */
+		keys[i] = i + rand() % 1000;
+		handlers[i] = xradixheap_insert(&h, keys[i], i);
+		if (handlers[i] == NoNode){
+			fprintf(stderr, "Error inserting %llu\n", i);
+			return -1;
+		}
+		/* keys below the last extracted one are raised to it */
+		keys[i] = xradixheap_getkey(&h, handlers[i]);
+		if (keys[i] < prev || keys[i] > i + 1000){
+			fprintf(stderr, "Inserted key %llu became %llu\n", i,
+					keys[i]);
+			return -1;
+		}
+		if (i % 4 == 3) {
+			r = xradixheap_extract(&h);
+			if (keys[r] < prev){
+				fprintf(stderr, "Extracted %llu out of order\n", r);
+				return -1;
+			}
+			prev = keys[r];
+			handlers[r] = NoNode;
+			extracted++;
+		}
+	}
+	for (i = 0; i < n; i += 3) {
+		if (handlers[i] == NoNode)
+			continue;
+		if (i % 2) {
+			xradixheap_remove(&h, handlers[i]);
+			handlers[i] = NoNode;
+			removed++;
+			continue;
+		}
+		key = keys[i] + rand() % 1000;
+		if (xradixheap_increasekey(&h, handlers[i], key) < 0){
+			fprintf(stderr, "Could not increase key of %llu\n", i);
+			return -1;
+		}
+		keys[i] = key;
+		if (xradixheap_getkey(&h, handlers[i]) != key){
+			fprintf(stderr, "getkey: got %llu instead of %llu\n",
+					xradixheap_getkey(&h, handlers[i]), key);
+			return -1;
+		}
+	}
+	while (!xradixheap_empty(&h)) {
+		if (xradixheap_peak(&h) != (r = xradixheap_extract(&h))){
+			fprintf(stderr, "Peaked node was not extracted\n");
+			return -1;
+		}
+		if (keys[r] < prev || handlers[r] == NoNode){
+			fprintf(stderr, "Extracted %llu out of order\n", r);
+			return -1;
+		}
+		prev = keys[r];
+		extracted++;
+	}
+	if (extracted + removed != n){
+		fprintf(stderr, "Extracted %lu and removed %lu of %lu nodes\n",
+				extracted, removed, n);
+		return -1;
+	}
+	xradixheap_free(&h);
+	free(handlers);
+	free(keys);
+	return 0;
+}
+
+/*
+ * An LRU over n entries: on each access of a random entry its key becomes the
+ * current time, and every other access evicts the least recently used entry
+ * and inserts a new one. Run it on both heaps.
+ */
+unsigned long lru_radix(unsigned long n)
+{
+	struct xradixheap h;
+	xradixheap_handler *handlers = malloc(sizeof(xradixheap_handler) * n);
+	xradixheapidx i, e, time = 0;
+	unsigned long sum = 0;
+
+	xradixheap_init(&h, n, NULL);
+	for (i = 0; i < n; i++)
+		handlers[i] = xradixheap_insert(&h, time++, i);
+	srand(n);
+	for (i = 0; i < 10 * n; i++) {
+		e = rand() % n;
+		xradixheap_increasekey(&h, handlers[e], time++);
+		if (i % 2) {
+			e = xradixheap_extract(&h);
+			sum += e;
+			handlers[e] = xradixheap_insert(&h, time++, e);
+		}
+	}
+	xradixheap_free(&h);
+	free(handlers);
+	return sum;
+}
+
+unsigned long lru_bin(unsigned long n)
+{
+	struct xbinheap h;
+	xbinheap_handler *handlers = malloc(sizeof(xbinheap_handler) * n);
+	xbinheapidx i, e, time = 0;
+	unsigned long sum = 0;
+
+	xbinheap_init(&h, n, XBINHEAP_MIN | XBINHEAP_4ARY, NULL);
+	for (i = 0; i < n; i++)
+		handlers[i] = xbinheap_insert(&h, time++, i);
+	srand(n);
+	for (i = 0; i < 10 * n; i++) {
+		e = rand() % n;
+		xbinheap_increasekey(&h, handlers[e], time++);
+		if (i % 2) {
+			e = xbinheap_extract(&h);
+			sum += e;
+			handlers[e] = xbinheap_insert(&h, time++, e);
+		}
+	}
+	xbinheap_free(&h);
+	free(handlers);
+	return sum;
+}
+
+int test2(unsigned long n)
+{
+	struct timeval start, end, tv;
+	unsigned long r1, r2;
+
+	gettimeofday(&start, NULL);
+	r1 = lru_radix(n);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "radix heap: %ds %dusec\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	gettimeofday(&start, NULL);
+	r2 = lru_bin(n);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "4-ary heap: %ds %dusec\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	if (r1 != r2){
+		fprintf(stderr, "Heaps evicted different entries\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+	struct timeval start, end, tv;
+	int r;
+	int n;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: ./xradixheap_test <n>\n");
+		return 1;
+	}
+	n = atoi(argv[1]);
+
+	fprintf(stderr, "Running test1\n");
+	gettimeofday(&start, NULL);
+	r = test1(n);
+	if (r < 0){
+		fprintf(stderr, "Test1: FAILED\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test1: PASSED\n");
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	fprintf(stderr, "Running test2\n");
+	r = test2(n);
+	if (r < 0){
+		fprintf(stderr, "Test2: FAILED\n");
+		return -1;
+	}
+	fprintf(stderr, "Test2: PASSED\n");
+	return 0;
+}
@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <xseg/xlock.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 
 volatile int cond = 0;
@@ -181,6 +182,98 @@ int test3(unsigned long n, unsigned long nr_threads)
 	return ((sum == expected_sum) ? 0 : -1);
 }
 
+/* works released in batches of at most k */
+int test4(unsigned long n, unsigned long k)
+{
+	struct xwaitq wq;
+	unsigned long i, ran = 0;
+	struct work *works = malloc(sizeof(struct work) * n);
+	xwaitq_init(&wq, condfn, NULL, 0);
+	cond = 0;
+	sum = 0;
+	xlock_release(&lock);
+
+	for (i = 0; i < n; i++) {
+		works[i].job_fn = jobfn;
+		works[i].job = (void *)1;
+		xwaitq_enqueue(&wq, &works[i]);
+	}
+	cond = 1;
+	while (ran < n) {
+		i = xwaitq_signal_n(&wq, k);
+		if (!i || i > k || sum != ran + i) {
+			fprintf(stderr, "signal_n ran %lu of %lu works\n", i, k);
+			return -1;
+		}
+		ran += i;
+	}
+
+	free(works);
+	xwaitq_destroy(&wq);
+
+	return ((sum == n)? 0 : -1);
+}
+
+void *thread_wait(void *arg)
+{
+	struct xwaitq *wq = (struct xwaitq *)arg;
+	if (xwaitq_wait(wq, XWAIT_FOREVER) < 0) {
+		return (void *)1;
+	}
+	xlock_acquire(&lock);
+	sum++;
+	xlock_release(&lock);
+	return NULL;
+}
+
+/* threads blocked on the waitq, and a wait that times out */
+int test5(unsigned long nr_threads)
+{
+	struct xwaitq wq;
+	struct timeval start, end, tv;
+	unsigned long i;
+	void *ret;
+	int r = 0;
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	xwaitq_init(&wq, condfn, NULL, 0);
+	cond = 0;
+	sum = 0;
+	xlock_release(&lock);
+
+	gettimeofday(&start, NULL);
+	if (xwaitq_wait(&wq, 20000) != -1) {
+		fprintf(stderr, "wait did not time out\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &tv);
+	if (tv.tv_sec == 0 && tv.tv_usec < 20000) {
+		fprintf(stderr, "wait timed out early\n");
+		return -1;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, thread_wait, &wq)) {
+			fprintf(stderr, "error pthread_create\n");
+			return -1;
+		}
+	}
+	usleep(10000);
+	cond = 1;
+	xwaitq_signal(&wq);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], &ret);
+		if (ret) {
+			r = -1;
+		}
+	}
+
+	free(threads);
+	xwaitq_destroy(&wq);
+
+	return ((!r && sum == nr_threads) ? 0 : -1);
+}
+
 int main(int argc, const char *argv[])
 {
 	struct timeval start, end, tv;
@@ -224,5 +317,29 @@ int main(int argc, const char *argv[])
 	timersub(&end, &start, &tv);
 	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 
+	fprintf(stderr, "running test4\n");
+	gettimeofday(&start, NULL);
+	r = test4(n, 7);
+	if (r < 0){
+		fprintf(stderr, "test4: failed\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "test4: passed\n");
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
+	fprintf(stderr, "running test5\n");
+	gettimeofday(&start, NULL);
+	r = test5(t);
+	if (r < 0){
+		fprintf(stderr, "test5: failed\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "test5: passed\n");
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
 	return 0;
 }
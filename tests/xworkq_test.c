@@ -151,6 +151,38 @@ int test3(unsigned long n, unsigned long nr_threads)
 	return ((sum == expected_sum) ? 0 : -1);
 }
 
+void embedded_jobfn(void *q, void *arg)
+{
+	struct work *w = (struct work *)arg;
+	sum += 1;
+	free(w);
+}
+
+/* works embedded by the caller may be freed by their own job_fn */
+int test4(unsigned long n)
+{
+	struct xworkq wq;
+	struct work *w;
+	unsigned long i;
+	xworkq_init(&wq, &lock, 0);
+	sum = 0;
+	xlock_release(&lock);
+
+	for (i = 0; i < n; i++) {
+		w = malloc(sizeof(struct work));
+		if (!w) {
+			return -1;
+		}
+		w->job_fn = embedded_jobfn;
+		w->job = w;
+		xworkq_enqueue_work(&wq, w);
+	}
+
+	xworkq_destroy(&wq);
+
+	return ((sum == n)? 0 : -1);
+}
+
 int main(int argc, const char *argv[])
 {
 	struct timeval start, end, tv;
@@ -194,5 +226,17 @@ int main(int argc, const char *argv[])
 	timersub(&end, &start, &tv);
 	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
 
+	fprintf(stderr, "running test4\n");
+	gettimeofday(&start, NULL);
+	r = test4(n);
+	if (r < 0){
+		fprintf(stderr, "test4: failed\n");
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "test4: passed\n");
+	timersub(&end, &start, &tv);
+	fprintf(stderr, "Test time: %ds %dusec\n\n", (int)tv.tv_sec, (int)tv.tv_usec);
+
 	return 0;
 }